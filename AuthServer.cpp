@@ -2,22 +2,41 @@
  Authorization Server code for CMPT 276, Spring 2016.
  */
 
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <exception>
 #include <iostream>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include <cpprest/containerstream.h>
 #include <cpprest/http_listener.h>
 #include <cpprest/json.h>
 
 #include <was/common.h>
 #include <was/table.h>
 
+#include "CredentialsCache.h"
+#include "InternalRpc.h"
+#include "JsonBody.h"
+#include "LocalTransport.h"
+#include "PartitionSalt.h"
+#include "SasUtils.h"
+#include "ServerUtils.h"
 #include "TableCache.h"
+#include "TokenCache.h"
+#include "UserProvisioner.h"
+#include "WorkerLauncher.h"
 #include "make_unique.h"
 
 #include "azure_keys.h"
 
+#ifdef COLOCATED
+namespace auth_server {
+#endif
+
 using azure::storage::storage_exception;
 using azure::storage::cloud_table;
 using azure::storage::cloud_table_client;
@@ -50,6 +69,7 @@ using web::json::value;
 
 using web::http::experimental::listener::http_listener;
 
+using prop_vals_t = vector<pair<string,value>>;
 using prop_str_vals_t = vector<pair<string,string>>;
 
 constexpr const char* def_url = "http://localhost:34570";
@@ -64,12 +84,60 @@ const string data_table_name {"DataTable"};
 const string get_read_token_op {"GetReadToken"};
 const string get_update_token_op {"GetUpdateToken"};
 const string get_update_data_op {"GetUpdateData"};
+const string refresh_token_op {"RefreshToken"};
+const string invalidate_credentials_op {"InvalidateCredentialsAdmin"};
+const string get_tokens_op {"GetTokens"};
+const string provision_users_op {"ProvisionUsersAdmin"};
+
+const string token_prop {"token"};
+const string entity_prop {"Entity"};
+const string userid_prop {"Userid"};
+const string permission_prop {"Permission"};
+const string status_prop {"Status"};
+
+const string read_permission {"read"};
+const string update_permission {"update"};
+
+// Most tokens one GetTokens request may ask for
+constexpr std::size_t max_bulk_tokens {1000};
+
+// Most batch writes one ProvisionUsersAdmin request runs at once
+std::size_t provision_parallelism {8};
+
+// Lifetime of the tokens do_get_token() issues
+constexpr std::chrono::hours token_lifetime {24};
+
+/*
+  Longest a sign-on lasts through RefreshToken. A token's start
+  time is its sign-on's, kept by every refresh, and is covered by
+  its signature.
+ */
+constexpr std::chrono::hours max_session_lifetime {24 * 7};
+
+// Tokens start this long before they are issued, for clocks behind ours
+constexpr std::chrono::minutes token_clock_skew {5};
 
 /*
   Cache of opened tables
  */
 TableCache table_cache {};
 
+/*
+  Cache of issued tokens
+ */
+TokenCache token_cache {};
+
+/*
+  Cache of AuthTable entities
+ */
+CredentialsCache credentials_cache {std::chrono::seconds {60}};
+
+/*
+  DataTable's sub-partitions, set by --partition-salt; must match
+  BasicServer's. AuthTable keeps the partitions clients know.
+ */
+PartitionSalt data_salt {};
+
 /*
   Convert properties represented in Azure Storage type
   to prop_str_vals_t type.
@@ -89,46 +157,9 @@ prop_str_vals_t get_string_properties (const table_entity::properties_type& prop
 }
 
 /*
-  Given an HTTP message with a JSON body, return the JSON
-  body as an unordered map of strings to strings.
-
-  Note that all types of JSON values are returned as strings.
-  Use C++ conversion utilities to convert to numbers or dates
-  as necessary.
- */
-unordered_map<string,string> get_json_body(http_request message) {  
-  unordered_map<string,string> results {};
-  const http_headers& headers {message.headers()};
-  auto content_type (headers.find("Content-Type"));
-  if (content_type == headers.end() ||
-      content_type->second != "application/json")
-    return results;
-
-  value json{};
-  message.extract_json(true)
-    .then([&json](value v) -> bool
-          {
-            json = v;
-            return true;
-          })
-    .wait();
-
-  if (json.is_object()) {
-    for (const auto& v : json.as_object()) {
-      if (v.second.is_string()) {
-        results[v.first] = v.second.as_string();
-      }
-      else {
-        results[v.first] = v.second.serialize();
-      }
-    }
-  }
-  return results;
-}
-
-/*
-  Return a token for 24 hours of access to the specified table,
-  for the single entity defind by the partition and row.
+  Return a token for access to the specified table from start
+  until exptime, for the single entity defind by the partition and
+  row.
 
   permissions: A bitwise OR ('|')  of table_shared_access_poligy::permission
     constants.
@@ -142,9 +173,9 @@ unordered_map<string,string> get_json_body(http_request message) {
 pair<status_code,string> do_get_token (const cloud_table& data_table,
                    const string& partition,
                    const string& row,
-                   uint8_t permissions) {
-
-  utility::datetime exptime {utility::datetime::utc_now() + utility::datetime::from_days(1)};
+                   uint8_t permissions,
+                   const utility::datetime& start,
+                   const utility::datetime& exptime) {
   try {
     string limited_access_token {
       data_table.get_shared_access_signature(table_shared_access_policy {
@@ -170,6 +201,107 @@ pair<status_code,string> do_get_token (const cloud_table& data_table,
   }
 }
 
+/*
+  Put the credentials of userid into credentials, from
+  credentials_cache if they were read recently, else from AuthTable.
+
+  Returns NotFound if the user has no AuthTable entity.
+ */
+status_code get_credentials (const string& userid, credentials_t& credentials) {
+  if (credentials_cache.lookup(userid, credentials))
+    return status_codes::OK;
+
+  table_operation retrieve_operation {table_operation::retrieve_entity(auth_table_userid_partition, userid)};
+  table_result retrieve_result {table_cache.lookup_table(auth_table_name).execute(retrieve_operation)};
+  cout << "Retrieve User id HTTP code is: " << retrieve_result.http_status_code() << endl;
+  if (retrieve_result.http_status_code() != status_codes::OK)
+    return retrieve_result.http_status_code();
+
+  credentials = credentials_t {};
+  for (const auto v : get_string_properties(retrieve_result.entity().properties())) {
+    if (v.first == auth_table_password_prop)
+      credentials.password = v.second;
+    else if (v.first == auth_table_partition_prop)
+      credentials.partition = v.second;
+    else if (v.first == auth_table_row_prop)
+      credentials.row = v.second;
+  }
+  credentials_cache.store(userid, credentials);
+  return status_codes::OK;
+}
+
+/*
+  Issue a new token as do_get_token() does and cache it,
+  replacing any cached token for the same entity and permissions.
+ */
+pair<status_code,string> issue_token (const string& table_name,
+                                      const string& partition,
+                                      const string& row,
+                                      uint8_t permissions) {
+  // Taken before the token's expiry is, so the cache never outlives it
+  const auto issued = std::chrono::steady_clock::now();
+  const utility::datetime now {utility::datetime::utc_now()};
+  pair<status_code,string> token_obj {
+    do_get_token(table_cache.lookup_table(table_name), partition, row, permissions,
+                 now - utility::datetime::from_minutes(token_clock_skew.count()),
+                 now + utility::datetime::from_hours(token_lifetime.count()))};
+  if (token_obj.first == status_codes::OK)
+    token_cache.store(table_name, partition, row, permissions, token_obj.second, issued, token_lifetime);
+  else
+    token_cache.release(table_name, partition, row, permissions);
+  return token_obj;
+}
+
+/*
+  Return a token for the entity with the given permissions, from
+  token_cache if it holds one with enough life left, otherwise
+  newly issued. A cached token due for replacement is returned
+  while its replacement is issued in the background.
+ */
+pair<status_code,string> get_token (const string& table_name,
+                                    const string& partition,
+                                    const string& row,
+                                    uint8_t permissions) {
+  string token;
+  bool refresh;
+  if (token_cache.lookup(table_name, partition, row, permissions, token, refresh)) {
+    if (refresh) {
+      pplx::create_task([table_name, partition, row, permissions] () {
+          issue_token(table_name, partition, row, permissions);
+        });
+    }
+    return make_pair(status_codes::OK, token);
+  }
+  return issue_token(table_name, partition, row, permissions);
+}
+
+/*
+  Return the status and token a GetReadToken or GetUpdateToken
+  request for userid with password would get, and put the user's
+  credentials into credentials.
+ */
+pair<status_code,string> get_user_token (const string& userid, const string& password, uint8_t permissions,
+                                         credentials_t& credentials) {
+  if (password == "" ||
+      std::any_of(password.begin(), password.end(), [] (char c) { return (int)c > 127 || (int)c < 0; }))
+    return make_pair(status_codes::BadRequest, string{});
+
+  status_code credentials_status {get_credentials(userid, credentials)};
+  if (credentials_status != status_codes::OK)
+    return make_pair(credentials_status, string{});
+  if (credentials.partition == "" || credentials.row == "")
+    return make_pair(status_codes::BadRequest, string{});
+  if (credentials.password == "" || credentials.password != password)
+    return make_pair(status_codes::NotFound, string{});
+  return get_token(data_table_name, data_salt.salt(credentials.partition, credentials.row),
+                   credentials.row, permissions);
+}
+
+pair<status_code,string> get_user_token (const string& userid, const string& password, uint8_t permissions) {
+  credentials_t credentials;
+  return get_user_token(userid, password, permissions, credentials);
+}
+
 /*
   Top-level routine for processing all HTTP GET requests.
  */
@@ -186,93 +318,92 @@ void handle_get(http_request message) {
   // Our extensions =================================================================================================================
   
   unordered_map<string,string> json_body {get_json_body (message)};
-  cloud_table table {table_cache.lookup_table(auth_table_name)};
+
+  /*
+    RefreshToken/<userid> with the user's current update token as
+    {"token": ...}: issue a fresh update token for the same entity,
+    without the password, provided the current one is genuine,
+    unexpired and for that user's entity. The fresh token keeps the
+    current one's start time, so no chain of refreshes outlives
+    max_session_lifetime; after that the user must give the
+    password again.
+   */
+  if(paths[0] == refresh_token_op){
+    auto old_token = json_body.find(token_prop);
+    if(json_body.size() != 1 || old_token == json_body.end()){
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+    credentials_t credentials;
+    status_code credentials_status {get_credentials(paths[1], credentials)};
+    if (credentials_status != status_codes::OK) { //user account not found
+      message.reply(credentials_status);
+      return;
+    }
+    const string StoredPart {data_salt.salt(credentials.partition, credentials.row)};
+    const string& RowName {credentials.row};
+
+    const uint8_t update_permissions = table_shared_access_policy::permissions::read | table_shared_access_policy::permissions::update;
+    const utility::datetime now {utility::datetime::utc_now()};
+    const auto max_session = utility::datetime::from_hours(max_session_lifetime.count());
+    sas_token_t sas {};
+    if(!parse_sas_token(old_token->second, sas) ||
+       !sas_renewable(sas, StoredPart, RowName, update_permissions, now, max_session) ||
+       !verify_sas_signature(table_cache.lookup_table(data_table_name), sas)){
+      cout << "Refusing to refresh token" << endl;
+      message.reply(status_codes::Forbidden);
+      return;
+    }
+
+    // Not cached: it may end early, at the end of the sign-on
+    utility::datetime exptime {now + utility::datetime::from_hours(token_lifetime.count())};
+    if(sas.start.to_interval() + max_session < exptime.to_interval())
+      exptime = sas.start + max_session;
+    pair<status_code,string> token_obj {
+      do_get_token(table_cache.lookup_table(data_table_name), StoredPart, RowName, update_permissions,
+                   sas.start, exptime)};
+    if(token_obj.first == status_codes::OK){
+      message.reply(token_obj.first, value::object(vector<pair<string,value>>{make_pair(token_prop, value::string(token_obj.second))}));
+    }
+    else{
+      message.reply(token_obj.first);
+    }
+    return;
+  }
 
   //getting token
   if(paths[0] == get_read_token_op || paths[0] == get_update_token_op || paths[0] == get_update_data_op){
-  	if(json_body.size() == 1){ //only execute if there's only 1 password given
-  		string GivenPass;
-  		for(const auto v : json_body) { //stores password
-  			GivenPass = string(v.second);
-    	}
-    	//check if there's a given password
-      	if(GivenPass == ""){
-      		cout << "Invalid password" << endl;
-      		message.reply(status_codes::BadRequest);
-      		return;
-      	}
-        for(int i=0; i<GivenPass.size() ;i++){
-          if((int)GivenPass[i] > 127 || (int)GivenPass[i] < 0){
-            cout << "Invalid password" << endl;
-            message.reply(status_codes::BadRequest);
-            return;
-          }
-        }
-    	cout << "The Given Password is: " << GivenPass << endl;
-    	//here we'll check if such user account exists by searching through the AuthTable
-      table_operation retrieve_operation {table_operation::retrieve_entity(auth_table_userid_partition, paths[1])};
-      table_result retrieve_result {table.execute(retrieve_operation)};
-      cout << "Retrieve User id HTTP code is: " << retrieve_result.http_status_code() << endl;
-      if (retrieve_result.http_status_code() == status_codes::NotFound) { //user account not found
-        message.reply(status_codes::NotFound);
+    if(json_body.size() == 1){ //only execute if there's only 1 password given
+      const string GivenPass {json_body.begin()->second};
+      const uint8_t permissions = paths[0] == get_read_token_op ?
+        table_shared_access_policy::permissions::read :
+        table_shared_access_policy::permissions::read | table_shared_access_policy::permissions::update;
+      credentials_t credentials;
+      pair<status_code,string> token_obj {get_user_token(paths[1], GivenPass, permissions, credentials)};
+      if(token_obj.first != status_codes::OK){
+        cout << "getting token failed!" << endl;
+        message.reply(token_obj.first);
         return;
       }
-      //set up to scan through properties of useraccount
-      table_entity entity {retrieve_result.entity()};
-      table_entity::properties_type properties {entity.properties()};
-      string PartName;
-      string RowName;
-      bool CorrectPass {false};
-      for(const auto v: properties){ //scan through properties
-        if(v.first == auth_table_password_prop && string(v.second.string_value()) == GivenPass){
-          cout << "Monkey entered correct password!" << endl;
-          CorrectPass= true;
-        }
-        else if(v.first == auth_table_row_prop){
-          RowName = string(v.second.string_value());
-          cout << "Row is: " << RowName << endl;
-        }
-        else if(v.first == auth_table_partition_prop){
-          PartName = string(v.second.string_value());
-          cout << "Partition is: " << PartName << endl;
-        }
-      }
-      if(PartName == "" || RowName == ""){ //check if account has parrtition and row
-      	cout << "Bad account" << endl;
-      	message.reply(status_codes::BadRequest);
-      	return;
-      }
-      if(CorrectPass){//corect password!
-      	cout << "getting token..." << endl;
-      	pair<status_code,string> token_obj;
-      	//getting requested token, either read only or read and update
-      	if(paths[0] == get_read_token_op){ //get read token
-      		token_obj = do_get_token(table_cache.lookup_table(data_table_name), PartName, RowName, table_shared_access_policy::permissions::read);
-      	}
-      	else{ //get update token
-      		token_obj = do_get_token(table_cache.lookup_table(data_table_name), PartName, RowName, table_shared_access_policy::permissions::read | table_shared_access_policy::permissions::update);
-      	}
-        if(token_obj.first == status_codes::OK){
-        	cout << "getting token success!" << endl;
-        	if(paths[0] == get_update_data_op){
-        		//get update token with data!!!
-        		message.reply(token_obj.first, value::object(vector<pair<string,value>>{make_pair("token", value::string(token_obj.second)), make_pair(auth_table_partition_prop, value::string(PartName)),  make_pair(auth_table_row_prop, value::string(RowName))}));
-        	}
-        	else{
-        		message.reply(token_obj.first, value::object(vector<pair<string,value>>{make_pair("token", value::string(token_obj.second))}));
-        	}
-          return;
-        }
-        else{
-        	cout << "getting token failed!" << endl;
-        	message.reply(token_obj.first);
+      if(paths[0] == get_update_data_op){
+        //get update token with data, plus the entity itself so the caller needn't read it
+        const string& PartName {credentials.partition};
+        const string& RowName {credentials.row};
+        table_operation data_operation {table_operation::retrieve_entity(data_salt.salt(PartName, RowName), RowName)};
+        table_result data_result {table_cache.lookup_table(data_table_name).execute(data_operation)};
+        if(data_result.http_status_code() != status_codes::OK){
+          cout << "User's entity not found" << endl;
+          message.reply(status_codes::NotFound);
           return;
         }
+        value entity {value::object(get_properties(data_result.entity().properties()))};
+        message.reply(token_obj.first, value::object(vector<pair<string,value>>{make_pair(token_prop, value::string(token_obj.second)), make_pair(auth_table_partition_prop, value::string(PartName)),  make_pair(auth_table_row_prop, value::string(RowName)), make_pair(entity_prop, entity)}));
+      }
+      else{
+        message.reply(token_obj.first, value::object(vector<pair<string,value>>{make_pair("token", value::string(token_obj.second))}));
       }
-      //bad password!!!
-      message.reply(status_codes::NotFound);
       return;
-  	}
+    }
   }
 
   //invalid command entered!!!
@@ -281,12 +412,164 @@ void handle_get(http_request message) {
   // End of our extensions =================================================================================================================
 }
 
+/*
+  ProvisionUsersAdmin: create the users listed in the body, one
+  JSON object per line:
+    {"Userid": ..., "Password": ..., "DataPartition": ..., "DataRow": ...}
+
+  The body is read a line at a time as it arrives and the users
+  written a chunk at a time, so the list can be arbitrarily long.
+  Replies with the UserProvisioner report of what was created and
+  which lines or rows failed.
+ */
+void provision_users(http_request message) {
+  UserProvisioner provisioner {table_cache.lookup_table(auth_table_name),
+                               table_cache.lookup_table(data_table_name),
+                               data_salt,
+                               provision_parallelism,
+                               [] (const string& userid) {
+                                 credentials_cache.invalidate(userid);
+                               }};
+  concurrency::streams::istream body {message.body()};
+  std::size_t line_number {0};
+  while (true) {
+    concurrency::streams::container_buffer<string> line_buffer {};
+    body.read_line(line_buffer).get();
+    const string& line = line_buffer.collection();
+    ++line_number;
+    if (line.find_first_not_of(" \t\r") != string::npos) {
+      value user {};
+      try {
+        user = value::parse(line);
+      }
+      catch (const web::json::json_exception&) {}
+
+      user_record_t record {};
+      if (user.is_object()) {
+        const auto& o = user.as_object();
+        auto u (o.find(userid_prop));
+        auto p (o.find(auth_table_password_prop));
+        auto dp (o.find(auth_table_partition_prop));
+        auto dr (o.find(auth_table_row_prop));
+        if (u != o.end() && u->second.is_string()) record.userid = u->second.as_string();
+        if (p != o.end() && p->second.is_string()) record.password = p->second.as_string();
+        if (dp != o.end() && dp->second.is_string()) record.partition = dp->second.as_string();
+        if (dr != o.end() && dr->second.is_string()) record.row = dr->second.as_string();
+      }
+      if (record.userid == "" || record.password == "" || record.partition == "" || record.row == "")
+        provisioner.reject(std::to_string(line_number), "Not a user with Userid, Password, DataPartition and DataRow");
+      else
+        provisioner.add(record);
+    }
+    if (body.is_eof())
+      break;
+  }
+
+  try {
+    value report {provisioner.finish()};
+    message.reply(status_codes::OK, report);
+  }
+  catch (const storage_exception& e) {
+    cout << "Azure Table Storage error: " << e.what() << endl;
+    message.reply(status_codes::InternalError);
+  }
+}
+
 /*
   Top-level routine for processing all HTTP POST requests.
  */
 void handle_post(http_request message) {
   string path {uri::decode(message.relative_uri().path())};
   cout << endl << "**** POST " << path << endl;
+  auto paths = uri::split_path(path);
+
+  if (paths.size() == 1 && paths[0] == provision_users_op) {
+    provision_users(message);
+    return;
+  }
+
+  /*
+    GetTokens with a JSON array of
+      {"Userid": ..., "Password": ..., "Permission": "read" or "update"}
+    returns an array, in the same order, of
+      {"Userid": ..., "Status": <code>, "token": ...}
+    where Status and token are what GetReadToken or GetUpdateToken
+    would have returned for that user. The users are looked up
+    concurrently.
+   */
+  if (paths.size() != 1 || paths[0] != get_tokens_op) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
+
+  value requests {};
+  try {
+    requests = message.extract_json(true).get();
+  }
+  catch (const web::json::json_exception&) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
+  if (!requests.is_array() || requests.size() > max_bulk_tokens) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
+  if (requests.size() == 0) {
+    message.reply(status_codes::OK, value::array());
+    return;
+  }
+
+  vector<pplx::task<value>> lookups {};
+  for (const auto& r : requests.as_array()) {
+    string userid;
+    string password;
+    string permission;
+    if (r.is_object()) {
+      const auto& o = r.as_object();
+      auto u (o.find(userid_prop));
+      auto p (o.find(auth_table_password_prop));
+      auto m (o.find(permission_prop));
+      if (u != o.end() && u->second.is_string()) userid = u->second.as_string();
+      if (p != o.end() && p->second.is_string()) password = p->second.as_string();
+      if (m != o.end() && m->second.is_string()) permission = m->second.as_string();
+    }
+
+    lookups.push_back(pplx::create_task([userid, password, permission] () {
+          pair<status_code,string> token_obj {status_codes::BadRequest, string{}};
+          try {
+            if (userid != "" && permission == read_permission)
+              token_obj = get_user_token(userid, password, table_shared_access_policy::permissions::read);
+            else if (userid != "" && permission == update_permission)
+              token_obj = get_user_token(userid, password, table_shared_access_policy::permissions::read | table_shared_access_policy::permissions::update);
+          }
+          catch (const storage_exception& e) {
+            cout << "Azure Table Storage error: " << e.what() << endl;
+            token_obj.first = status_codes::InternalError;
+          }
+          catch (const std::exception& e) {
+            cout << "GetTokens error for " << userid << ": " << e.what() << endl;
+            token_obj.first = status_codes::InternalError;
+          }
+
+          vector<pair<string,value>> result {make_pair(userid_prop, value::string(userid)),
+                                             make_pair(status_prop, value::number(token_obj.first))};
+          if (token_obj.first == status_codes::OK)
+            result.push_back(make_pair(token_prop, value::string(token_obj.second)));
+          return value::object(result);
+        }));
+  }
+
+  // Task-based, so the client gets a reply even if a lookup threw
+  pplx::when_all(lookups.begin(), lookups.end())
+    .then([message] (pplx::task<vector<value>> lookups_done) {
+        try {
+          message.reply(status_codes::OK, value::array(lookups_done.get()));
+        }
+        catch (...) {
+          cout << "GetTokens failed" << endl;
+          message.reply(status_codes::InternalError);
+        }
+      });
 }
 
 /*
@@ -303,6 +586,25 @@ void handle_put(http_request message) {
 void handle_delete(http_request message) {
   string path {uri::decode(message.relative_uri().path())};
   cout << endl << "**** DELETE " << path << endl;
+  auto paths = uri::split_path(path);
+  // Need at least an operation and userid
+  if (paths.size() < 2) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
+
+  /*
+    InvalidateCredentialsAdmin/<userid>: forget the user's cached
+    AuthTable entity, for use after the entity is changed or deleted.
+    Succeeds whether or not anything was cached.
+   */
+  if (paths[0] == invalidate_credentials_op) {
+    credentials_cache.invalidate(paths[1]);
+    message.reply(status_codes::OK);
+    return;
+  }
+
+  message.reply(status_codes::BadRequest);
 }
 
 /*
@@ -322,23 +624,61 @@ void handle_delete(http_request message) {
   
   Wait for a carriage return, then shut the server down.
  */
+#ifdef COLOCATED
+int run (int argc, char const * argv[]) {
+#else
 int main (int argc, char const * argv[]) {
+#endif
+  // Clients know only the first worker's address, and
+  // InvalidateCredentialsAdmin must reach the one credentials
+  // cache, so it runs as one worker
+  WorkerLauncher launcher {false};
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (launcher.parse_option(argv[i], argv[i+1]))
+      continue;
+    else if (string(argv[i]) == "--token-min-life")
+      token_cache.set_min_life(std::stod(argv[i+1]));
+    else if (string(argv[i]) == "--credentials-ttl")
+      credentials_cache.set_ttl(std::chrono::seconds {std::stol(argv[i+1])});
+    else if (string(argv[i]) == "--provision-parallelism")
+      provision_parallelism = std::stoul(argv[i+1]);
+    else if (string(argv[i]) == "--partition-salt")
+      data_salt.set_sub_partitions(std::stoul(argv[i+1]));
+  }
+  launcher.start();
+
   cout << "AuthServer: Parsing connection string" << endl;
   table_cache.init (storage_connection_string);
 
   cout << "AuthServer: Opening listener" << endl;
-  http_listener listener {def_url};
+  http_listener listener {launcher.url(def_url)};
   listener.support(methods::GET, &handle_get);
-  //listener.support(methods::POST, &handle_post);
+  listener.support(methods::POST, &handle_post);
   //listener.support(methods::PUT, &handle_put);
-  //listener.support(methods::DEL, &handle_delete);
+  listener.support(methods::DEL, &handle_delete);
   listener.open().wait(); // Wait for listener to complete starting
-
-  cout << "Enter carriage return to stop AuthServer." << endl;
-  string line;
-  getline(std::cin, line);
+#ifdef COLOCATED
+  register_local_service(launcher.url(def_url), methods::GET, &handle_get);
+  register_local_service(launcher.url(def_url), methods::POST, &handle_post);
+  register_local_service(launcher.url(def_url), methods::DEL, &handle_delete);
+#endif
+  auto rpc_server (open_rpc_server(launcher.url(def_url), rpc_handlers_t {
+      {methods::GET, &handle_get},
+      {methods::POST, &handle_post},
+      {methods::DEL, &handle_delete}}));
+
+  if (launcher.worker() == 0)
+    cout << "Enter carriage return to stop AuthServer." << endl;
+  launcher.wait_for_stop();
 
   // Shut it down
   listener.close().wait();
+  rpc_server.reset();
+  launcher.stop();
   cout << "AuthServer closed" << endl;
+  return 0;
+}
+
+#ifdef COLOCATED
 }
+#endif
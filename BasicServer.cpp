@@ -20,18 +20,26 @@
 #include <was/storage_account.h>
 #include <was/table.h>
 
+#include "InternalRpc.h"
+#include "JsonBody.h"
+#include "LocalTransport.h"
+#include "PartitionSalt.h"
 #include "TableCache.h"
+#include "WorkerLauncher.h"
 #include "make_unique.h"
 
 #include "azure_keys.h"
 #include "ServerUtils.h"
 
+#ifdef COLOCATED
+namespace basic_server {
+#endif
+
 using azure::storage::cloud_storage_account;
 using azure::storage::storage_credentials;
 using azure::storage::storage_exception;
 using azure::storage::cloud_table;
 using azure::storage::cloud_table_client;
-using azure::storage::edm_type;
 using azure::storage::entity_property;
 using azure::storage::table_entity;
 using azure::storage::table_operation;
@@ -77,6 +85,8 @@ const string update_property {"UpdatePropertyAdmin"};
 const string read_entity{"ReadEntityAdmin"};
 const string read_entity_auth{"ReadEntityAuth"};
 const string update_entity_auth {"UpdateEntityAuth"};
+
+const string data_table_name {"DataTable"};
 // End of our extensions =================================================================================================================
 
 /*
@@ -85,34 +95,14 @@ const string update_entity_auth {"UpdateEntityAuth"};
 TableCache table_cache {};
 
 /*
-  Convert properties represented in Azure Storage type
-  to prop_vals_t type.
+  DataTable's sub-partitions, set by --partition-salt. Other
+  tables are stored as addressed.
  */
-prop_vals_t get_properties (const table_entity::properties_type& properties, prop_vals_t values = prop_vals_t {}) {
-  for (const auto v : properties) {
-    if (v.second.property_type() == edm_type::string) {
-      values.push_back(make_pair(v.first, value::string(v.second.string_value())));
-    }
-    else if (v.second.property_type() == edm_type::datetime) {
-      values.push_back(make_pair(v.first, value::string(v.second.str())));
-    }
-    else if(v.second.property_type() == edm_type::int32) {
-      values.push_back(make_pair(v.first, value::number(v.second.int32_value())));      
-    }
-    else if(v.second.property_type() == edm_type::int64) {
-      values.push_back(make_pair(v.first, value::number(v.second.int64_value())));      
-    }
-    else if(v.second.property_type() == edm_type::double_floating_point) {
-      values.push_back(make_pair(v.first, value::number(v.second.double_value())));      
-    }
-    else if(v.second.property_type() == edm_type::boolean) {
-      values.push_back(make_pair(v.first, value::boolean(v.second.boolean_value())));      
-    }
-    else {
-      values.push_back(make_pair(v.first, value::string(v.second.str())));
-    }
-  }
-  return values;
+PartitionSalt data_salt {};
+const PartitionSalt no_salt {};
+
+const PartitionSalt& salt_for (const string& table_name) {
+  return table_name == data_table_name ? data_salt : no_salt;
 }
 
 /*
@@ -124,55 +114,17 @@ bool has_json_body (http_request message) {
   return message.headers()["Content-type"] == "application/json";
 }
 
-/*
-  Given an HTTP message with a JSON body, return the JSON
-  body as an unordered map of strings to strings.
-
-  If the message has no JSON body, return an empty map.
-
-  THIS ROUTINE CAN ONLY BE CALLED ONCE FOR A GIVEN MESSAGE
-  (see http://microsoft.github.io/cpprestsdk/classweb_1_1http_1_1http__request.html#ae6c3d7532fe943de75dcc0445456cbc7
-  for source of this limit).
-
-  Note that all types of JSON values are returned as strings.
-  Use C++ conversion utilities to convert to numbers or dates
-  as necessary.
- */
-unordered_map<string,string> get_json_body(http_request message) {  
-  unordered_map<string,string> results {};
-  const http_headers& headers {message.headers()};
-  auto content_type (headers.find("Content-Type"));
-  if (content_type == headers.end() ||
-      content_type->second != "application/json")
-    return results;
-
-  value json{};
-  message.extract_json(true)
-    .then([&json](value v) -> bool
-	  {
-            json = v;
-	    return true;
-	  })
-    .wait();
-
-  if (json.is_object()) {
-    for (const auto& v : json.as_object()) {
-      if (v.second.is_string()) {
-	results[v.first] = v.second.as_string();
-      }
-      else {
-	results[v.first] = v.second.serialize();
-      }
-    }
-  }
-  return results;
-}
-
 /*
   Top-level routine for processing all HTTP GET requests.
 
   GET is the only request that has no command. All
   operands specify the value(s) to be retrieved.
+
+  Binary properties come back as base64 text, each followed by a
+  "<name>@odata.type": "Edm.Binary" property, as in Azure's own
+  JSON format. Since UserServer began storing Friends in binary,
+  a user entity read here carries both; the text form of the list
+  is only served by UserServer's ReadFriendList.
  */
 void handle_get(http_request message) { 
   string path {uri::decode(message.relative_uri().path())};
@@ -188,17 +140,14 @@ void handle_get(http_request message) {
   }
 
   cloud_table table {table_cache.lookup_table(paths[1])};
-  if ( ! table.exists()) {
-    message.reply(status_codes::NotFound);
-    return;
-  }
+  const PartitionSalt& salt (salt_for(paths[1]));
 
   // Our extensions =================================================================================================================
 
-  //GET entity with authorization
+  //GET entity with authorization; the token is checked before any storage call
   if(paths[0] == read_entity_auth){
     //using the read_with_token from ServerUtils
-  	pair<status_code,table_entity> stat_and_entity {read_with_token(message, tables_endpoint)};
+  	pair<status_code,table_entity> stat_and_entity {read_with_token(message, table_cache, salt)};
   	if(stat_and_entity.first == status_codes::OK){ //making sure the request is good!
   		table_entity entity {stat_and_entity.second};
   		table_entity::properties_type properties {entity.properties()};
@@ -213,6 +162,12 @@ void handle_get(http_request message) {
     //request was bad!
     else
       message.reply(stat_and_entity.first);
+    return;
+  }
+
+  if ( ! table.exists()) {
+    message.reply(status_codes::NotFound);
+    return;
   }
 
   //GET all entities containing all specified properties
@@ -244,10 +199,10 @@ void handle_get(http_request message) {
   		const table_entity::properties_type& properties = it->properties();
 
   		for(const auto v : properties){ //traverse all properties of the item
-  			cout << "Property: " << v.first << " Value: " << string(v.second.string_value()) << endl; //tracing can comment out
+  			cout << "Property: " << v.first << " Value: " << v.second.str() << endl; //tracing can comment out
 
   			for(i=0; i<json_body.size(); i++){
-  				if(prop[i] == v.first && prop_vals[i] == string(v.second.string_value())){ //increment if property name and value are good
+  				if(prop[i] == v.first && prop_vals[i] == v.second.str()){ //increment if property name and value are good
   					counter++;
   				}
 
@@ -260,7 +215,7 @@ void handle_get(http_request message) {
   		if(counter == json_body.size()){ //add into key_vec if counter is the same as the json_body
   			cout << "ACCEPTED Key: " << it->partition_key() << " / " << it->row_key() << endl;
   			prop_vals_t keys{
-			  make_pair("Partition",value::string(it->partition_key())),
+			  make_pair("Partition",value::string(salt.unsalt(it->partition_key()))),
 			  make_pair("Row", value::string(it->row_key())) };
   			keys = get_properties(it->properties(), keys);
       		key_vec.push_back(value::object(keys));
@@ -283,7 +238,7 @@ void handle_get(http_request message) {
     while (it != end) {
       cout << "Key: " << it->partition_key() << " / " << it->row_key() << endl;
       prop_vals_t keys {
-	make_pair("Partition",value::string(it->partition_key())),
+	make_pair("Partition",value::string(salt.unsalt(it->partition_key()))),
 	make_pair("Row", value::string(it->row_key()))};
       keys = get_properties(it->properties(), keys);
       key_vec.push_back(value::object(keys));
@@ -301,36 +256,40 @@ void handle_get(http_request message) {
   // Our extensions =================================================================================================================
 
   // GET all entities from a specific partition.
-  // Code is almost the same as get all but we apply a query filter
-
+  // Each of its stored partitions is queried in parallel and the results merged
   if (paths[3] == "*") {
-	  table_query query{};
-	  table_query_iterator end;
-
-	  //applying filter here
-	  query.set_filter_string(azure::storage::table_query::generate_filter_condition(U("PartitionKey"), azure::storage::query_comparison_operator::equal, U(paths[2]))); 
-	  table_query_iterator it = table.execute_query(query);
-	  vector<value> key_vec;
-
-	  while (it != end) {
-		  cout << "Key: " << it->partition_key() << " / " << it->row_key() << endl;
-		  prop_vals_t keys{
-			  make_pair("Partition",value::string(it->partition_key())),
-			  make_pair("Row", value::string(it->row_key())) };
-      keys = get_properties(it->properties(), keys);
-      key_vec.push_back(value::object(keys));
-		  ++it;
+    vector<pplx::task<vector<value>>> queries {};
+    for (const auto& partition : salt.all(paths[2])) {
+      queries.push_back(pplx::create_task([table, partition, &salt] () mutable {
+            table_query query {};
+            query.set_filter_string(azure::storage::table_query::generate_filter_condition(U("PartitionKey"), azure::storage::query_comparison_operator::equal, U(partition)));
+            vector<value> found {};
+            table_query_iterator end;
+            for (table_query_iterator it = table.execute_query(query); it != end; ++it) {
+              cout << "Key: " << it->partition_key() << " / " << it->row_key() << endl;
+              prop_vals_t keys {
+                make_pair("Partition",value::string(salt.unsalt(it->partition_key()))),
+                make_pair("Row", value::string(it->row_key()))};
+              keys = get_properties(it->properties(), keys);
+              found.push_back(value::object(keys));
+            }
+            return found;
+          }));
+    }
 
-	  }
-    
-	  message.reply(status_codes::OK, value::array(key_vec));
-	  return;
+    vector<value> key_vec;
+    for (auto& q : queries) {
+      vector<value> found {q.get()};
+      key_vec.insert(key_vec.end(), found.begin(), found.end());
+    }
+    message.reply(status_codes::OK, value::array(key_vec));
+    return;
   }
   // End of our extensions =================================================================================================================
 
   // GET specific entry: Partition == paths[1], Row == paths[2]
-  table_operation retrieve_operation {table_operation::retrieve_entity(paths[2], paths[3])};
-  table_result retrieve_result {table.execute(retrieve_operation)};
+  table_operation retrieve_operation {table_operation::retrieve_entity(salt.salt(paths[2], paths[3]), paths[3])};
+  table_result retrieve_result {execute_read(table, retrieve_operation)};
   cout << "HTTP code: " << retrieve_result.http_status_code() << endl;
   if (retrieve_result.http_status_code() == status_codes::NotFound) {
     message.reply(status_codes::NotFound);
@@ -368,6 +327,7 @@ void handle_post(http_request message) {
   if (paths[0] == create_table) {
     cout << "Create " << table_name << endl;
     bool created {table.create_if_not_exists()};
+    table_cache.created(table_name);
     cout << "Administrative table URI " << table.uri().primary_uri().to_string() << endl;
     if (created)
       message.reply(status_codes::Created);
@@ -397,21 +357,22 @@ void handle_put(http_request message) {
   unordered_map<string,string> json_body {get_json_body (message)};  
 
   cloud_table table {table_cache.lookup_table(paths[1])};
-  if ( ! table.exists()) {
-    message.reply(status_codes::NotFound);
-    return;
-  }
-  
+
   // Our extensions =================================================================================================================
 
-  //Update entity with authorization
+  //Update entity with authorization; the token is checked before any storage call
   if(paths[0] == update_entity_auth && json_body.size() > 0){
     //we'll use update_with_token from ServerUtils
-  	status_code result {update_with_token(message, tables_endpoint, json_body)};
+  	status_code result {update_with_token(message, table_cache, salt_for(paths[1]), json_body)};
   	message.reply(result);
   	return;
   }
 
+  if ( ! table.exists()) {
+    message.reply(status_codes::NotFound);
+    return;
+  }
+
   //Add the specified property (name / value pair) to all entities.
  if (paths[0] == add_property && json_body.size() == 1) {
     table_query query {};
@@ -456,7 +417,7 @@ void handle_put(http_request message) {
 
       const table_entity::properties_type& key_properties = it->properties();
       for(const auto v : key_properties){
-        cout << "Property: " << v.first << " Value: " << string(v.second.string_value()) << endl;
+        cout << "Property: " << v.first << " Value: " << v.second.str() << endl;
         if(prop == v.first){
           prop_exist = true;
         }
@@ -479,19 +440,16 @@ void handle_put(http_request message) {
   }
   // End of our extensions =================================================================================================================
 
-  table_entity entity {paths[2], paths[3]};
+  table_entity entity {salt_for(paths[1]).salt(paths[2], paths[3]), paths[3]};
 
   // Update entity
   try {
     if (paths[0] == update_entity) {
       cout << "Update " << entity.partition_key() << " / " << entity.row_key() << endl;
-      table_entity::properties_type& properties = entity.properties();
-      for (const auto v : json_body) {
-	properties[v.first] = entity_property {v.second};
-      }
+      set_entity_properties(entity.properties(), json_body);
 
       table_operation operation {table_operation::insert_or_merge_entity(entity)};
-      table_result op_result {table.execute(operation)};
+      table_result op_result {execute_write(table, operation)};
 
       message.reply(status_codes::OK);
     }
@@ -539,7 +497,7 @@ void handle_delete(http_request message) {
 	message.reply(status_codes::BadRequest);
 	return;
     }
-    table_entity entity {paths[2], paths[3]};
+    table_entity entity {salt_for(table_name).salt(paths[2], paths[3]), paths[3]};
     cout << "Delete " << entity.partition_key() << " / " << entity.row_key()<< endl;
 
     table_operation operation {table_operation::delete_entity(entity)};
@@ -565,23 +523,69 @@ void handle_delete(http_request message) {
   
   Wait for a carriage return, then shut the server down.
  */
+#ifdef COLOCATED
+int run (int argc, char const * argv[]) {
+#else
 int main (int argc, char const * argv[]) {
+#endif
+  WorkerLauncher launcher {true};
+  retry_policy_t storage_policy {};
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (launcher.parse_option(argv[i], argv[i+1]))
+      continue;
+    else if (parse_retry_option(argv[i], argv[i+1], storage_policy))
+      continue;
+    else if (string(argv[i]) == "--partition-salt")
+      data_salt.set_sub_partitions(std::stoul(argv[i+1]));
+  }
+  launcher.start();
+  set_storage_policy(storage_policy);
+
   cout << "Parsing connection string" << endl;
   table_cache.init (storage_connection_string);
 
   cout << "Opening listener" << endl;
-  http_listener listener {def_url};
-  listener.support(methods::GET, &handle_get);
-  listener.support(methods::POST, &handle_post);
-  listener.support(methods::PUT, &handle_put);
-  listener.support(methods::DEL, &handle_delete);
-  listener.open().wait(); // Wait for listener to complete starting
-
-  cout << "Enter carriage return to stop server." << endl;
-  string line;
-  getline(std::cin, line);
+  const rpc_handlers_t handlers {
+    {methods::GET, &handle_get},
+    {methods::POST, &handle_post},
+    {methods::PUT, &handle_put},
+    {methods::DEL, &handle_delete}};
+  // Workers share the port, which http_listener cannot do
+  std::unique_ptr<http_listener> listener {};
+  std::unique_ptr<HttpServer> shared_listener {};
+  if (launcher.shared_port()) {
+    shared_listener = open_http_server(launcher.url(def_url), handlers);
+  }
+  else {
+    listener = std::make_unique<http_listener>(launcher.url(def_url));
+    listener->support(methods::GET, &handle_get);
+    listener->support(methods::POST, &handle_post);
+    listener->support(methods::PUT, &handle_put);
+    listener->support(methods::DEL, &handle_delete);
+    listener->open().wait(); // Wait for listener to complete starting
+  }
+#ifdef COLOCATED
+  register_local_service(launcher.url(def_url), methods::GET, &handle_get);
+  register_local_service(launcher.url(def_url), methods::POST, &handle_post);
+  register_local_service(launcher.url(def_url), methods::PUT, &handle_put);
+  register_local_service(launcher.url(def_url), methods::DEL, &handle_delete);
+#endif
+  auto rpc_server (open_rpc_server(launcher.url(def_url), handlers, launcher.shared_port()));
+
+  if (launcher.worker() == 0)
+    cout << "Enter carriage return to stop server." << endl;
+  launcher.wait_for_stop();
 
   // Shut it down
-  listener.close().wait();
+  if (listener)
+    listener->close().wait();
+  shared_listener.reset();
+  rpc_server.reset();
+  launcher.stop();
   cout << "Closed" << endl;
+  return 0;
+}
+
+#ifdef COLOCATED
 }
+#endif
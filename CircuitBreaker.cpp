@@ -0,0 +1,149 @@
+#include "CircuitBreaker.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+using std::size_t;
+using std::string;
+
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+/*
+  Take --breaker on|off, --breaker-failure-pct N, --breaker-slow-ms N,
+  --breaker-slow-op Op=N, --breaker-open-ms N and
+  --breaker-min-calls N into policy. Returns false if flag is none
+  of them.
+ */
+bool parse_breaker_option (const string& flag, const string& val, breaker_policy_t& policy) {
+  if (flag == "--breaker")
+    policy.enabled = val == "on";
+  else if (flag == "--breaker-failure-pct")
+    policy.failure_percent = std::min(100ul, std::stoul(val));
+  else if (flag == "--breaker-slow-ms")
+    policy.slow_call = milliseconds {std::stol(val)};
+  else if (flag == "--breaker-slow-op") {
+    const auto eq = val.find('=');
+    if (eq == string::npos || eq == 0)
+      throw std::invalid_argument("--breaker-slow-op takes Operation=milliseconds");
+    policy.slow_call_by_op[val.substr(0, eq)] = milliseconds {std::stol(val.substr(eq + 1))};
+  }
+  else if (flag == "--breaker-open-ms")
+    policy.open_time = milliseconds {std::stol(val)};
+  else if (flag == "--breaker-min-calls")
+    policy.min_calls = std::stoul(val);
+  else
+    return false;
+  return true;
+}
+
+/*
+  Return the time after which a call of op counts as slow, or zero
+  if it never does
+ */
+milliseconds breaker_policy_t::slow_call_for (const string& op) const {
+  auto limit (slow_call_by_op.find(op));
+  return limit == slow_call_by_op.end() ? slow_call : limit->second;
+}
+
+CircuitBreaker::CircuitBreaker (const breaker_policy_t& policy) :
+  policy (policy),
+  window (std::max(size_t {1}, policy.buckets), bucket_t {steady_clock::time_point {}, 0, 0}),
+  state {state_t::closed},
+  opened {},
+  probing {false},
+  lock {}
+{}
+
+/*
+  Return the bucket for now, emptying it first if it last held
+  calls from an earlier pass around the window. Call with lock held.
+ */
+CircuitBreaker::bucket_t& CircuitBreaker::current_bucket (steady_clock::time_point now) {
+  const auto width = std::max(steady_clock::duration {1}, steady_clock::duration {policy.window} / static_cast<long>(window.size()));
+  const auto slice = now.time_since_epoch() / width;
+  bucket_t& b (window[static_cast<size_t>(slice) % window.size()]);
+  const steady_clock::time_point start {slice * width};
+  if (b.start != start)
+    b = bucket_t {start, 0, 0};
+  return b;
+}
+
+/*
+  Open the breaker and forget the window. Call with lock held.
+ */
+void CircuitBreaker::trip (steady_clock::time_point now) {
+  state = state_t::open;
+  opened = now;
+  probing = false;
+  for (auto& b : window)
+    b = bucket_t {steady_clock::time_point {}, 0, 0};
+}
+
+/*
+  Return whether a call may be made now. probe is set true if the
+  call is the half-open breaker's single probe.
+ */
+bool CircuitBreaker::allow (bool& probe) {
+  probe = false;
+  pplx::extensibility::scoped_critical_section_t l {lock};
+  if (state == state_t::closed)
+    return true;
+  if (state == state_t::open && steady_clock::now() - opened >= policy.open_time)
+    state = state_t::half_open;
+  if (state == state_t::half_open && ! probing) {
+    probing = true;
+    probe = true;
+    return true;
+  }
+  return false;
+}
+
+/*
+  Record the outcome of a call of op that allow() admitted. A
+  success slower than op's slow_call counts as a failure.
+ */
+void CircuitBreaker::record (bool probe, bool success, steady_clock::duration latency,
+                             const string& op) {
+  const milliseconds slow_call {policy.slow_call_for(op)};
+  const bool healthy {success && (slow_call == milliseconds::zero() || latency <= slow_call)};
+  const auto now = steady_clock::now();
+  pplx::extensibility::scoped_critical_section_t l {lock};
+  if (probe) {
+    if (healthy)
+      state = state_t::closed;
+    else
+      trip(now);
+    probing = false;
+    return;
+  }
+  // Calls admitted before the breaker opened say nothing new
+  if (state != state_t::closed)
+    return;
+
+  bucket_t& b (current_bucket(now));
+  ++b.calls;
+  if (! healthy)
+    ++b.failures;
+  if (healthy)
+    return;
+
+  size_t calls {0};
+  size_t failures {0};
+  const auto oldest = now - policy.window;
+  for (const auto& w : window)
+    if (w.start > oldest) {
+      calls += w.calls;
+      failures += w.failures;
+    }
+  if (calls >= policy.min_calls && failures * 100 >= calls * policy.failure_percent)
+    trip(now);
+}
+
+CircuitBreaker::state_t CircuitBreaker::current_state () {
+  pplx::extensibility::scoped_critical_section_t l {lock};
+  return state;
+}
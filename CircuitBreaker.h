@@ -0,0 +1,82 @@
+#ifndef CircuitBreaker_h
+#define CircuitBreaker_h
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+/*
+  When a CircuitBreaker trips and for how long it stays open
+ */
+struct breaker_policy_t {
+  bool enabled {true};
+  std::chrono::milliseconds window {10000};    // Span of the rolling window
+  std::size_t buckets {10};                    // Window slices, expired one at a time
+  std::size_t min_calls {20};                  // Fewer calls in the window never trip it
+  unsigned failure_percent {50};               // Failed or slow calls that trip it
+  std::chrono::milliseconds slow_call {2000};  // Calls slower than this count as failed
+  std::chrono::milliseconds open_time {5000};  // Time open before a probe is let through
+  // Operations, by the first segment of their path, that take their
+  // own slow_call; zero never counts them as slow. A PushStatus to
+  // an author with many followers is slow by design.
+  std::unordered_map<std::string,std::chrono::milliseconds> slow_call_by_op {
+    {"PushStatus", std::chrono::milliseconds {0}}};
+
+  std::chrono::milliseconds slow_call_for(const std::string& op) const;
+};
+
+bool parse_breaker_option(const std::string& flag, const std::string& val, breaker_policy_t& policy);
+
+/*
+  Fails calls to one dependency fast while it is unhealthy.
+
+  Closed, every call is let through and its outcome recorded in a
+  rolling window of buckets. Once the window holds at least
+  min_calls and failure_percent of them failed or took longer than
+  their operation's slow_call, the breaker opens: allow() refuses every call, so
+  callers do not queue threads on a server that is down or
+  drowning.
+
+  After open_time the breaker is half-open and lets exactly one
+  call through as a probe. If the probe succeeds in time the
+  breaker closes with an empty window; otherwise it opens again
+  for another open_time.
+
+  Every call allow() admits must be reported to record(), with
+  the probe flag allow() gave, whether it succeeded or threw.
+ */
+class CircuitBreaker {
+public:
+  enum class state_t {closed, open, half_open};
+
+private:
+  struct bucket_t {
+    std::chrono::steady_clock::time_point start;
+    std::size_t calls;
+    std::size_t failures;
+  };
+
+  breaker_policy_t policy;
+  std::vector<bucket_t> window;
+  state_t state;
+  std::chrono::steady_clock::time_point opened;
+  bool probing;
+  pplx::extensibility::critical_section_t lock;
+
+  bucket_t& current_bucket(std::chrono::steady_clock::time_point now);
+  void trip(std::chrono::steady_clock::time_point now);
+
+public:
+  explicit CircuitBreaker (const breaker_policy_t& policy);
+
+  bool allow(bool& probe);
+  void record(bool probe, bool success, std::chrono::steady_clock::duration latency,
+              const std::string& op);
+  state_t current_state();
+};
+
+#endif
@@ -10,20 +10,38 @@
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
+#include <cpprest/asyncrt_utils.h>
 #include <cpprest/http_client.h>
 #include <cpprest/json.h>
 
 #include <pplx/pplxtasks.h>
 
+#include "CircuitBreaker.h"
+#include "InternalRpc.h"
+#include "LocalTransport.h"
+#include "Resilience.h"
+#include "ShardedMap.h"
+#include "SimdScan.h"
+#include "StringRef.h"
+
 using std::make_pair;
 using std::pair;
+using std::size_t;
 using std::string;
 using std::unordered_map;
 using std::vector;
 
+using web::http::http_exception;
 using web::http::http_headers;
 using web::http::http_request;
 using web::http::http_response;
@@ -31,11 +49,125 @@ using web::http::method;
 using web::http::status_code;
 using web::http::status_codes;
 
+using web::http::uri;
+
 using web::http::client::http_client;
 
 using web::json::object;
 using web::json::value;
 
+namespace {
+  /*
+    Wait for response, returning its status code and any JSON
+    value in its body, as described for do_request()
+   */
+  pair<status_code,value> wait_for_response (pplx::task<http_response> response_task) {
+    status_code code;
+    value resp_body;
+    response_task
+      .then([&code](http_response response)
+            {
+              code = response.status_code();
+              const http_headers& headers {response.headers()};
+              auto content_type (headers.find("Content-Type"));
+              if (content_type == headers.end() ||
+                  content_type->second != "application/json")
+                return pplx::task<value> ([] { return value::object ();});
+              else
+                return response.extract_json();
+            })
+      .then([&resp_body](value v) -> void
+            {
+              resp_body = v;
+              return;
+            })
+      .wait();
+    return make_pair(code, resp_body);
+  }
+
+  /*
+    Send a request by whichever transport reaches its server, as
+    described for do_request()
+   */
+  pair<status_code,value> send_request (const method& http_method, const string& uri_string, const value& req_body) {
+    http_request request {http_method};
+    if (req_body != value {}) {
+      http_headers& headers (request.headers());
+      headers.add("Content-Type", "application/json");
+      request.set_body(req_body);
+    }
+
+    // A server in this process takes the request without HTTP
+    local_handler_t local_handler;
+    if (find_local_service(uri_string, http_method, local_handler)) {
+      request.set_request_uri(uri {uri_string});
+      try {
+        local_handler(request);
+      }
+      catch (const std::exception&) {
+        // As the listener would
+        request.reply(status_codes::InternalError);
+      }
+      return wait_for_response(request.get_response());
+    }
+
+    pair<status_code,value> rpc_result;
+    if (internal_rpc_enabled() && rpc_request(http_method, uri_string, req_body, rpc_result))
+      return rpc_result;
+
+    http_client client {uri_string};
+    return wait_for_response(client.request(request));
+  }
+
+  // Set once by set_breaker_policy(), before any request is made
+  breaker_policy_t breaker_policy {};
+  // Breakers by server address. Never destroyed, as requests may
+  // still be running at exit.
+  ShardedMap<std::shared_ptr<CircuitBreaker>>& breakers {
+    *new ShardedMap<std::shared_ptr<CircuitBreaker>> {8}};
+
+  /*
+    The object kept in per_server for the server uri_string is
+    addressed to, made by make if there is none yet. Entries are
+    never erased, so the map keeps it alive.
+   */
+  template <typename T, typename F>
+  T& for_server (ShardedMap<std::shared_ptr<T>>& per_server, const string& uri_string, F make) {
+    return *per_server.find_or_insert(uri {uri_string}.authority().to_string(), make);
+  }
+
+  CircuitBreaker& breaker_for (const string& uri_string) {
+    return for_server(breakers, uri_string,
+                      [] () { return std::make_shared<CircuitBreaker>(breaker_policy); });
+  }
+
+  /*
+    The operation a request to one of the servers names: the first
+    segment of its path
+   */
+  string operation_of (const string& uri_string) {
+    const auto paths = uri::split_path(uri {uri_string}.path());
+    return paths.empty() ? string {} : paths[0];
+  }
+
+  /*
+    Whether a reply shows its server in trouble, as opposed to
+    refusing this request
+   */
+  bool unhealthy_status (status_code code) {
+    return code == status_codes::RequestTimeout || code == 429 ||
+      (code >= 500 && code != status_codes::NotImplemented);
+  }
+}
+
+/*
+  Set the policy of the circuit breakers do_request() keeps for
+  each server. Breakers already made keep the policy they had.
+ */
+void set_breaker_policy (const breaker_policy_t& policy) {
+  breaker_policy = policy;
+}
+
 /*
   Make an HTTP request, returning the status code and any JSON value in the body
 
@@ -48,6 +180,16 @@ using web::json::value;
   If the response does not have that Content-Type, the second part
   of the result is simply json::value {}.
 
+  If the URI names a server registered with register_local_service()
+  in this process, its handler is called directly. Otherwise, once
+  enable_internal_rpc() is on, the request goes over RPC to servers
+  that take it.
+
+  Each server has a CircuitBreaker. While a server's breaker is
+  open, as it is after many recent requests to it failed or were
+  slow for their operation, the request is not sent and the result is at once
+  ServiceUnavailable with an empty object.
+
   If the URI denotes an address/port combination that cannot be
   located (say because the server is not running or the port 
   number is incorrect), the routine throws a web::uri_exception().
@@ -69,35 +211,25 @@ using web::json::value;
 
 // Version with explicit third argument
 pair<status_code,value> do_request (const method& http_method, const string& uri_string, const value& req_body) {
-  http_request request {http_method};
-  if (req_body != value {}) {
-    http_headers& headers (request.headers());
-    headers.add("Content-Type", "application/json");
-    request.set_body(req_body);
+  if (! breaker_policy.enabled)
+    return send_request(http_method, uri_string, req_body);
+
+  CircuitBreaker& breaker {breaker_for(uri_string)};
+  bool probe;
+  if (! breaker.allow(probe))
+    return make_pair(status_codes::ServiceUnavailable, value::object ());
+
+  const string op {operation_of(uri_string)};
+  const auto start = std::chrono::steady_clock::now();
+  try {
+    pair<status_code,value> result {send_request(http_method, uri_string, req_body)};
+    breaker.record(probe, ! unhealthy_status(result.first), std::chrono::steady_clock::now() - start, op);
+    return result;
+  }
+  catch (...) {
+    breaker.record(probe, false, std::chrono::steady_clock::now() - start, op);
+    throw;
   }
-
-  status_code code;
-  value resp_body;
-  http_client client {uri_string};
-  client.request (request)
-    .then([&code](http_response response)
-          {
-            code = response.status_code();
-            const http_headers& headers {response.headers()};
-            auto content_type (headers.find("Content-Type"));
-            if (content_type == headers.end() ||
-                content_type->second != "application/json")
-              return pplx::task<value> ([] { return value::object ();});
-            else
-              return response.extract_json();
-          })
-    .then([&resp_body](value v) -> void
-          {
-            resp_body = v;
-            return;
-          })
-    .wait();
-  return make_pair(code, resp_body);
 }
 
 // Version that defaults third argument
@@ -105,6 +237,92 @@ pair<status_code,value> do_request (const method& http_method, const string& uri
   return do_request (http_method, uri_string, value {});
 }
 
+namespace {
+  // Set once by set_request_policy(), before any request is made
+  retry_policy_t request_policy {};
+  // GET latencies by server address. Never destroyed, as hedged
+  // requests may still be running at exit.
+  ShardedMap<std::shared_ptr<LatencyTracker>>& request_latency {
+    *new ShardedMap<std::shared_ptr<LatencyTracker>> {8}};
+
+  LatencyTracker& latency_for (const string& uri_string) {
+    return for_server(request_latency, uri_string,
+                      [] () { return std::make_shared<LatencyTracker>(); });
+  }
+
+  /*
+    Statuses that another attempt may not get: timeouts, throttling
+    (429) and server errors other than those that will not change
+   */
+  bool retryable_status (status_code code) {
+    return code == status_codes::RequestTimeout || code == 429 ||
+      (code >= 500 && code != status_codes::NotImplemented &&
+       code != status_codes::HttpVersionNotSupported);
+  }
+
+  bool retryable_error (const std::exception& e) {
+    return dynamic_cast<const http_exception*>(&e) != nullptr;
+  }
+
+  /*
+    Whether do_request() would now refuse a request to the server
+    of uri_string; retrying it would only use up the budget
+   */
+  bool breaker_open (const string& uri_string) {
+    return breaker_policy.enabled &&
+      breaker_for(uri_string).current_state() == CircuitBreaker::state_t::open;
+  }
+}
+
+/*
+  Set how do_retrying_request() retries and hedges
+ */
+void set_request_policy (const retry_policy_t& policy) {
+  request_policy = policy;
+}
+
+/*
+  do_request(), retrying transient failures under the policy of
+  set_request_policy(): an http_exception (no connection, reset)
+  or a retryable status is tried again after a decorrelated-jitter
+  backoff, while attempts and budget remain. The last result is
+  returned, or the last exception thrown.
+
+  Only for idempotent requests: GETs and PUTs that set properties
+  to given values. A POST is never retried, as an attempt that
+  seemed to fail may have been carried out.
+
+  A request refused by an open circuit breaker is not retried.
+
+  With --hedge-reads on, a GET slower than the recent p95 for its
+  server is sent again and the first reply used.
+ */
+pair<status_code,value> do_retrying_request (const method& http_method, const string& uri_string, const value& req_body) {
+  retry_policy_t policy {request_policy};
+  if (http_method == web::http::methods::POST)
+    policy.max_attempts = 1;
+  auto attempt = [http_method, uri_string, req_body] () {
+    return do_request(http_method, uri_string, req_body);
+  };
+  const bool hedge {policy.hedge_reads && http_method == web::http::methods::GET};
+  return with_retries<pair<status_code,value>>(policy,
+                                               [&] () {
+                                                 return hedge ?
+                                                   hedged<pair<status_code,value>>(latency_for(uri_string), attempt) :
+                                                   attempt();
+                                               },
+                                               [&uri_string] (const pair<status_code,value>& r) {
+                                                 return retryable_status(r.first) && ! breaker_open(uri_string);
+                                               },
+                                               [&uri_string] (const std::exception& e) {
+                                                 return retryable_error(e) && ! breaker_open(uri_string);
+                                               });
+}
+
+pair<status_code,value> do_retrying_request (const method& http_method, const string& uri_string) {
+  return do_retrying_request (http_method, uri_string, value {});
+}
+
 /*
  Return a JSON object value whose (0 or more) properties are specified as a 
  vector of <string,string> pairs
@@ -218,17 +436,12 @@ string get_json_object_prop (const value& v, const string& propname) {
     return propval.serialize();
 }
 
-using pos_t = string::size_type;
-
 char pair_separator {'|'};
 char pair_delimiter {';'};
 
-static pos_t next_delim (const string& s, char delim, pos_t start) {
-  return s.find(delim, start);
-}
-
 /*
- Return a vector of (country, name) pairs representing a list of friends
+ Return a vector of (country, name) pairs representing a list of friends,
+ as string_refs into friends_list, which must outlive the result.
 
  The parameter is a string representing a friends list as described below:
 
@@ -257,43 +470,272 @@ static pos_t next_delim (const string& s, char delim, pos_t start) {
 
    "USAMadonna|Canada" (no delimiter in opening "pair")
 
- Note: gcc 4.8.4's version of STL does not include full support for <regexp>,
- so this algorthm uses the more basic (and entirely adequate) string::find.
+ The separators are found with find_first_of2(), which tests 16
+ bytes at a time where SSE2 is available.
+ */
+friends_ref_list_t parse_friends_refs (const string_ref& friends_list) {
+  friends_ref_list_t res {};
+
+  const char* p {friends_list.begin()};
+  const char* const e {friends_list.end()};
+  if (p < e && *p == pair_separator)
+    p++; // Skip any initial separator
+  while (p < e) {
+    const char* q {find_first_of2(p, e, pair_delimiter, pair_separator)};
+    if (q == e)
+      break; // Trailing characters with no delimiter
+    if (*q != pair_delimiter) {
+      // A pair with no delimiter is an error unless no pair follows it
+      if (find_first(q, e, pair_delimiter) != e)
+        throw std::invalid_argument(string("Misformed friends list: ") + friends_list.to_string());
+      break;
+    }
+    const char* end {find_first(q + 1, e, pair_separator)};
+    if (end == q + 1)
+      throw std::invalid_argument(string("Misformed friends list: ") + friends_list.to_string());
+    res.push_back (make_pair (string_ref {p, static_cast<size_t>(q - p)},
+                              string_ref {q + 1, static_cast<size_t>(end - q - 1)}));
+    if (end == e)
+      break;
+    p = end + 1;
+  }
+  return res;
+}
+
+/*
+ Return a vector of (country, name) pairs representing a list of friends,
+ accepting and rejecting the same strings as parse_friends_refs()
  */
 friends_list_t parse_friends_list (const string& friends_list) {
+  const friends_ref_list_t refs {parse_friends_refs(friends_list)};
   friends_list_t res {};
-
-  pos_t start {0};
-  if (friends_list[start] == pair_separator)
-    start++; // Skip any initial separator
-  for (pos_t delim {next_delim (friends_list, pair_delimiter, start)};
-       delim != string::npos; 
-       delim = next_delim (friends_list, pair_delimiter, start)) {
-    pos_t end {next_delim (friends_list, pair_separator, start)};
-    if (end == string::npos)
-      end = friends_list.size();
-    if (end <= delim+1)
-      throw std::invalid_argument(string("Misformed friends list: ") + friends_list);
-    string country {friends_list.substr (start, delim-start)};
-    string name {friends_list.substr (delim+1, end-delim-1)};
-    res.push_back (make_pair (country, name));
-    start = end+1;
-  }
+  res.reserve(refs.size());
+  for (const auto& f : refs)
+    res.push_back (make_pair (f.first.to_string(), f.second.to_string()));
   return res;
 }
 
 /*
-  Return the string representation of a friends list 
+  Return the string representation of a friends list, allocating
+  it once at its final size
  */
-string friends_list_to_string (const friends_list_t& list) {
+template <typename L>
+static string list_to_string (const L& list) {
+  if (list.empty())
+    return string {};
+  size_t size {list.size() * 2 - 1};
+  for (const auto& p : list)
+    size += p.first.size() + p.second.size();
+
   string result {};
+  result.reserve(size);
   bool started {false};
-
   for (const auto& p : list) {
     if (started)
       result += pair_separator;
-    result += p.first + pair_delimiter + p.second;
+    result.append(p.first.data(), p.first.size());
+    result += pair_delimiter;
+    result.append(p.second.data(), p.second.size());
     started = true;
   }
   return result;
 }
+
+string friends_list_to_string (const friends_list_t& list) {
+  return list_to_string(list);
+}
+
+string friends_list_to_string (const friends_ref_list_t& list) {
+  return list_to_string(list);
+}
+
+const string odata_type_suffix {"@odata.type"};
+const string edm_binary_type {"Edm.Binary"};
+
+namespace {
+  // First byte of every binary friends list
+  constexpr unsigned char friends_binary_version {1};
+
+  void put_varint (vector<unsigned char>& out, size_t n) {
+    while (n >= 0x80) {
+      out.push_back(static_cast<unsigned char>(n | 0x80));
+      n >>= 7;
+    }
+    out.push_back(static_cast<unsigned char>(n));
+  }
+
+  /*
+    Read a varint at p, advancing p. Throws std::invalid_argument
+    if it runs past end or does not fit in 32 bits.
+   */
+  size_t get_varint (const unsigned char*& p, const unsigned char* end) {
+    size_t n {0};
+    for (unsigned shift = 0; shift < 35; shift += 7) {
+      if (p == end)
+        throw std::invalid_argument("Misformed binary friends list: truncated length");
+      const unsigned char b {*p++};
+      n |= static_cast<size_t>(b & 0x7f) << shift;
+      if ((b & 0x80) == 0)
+        return n;
+    }
+    throw std::invalid_argument("Misformed binary friends list: length too long");
+  }
+
+  /*
+    Read a length-prefixed string at p, advancing p past it
+   */
+  string_ref get_bytes (const unsigned char*& p, const unsigned char* end) {
+    const size_t len {get_varint(p, end)};
+    if (len > static_cast<size_t>(end - p))
+      throw std::invalid_argument("Misformed binary friends list: truncated string");
+    string_ref res {reinterpret_cast<const char*>(p), len};
+    p += len;
+    return res;
+  }
+
+  void put_bytes (vector<unsigned char>& out, const string& s) {
+    put_varint(out, s.size());
+    out.insert(out.end(), s.begin(), s.end());
+  }
+}
+
+/*
+  Return the binary form of a friends list, for storing as an
+  Edm.Binary property. Unlike the string form, it can hold any
+  characters in countries and names.
+
+  Layout, with every length and count a little-endian base-128
+  varint:
+
+    version (1 byte)
+    country count, then each distinct country: length, bytes
+    friend count, then each friend: country index, name length, bytes
+
+  Countries are numbered in order of first appearance, so each is
+  stored once however many friends live there.
+ */
+vector<unsigned char> encode_friends_binary (const friends_list_t& list) {
+  vector<string> countries {};
+  unordered_map<string,size_t> country_index {};
+  vector<size_t> indices {};
+  indices.reserve(list.size());
+  size_t size {1};
+  for (const auto& f : list) {
+    auto c (country_index.find(f.first));
+    if (c == country_index.end()) {
+      c = country_index.insert(make_pair(f.first, countries.size())).first;
+      countries.push_back(f.first);
+      size += f.first.size() + 5;
+    }
+    indices.push_back(c->second);
+    size += f.second.size() + 10;
+  }
+
+  vector<unsigned char> out {};
+  out.reserve(size + 10);
+  out.push_back(friends_binary_version);
+  put_varint(out, countries.size());
+  for (const auto& c : countries)
+    put_bytes(out, c);
+  put_varint(out, list.size());
+  for (size_t i = 0; i < list.size(); ++i) {
+    put_varint(out, indices[i]);
+    put_bytes(out, list[i].second);
+  }
+  return out;
+}
+
+/*
+  Decode a friends list written by encode_friends_binary(). The
+  result refers into data, which must outlive it.
+
+  Every length and index is checked against the buffer before it
+  is used; a buffer that is truncated, has an unknown version,
+  refers to a country it does not hold, or has bytes left over
+  throws std::invalid_argument.
+ */
+friends_ref_list_t decode_friends_binary (const unsigned char* data, size_t size) {
+  const unsigned char* p {data};
+  const unsigned char* const end {data + size};
+  if (p == end || *p++ != friends_binary_version)
+    throw std::invalid_argument("Misformed binary friends list: unknown version");
+
+  // Every entry takes at least one byte, so counts larger than
+  // what is left are rejected before anything is allocated
+  const size_t country_count {get_varint(p, end)};
+  if (country_count > static_cast<size_t>(end - p))
+    throw std::invalid_argument("Misformed binary friends list: bad country count");
+  vector<string_ref> countries {};
+  countries.reserve(country_count);
+  for (size_t i = 0; i < country_count; ++i)
+    countries.push_back(get_bytes(p, end));
+
+  const size_t friend_count {get_varint(p, end)};
+  if (friend_count > static_cast<size_t>(end - p))
+    throw std::invalid_argument("Misformed binary friends list: bad friend count");
+  friends_ref_list_t res {};
+  res.reserve(friend_count);
+  for (size_t i = 0; i < friend_count; ++i) {
+    const size_t c {get_varint(p, end)};
+    if (c >= countries.size())
+      throw std::invalid_argument("Misformed binary friends list: bad country index");
+    res.push_back(make_pair(countries[c], get_bytes(p, end)));
+  }
+  if (p != end)
+    throw std::invalid_argument("Misformed binary friends list: trailing bytes");
+  return res;
+}
+
+/*
+  Return the friends list held in property propname of an entity
+  as read from BasicServer, in either form.
+
+  A binary property comes as base64 text with a companion
+  "<propname>@odata.type" property of "Edm.Binary"; anything else
+  is the string form. Entities written before the binary form
+  existed are thus read unchanged, and move to it when their list
+  is next written with friends_props().
+ */
+friends_list_t get_friends_prop (const value& entity, const string& propname) {
+  const string text {get_json_object_prop(entity, propname)};
+  if (get_json_object_prop(entity, propname + odata_type_suffix) != edm_binary_type)
+    return parse_friends_list(text);
+
+  const vector<unsigned char> bytes {utility::conversions::from_base64(text)};
+  const friends_ref_list_t refs {decode_friends_binary(bytes.data(), bytes.size())};
+  friends_list_t res {};
+  res.reserve(refs.size());
+  for (const auto& f : refs)
+    res.push_back (make_pair (f.first.to_string(), f.second.to_string()));
+  return res;
+}
+
+/*
+  Return the properties that store list in property propname in
+  binary form, for an update through BasicServer
+ */
+vector<pair<string,string>> friends_props (const string& propname, const friends_list_t& list) {
+  return vector<pair<string,string>> {
+    make_pair(propname, utility::conversions::to_base64(encode_friends_binary(list))),
+    make_pair(propname + odata_type_suffix, edm_binary_type)
+  };
+}
+
+/*
+  Return the expiry time written in a shared access signature
+  token (its "se" field), or the epoch if it has none.
+ */
+std::chrono::system_clock::time_point sas_token_expiry (const string& token) {
+  // utility::datetime counts 100ns intervals from 1601-01-01
+  constexpr utility::datetime::interval_type unix_epoch {116444736000000000};
+  auto fields = uri::split_query(token[0] == '?' ? token.substr(1) : token);
+  auto se (fields.find("se"));
+  if (se == fields.end())
+    return std::chrono::system_clock::time_point {};
+
+  utility::datetime expiry {utility::datetime::from_string(uri::decode(se->second), utility::datetime::ISO_8601)};
+  if (!expiry.is_initialized() || expiry.to_interval() < unix_epoch)
+    return std::chrono::system_clock::time_point {};
+  std::chrono::microseconds since_epoch {static_cast<std::chrono::microseconds::rep>((expiry.to_interval() - unix_epoch) / 10)};
+  return std::chrono::system_clock::time_point {std::chrono::duration_cast<std::chrono::system_clock::duration>(since_epoch)};
+}
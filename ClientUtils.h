@@ -1,6 +1,9 @@
 #ifndef CLIENT_UTILS_H
 #define CLIENT_UTILS_H
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <unordered_map>
 #include <utility>
@@ -9,12 +12,21 @@
 #include <cpprest/http_client.h>
 #include <cpprest/json.h>
 
+#include <pplx/pplxtasks.h>
+
+#include "CircuitBreaker.h"
+#include "Resilience.h"
+#include "StringRef.h"
+
 // Alias for a type representing the result of do_request()
 using req_res_t = std::pair<web::http::status_code,web::json::value>;
 
 // Alias for a vector representing a friends list
 using friends_list_t = std::vector<std::pair<std::string,std::string>>;
 
+// Alias for a vector representing a friends list held in another string
+using friends_ref_list_t = std::vector<std::pair<string_ref,string_ref>>;
+
 // Alias for an unordered_map representing a JSON object's property/value pairs
 using value_string_t = std::unordered_map<std::string,std::string>;
 
@@ -24,6 +36,16 @@ do_request (const web::http::method& http_method, const std::string& uri_string,
 req_res_t
 do_request (const web::http::method& http_method, const std::string& uri_string);
 
+void set_breaker_policy (const breaker_policy_t& policy);
+
+void set_request_policy (const retry_policy_t& policy);
+
+req_res_t
+do_retrying_request (const web::http::method& http_method, const std::string& uri_string, const web::json::value& req_body);
+
+req_res_t
+do_retrying_request (const web::http::method& http_method, const std::string& uri_string);
+
 web::json::value
 build_json_value (const std::vector<std::pair<std::string,std::string>>& props);
 
@@ -52,6 +74,28 @@ extern char pair_delimiter;
 friends_list_t
 parse_friends_list (const std::string& friends_list);
 
+friends_ref_list_t
+parse_friends_refs (const string_ref& friends_list);
+
 std::string friends_list_to_string(const friends_list_t& list);
+std::string friends_list_to_string(const friends_ref_list_t& list);
+
+extern const std::string odata_type_suffix;
+extern const std::string edm_binary_type;
+
+std::vector<unsigned char>
+encode_friends_binary (const friends_list_t& list);
+
+friends_ref_list_t
+decode_friends_binary (const unsigned char* data, std::size_t size);
+
+friends_list_t
+get_friends_prop (const web::json::value& entity, const std::string& propname);
+
+std::vector<std::pair<std::string,std::string>>
+friends_props (const std::string& propname, const friends_list_t& list);
+
+std::chrono::system_clock::time_point
+sas_token_expiry (const std::string& token);
 
 #endif
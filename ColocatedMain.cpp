@@ -0,0 +1,46 @@
+/*
+  Runs BasicServer, AuthServer, UserServer and PushServer in one
+  process. Each still opens its listener for outside clients, but
+  the servers' requests to each other call the target's handler
+  directly (see LocalTransport.h) instead of going over HTTP.
+
+  Every server is given the whole command line and takes the
+  options it knows. --workers is ignored; --threads sizes the
+  one thread pool they share.
+
+  Built from the servers' own sources with COLOCATED defined,
+  which puts each in its own namespace with main() renamed run().
+ */
+
+#include <initializer_list>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "WorkerLauncher.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+namespace basic_server { int run (int argc, char const * argv[]); }
+namespace auth_server { int run (int argc, char const * argv[]); }
+namespace user_server { int run (int argc, char const * argv[]); }
+namespace push_server { int run (int argc, char const * argv[]); }
+
+int main (int argc, char const * argv[]) {
+  using run_t = int (*) (int, char const * []);
+  vector<std::thread> servers {};
+  for (run_t run : {&basic_server::run, &auth_server::run, &user_server::run, &push_server::run})
+    servers.emplace_back([run, argc, argv] () { run(argc, argv); });
+
+  string line;
+  getline(std::cin, line);
+  cout << "Stopping all servers" << endl;
+  WorkerLauncher::stop_all();
+  for (auto& server : servers)
+    server.join();
+  cout << "Closed" << endl;
+}
@@ -0,0 +1,45 @@
+#include "CredentialsCache.h"
+
+#include <chrono>
+#include <string>
+
+using std::string;
+
+using std::chrono::steady_clock;
+
+/*
+  Copy the cached credentials of userid into credentials. Returns
+  false if there are none younger than ttl; older ones are dropped.
+ */
+bool CredentialsCache::lookup(const string& userid, credentials_t& credentials) {
+  entry_t entry;
+  if (!entries.find(userid, entry))
+    return false;
+
+  const auto now = steady_clock::now();
+  if (now - entry.fetched >= ttl) {
+    const auto fetched = entry.fetched;
+    // Only drop the entry looked at, not one stored since
+    entries.erase_if(userid, [fetched] (const entry_t& e) {
+        return e.fetched == fetched;
+      });
+    return false;
+  }
+  credentials = entry.credentials;
+  return true;
+}
+
+/*
+  Cache credentials just read from AuthTable
+ */
+void CredentialsCache::store(const string& userid, const credentials_t& credentials) {
+  entries.assign(userid, entry_t {credentials, steady_clock::now()});
+}
+
+/*
+  Drop any cached credentials of userid. Returns false if there
+  were none.
+ */
+bool CredentialsCache::invalidate(const string& userid) {
+  return entries.erase(userid);
+}
@@ -0,0 +1,48 @@
+#ifndef CredentialsCache_h
+#define CredentialsCache_h
+
+#include <chrono>
+#include <string>
+
+#include "ShardedMap.h"
+
+/*
+  The fields of a user's AuthTable entity that AuthServer uses
+ */
+struct credentials_t {
+  std::string password;
+  std::string partition;  // Partition and row of the user's DataTable entity
+  std::string row;
+};
+
+/*
+  Credentials recently read from AuthTable, keyed by userid.
+
+  An entry is used for ttl after it was read and then read again,
+  so a change to AuthTable made behind AuthServer's back takes at
+  most ttl to be seen. invalidate() drops an entry at once.
+ */
+class CredentialsCache {
+private:
+  struct entry_t {
+    credentials_t credentials;
+    std::chrono::steady_clock::time_point fetched;
+  };
+
+  ShardedMap<entry_t> entries;
+  std::chrono::seconds ttl;
+
+public:
+  explicit CredentialsCache (std::chrono::seconds ttl) :
+    entries {},
+    ttl {ttl}
+    {};
+
+  void set_ttl(std::chrono::seconds t) { ttl = t; }
+
+  bool lookup(const std::string& userid, credentials_t& credentials);
+  void store(const std::string& userid, const credentials_t& credentials);
+  bool invalidate(const std::string& userid);
+};
+
+#endif
@@ -0,0 +1,312 @@
+#include "FeedMailbox.h"
+
+#include <algorithm>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_listener.h>
+#include <cpprest/json.h>
+
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::make_pair;
+using std::pair;
+using std::string;
+using std::vector;
+
+using web::http::http_request;
+using web::http::status_codes;
+
+using web::json::value;
+
+const string feed_updates_prop {"Updates"};
+
+static string mailbox_key (const string& country, const string& name) {
+  return country + "/" + name;
+}
+
+/*
+  Return the reply body for a batch of statuses, in the same
+  newline-separated form as the Updates property
+ */
+static value updates_body (const vector<string>& statuses) {
+  string updates {};
+  for (const auto& s : statuses) {
+    if (! updates.empty())
+      updates += "\n";
+    updates += s;
+  }
+  return value::object(vector<pair<string,value>> {
+      make_pair(feed_updates_prop, value::string(updates))
+    });
+}
+
+/*
+  Remove and return everything a user has not yet seen: their queued
+  statuses plus newer posts on the timelines they follow, oldest first.
+
+  Must be called with resplock held.
+ */
+vector<string> FeedMailbox::collect(const string& key, mailbox_t& box) {
+  vector<post_t> posts {box.posts.begin(), box.posts.end()};
+  box.posts.clear();
+
+  auto follows (following.find(key));
+  if (follows != following.end()) {
+    for (auto& cursor : follows->second) {
+      auto timeline (timelines.find(cursor.first));
+      if (timeline == timelines.end())
+        continue;
+      for (const auto& p : timeline->second) {
+        if (p.seq > cursor.second)
+          posts.push_back(p);
+      }
+      if (! timeline->second.empty())
+        cursor.second = std::max(cursor.second, timeline->second.back().seq);
+    }
+  }
+
+  std::sort(posts.begin(), posts.end(),
+            [] (const post_t& a, const post_t& b) { return a.seq < b.seq; });
+  vector<string> statuses {};
+  statuses.reserve(posts.size());
+  for (auto& p : posts)
+    statuses.push_back(std::move(p.status));
+  return statuses;
+}
+
+/*
+  Deliver a status to a user's mailbox.
+
+  If the user has a Feed request waiting, it is answered at once.
+  Otherwise the status is queued for their next poll, dropping
+  the oldest status once max_queued are waiting.
+
+  Returns false if the user has no mailbox (is not reading their feed).
+ */
+bool FeedMailbox::deliver(const string& country, const string& name, const string& status) {
+  const string key {mailbox_key(country, name)};
+  vector<waiter_t> ready {};
+  vector<string> statuses {};
+  {
+    scoped_critical_section_t lock {resplock};
+    auto entry (mailboxes.find(key));
+    if (entry == mailboxes.end())
+      return false;
+
+    mailbox_t& box = entry->second;
+    box.posts.push_back(post_t {take_seq(), status});
+    if (box.waiters.empty()) {
+      if (box.posts.size() > max_queued)
+        box.posts.pop_front();
+      return true;
+    }
+    statuses = collect(key, box);
+    ready.swap(box.waiters);
+  }
+
+  // Reply outside the lock; every waiter of the user sees the batch
+  value body {updates_body(statuses)};
+  for (auto& w : ready)
+    w.message.reply(status_codes::OK, body);
+  return true;
+}
+
+/*
+  Return the next sequence number: the current time in milliseconds
+  since the epoch, or one past the last number if that is later.
+
+  Must be called with resplock held.
+ */
+std::uint64_t FeedMailbox::take_seq() {
+  const std::uint64_t now_ms {static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count())};
+  next_seq = std::max(next_seq, now_ms);
+  return next_seq++;
+}
+
+/*
+  Publish a status of a high fan-out author.
+
+  The status is stored once, on the author's timeline, and the
+  author's followers are recorded for unseen(). Each follower with
+  a mailbox who is not already following the author starts from
+  this status, and those with a Feed request waiting are answered
+  at once. No per-follower copy of the status is made.
+
+  resplock is taken once per follower rather than across the
+  whole list, so polls and deliveries to other users
+  are not held up behind a large fan-out.
+
+  Returns the status's sequence number, for the author's Timeline.
+ */
+std::uint64_t FeedMailbox::publish(const string& country, const string& name,
+                                   const string& status, const friends_list_t& followers) {
+  const string author {mailbox_key(country, name)};
+  std::unordered_set<string> keys {};
+  keys.reserve(followers.size());
+  for (const auto& f : followers)
+    keys.insert(mailbox_key(f.first, f.second));
+
+  std::unordered_set<string> recorded {keys};  // Swapped in, so not copied under the lock
+  std::uint64_t seq {0};
+  {
+    scoped_critical_section_t lock {resplock};
+    seq = take_seq();
+    std::deque<post_t>& timeline = timelines[author];
+    timeline.push_back(post_t {seq, status});
+    if (timeline.size() > max_queued)
+      timeline.pop_front();
+    followers_of[author].swap(recorded);
+  }
+
+  for (const auto& key : keys) {
+    vector<waiter_t> waiters {};
+    value body {};
+    {
+      scoped_critical_section_t lock {resplock};
+      auto entry (mailboxes.find(key));
+      if (entry == mailboxes.end())
+        continue;
+      following[key].insert(make_pair(author, seq - 1));
+      if (entry->second.waiters.empty())
+        continue;
+      waiters.swap(entry->second.waiters);
+      body = updates_body(collect(key, entry->second));
+    }
+    for (auto& w : waiters)
+      w.message.reply(status_codes::OK, body);
+  }
+  return seq;
+}
+
+/*
+  True if the author's timeline is held here, from publish() or
+  load_timeline()
+ */
+bool FeedMailbox::has_timeline(const string& country, const string& name) {
+  scoped_critical_section_t lock {resplock};
+  return followers_of.find(mailbox_key(country, name)) != followers_of.end();
+}
+
+/*
+  Seed an author's timeline from their stored Timeline property and
+  friends list, as after a restart. Posts already held are kept;
+  the newest max_queued of the two are.
+ */
+void FeedMailbox::load_timeline(const string& country, const string& name,
+                                const vector<pair<std::uint64_t,string>>& posts,
+                                const friends_list_t& followers) {
+  const string author {mailbox_key(country, name)};
+  std::unordered_set<string> keys {};
+  keys.reserve(followers.size());
+  for (const auto& f : followers)
+    keys.insert(mailbox_key(f.first, f.second));
+
+  scoped_critical_section_t lock {resplock};
+  std::deque<post_t>& timeline = timelines[author];
+  for (const auto& p : posts) {
+    auto at = std::lower_bound(timeline.begin(), timeline.end(), p.first,
+                               [] (const post_t& a, std::uint64_t seq) { return a.seq < seq; });
+    if (at == timeline.end() || at->seq != p.first)
+      timeline.insert(at, post_t {p.first, p.second});
+    next_seq = std::max(next_seq, p.first + 1);
+  }
+  while (timeline.size() > max_queued)
+    timeline.pop_front();
+  auto known (followers_of.find(author));
+  if (known == followers_of.end())
+    followers_of[author].swap(keys);
+}
+
+/*
+  Return the statuses with sequence numbers after since on the
+  timelines of the fan-out authors a user follows, oldest first.
+  Nothing is removed; the caller records how far it has merged.
+ */
+vector<pair<std::uint64_t,string>> FeedMailbox::unseen(const string& country, const string& name,
+                                                       std::uint64_t since) {
+  const string key {mailbox_key(country, name)};
+  vector<pair<std::uint64_t,string>> posts {};
+  scoped_critical_section_t lock {resplock};
+  for (const auto& author : followers_of) {
+    if (author.second.count(key) == 0)
+      continue;
+    auto timeline (timelines.find(author.first));
+    if (timeline == timelines.end())
+      continue;
+    for (const auto& p : timeline->second) {
+      if (p.seq > since)
+        posts.push_back(make_pair(p.seq, p.status));
+    }
+  }
+  std::sort(posts.begin(), posts.end());
+  return posts;
+}
+
+/*
+  Answer a Feed request for a user.
+
+  Unseen statuses are returned immediately. With nothing new,
+  the request is held for up to wait seconds and answered by the
+  next deliver() or publish() or, failing that, by expire() with
+  NoContent.
+ */
+void FeedMailbox::poll(const string& country, const string& name,
+                       http_request message, std::chrono::seconds wait) {
+  const string key {mailbox_key(country, name)};
+  vector<string> statuses {};
+  {
+    scoped_critical_section_t lock {resplock};
+    mailbox_t& box = mailboxes[key];
+    box.last_poll = feed_clock::now();
+    statuses = collect(key, box);
+    if (statuses.empty() && wait.count() > 0) {
+      box.waiters.push_back(waiter_t {message, box.last_poll + wait});
+      return;
+    }
+  }
+
+  if (statuses.empty())
+    message.reply(status_codes::NoContent);
+  else
+    message.reply(status_codes::OK, updates_body(statuses));
+}
+
+/*
+  Answer waiters whose deadline has passed with NoContent and drop
+  mailboxes that have not been polled for idle_timeout, along with
+  their cursors.
+
+  Called periodically from a background thread.
+ */
+void FeedMailbox::expire() {
+  const feed_clock::time_point now {feed_clock::now()};
+  vector<waiter_t> expired {};
+  {
+    scoped_critical_section_t lock {resplock};
+    for (auto it = mailboxes.begin(); it != mailboxes.end(); ) {
+      mailbox_t& box = it->second;
+      for (auto w = box.waiters.begin(); w != box.waiters.end(); ) {
+        if (w->deadline <= now) {
+          expired.push_back(*w);
+          w = box.waiters.erase(w);
+        }
+        else
+          ++w;
+      }
+      if (box.waiters.empty() && now - box.last_poll > idle_timeout) {
+        following.erase(it->first);
+        it = mailboxes.erase(it);
+      }
+      else
+        ++it;
+    }
+  }
+
+  for (auto& w : expired)
+    w.message.reply(status_codes::NoContent);
+}
@@ -0,0 +1,105 @@
+#ifndef FeedMailbox_h
+#define FeedMailbox_h
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_listener.h>
+
+#include <pplx/pplxtasks.h>
+
+#include "ClientUtils.h"
+
+/*
+  In-memory mailboxes of statuses pushed to users who read their
+  feed from PushServer rather than from their DataTable entity.
+
+  A user's mailbox is created by their first Feed request and
+  dropped once they stop polling for idle_timeout. Statuses pushed
+  to a user without a mailbox are not queued; those users still
+  see them in the Updates property of their entity.
+
+  Authors with very large friend lists are fanned out on read
+  instead: publish() keeps their recent statuses on a single
+  timeline and records, per follower with a mailbox, the last one
+  they have seen. Each poll merges the user's own mailbox with the
+  timelines of the authors they follow, in the order the statuses
+  were pushed. The timelines mirror the durable Timeline property
+  PushServer keeps on each such author's entity; unseen() gives
+  what a follower has not yet had merged into their Updates.
+
+  Sequence numbers are milliseconds since the epoch, made strictly
+  increasing, so those stored in Timeline properties stay ordered
+  across restarts. Cursors go with their follower's mailbox; the
+  timelines, at most max_queued statuses for each fan-out author,
+  are kept.
+ */
+class FeedMailbox {
+public:
+  using feed_clock = std::chrono::steady_clock;
+
+private:
+  struct post_t {
+    std::uint64_t seq;
+    std::string status;
+  };
+
+  struct waiter_t {
+    web::http::http_request message;
+    feed_clock::time_point deadline;
+  };
+
+  struct mailbox_t {
+    std::deque<post_t> posts;
+    std::vector<waiter_t> waiters;
+    feed_clock::time_point last_poll;
+  };
+
+  using cursors_t = std::unordered_map<std::string,std::uint64_t>;
+
+  std::unordered_map<std::string,mailbox_t> mailboxes;
+  std::unordered_map<std::string,std::deque<post_t>> timelines;
+  std::unordered_map<std::string,cursors_t> following;
+  std::unordered_map<std::string,std::unordered_set<std::string>> followers_of;  // Author -> followers
+  std::uint64_t next_seq;
+  std::deque<post_t>::size_type max_queued;
+  std::chrono::seconds idle_timeout;
+  pplx::extensibility::critical_section_t resplock;
+
+  std::vector<std::string> collect(const std::string& key, mailbox_t& box);
+  std::uint64_t take_seq();
+
+public:
+  FeedMailbox (std::deque<post_t>::size_type max_queued,
+               std::chrono::seconds idle_timeout) :
+    mailboxes {},
+    timelines {},
+    following {},
+    followers_of {},
+    next_seq {1},
+    max_queued {max_queued},
+    idle_timeout {idle_timeout},
+    resplock {}
+    {};
+
+  bool deliver(const std::string& country, const std::string& name, const std::string& status);
+  std::uint64_t publish(const std::string& country, const std::string& name,
+                        const std::string& status, const friends_list_t& followers);
+  bool has_timeline(const std::string& country, const std::string& name);
+  void load_timeline(const std::string& country, const std::string& name,
+                     const std::vector<std::pair<std::uint64_t,std::string>>& posts,
+                     const friends_list_t& followers);
+  std::vector<std::pair<std::uint64_t,std::string>>
+    unseen(const std::string& country, const std::string& name, std::uint64_t since);
+  void poll(const std::string& country, const std::string& name,
+            web::http::http_request message, std::chrono::seconds wait);
+  void expire();
+};
+
+#endif
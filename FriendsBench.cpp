@@ -0,0 +1,90 @@
+/*
+  Benchmark of the friends list codec: the original
+  string::find/substr parser against parse_friends_refs() and
+  parse_friends_list(), the encoders, and the binary form.
+
+  Usage: friendsbench [iterations]
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ClientUtils.h"
+
+using std::cout;
+using std::endl;
+using std::make_pair;
+using std::size_t;
+using std::string;
+
+namespace {
+  /*
+    parse_friends_list() as it was before the scan was vectorized
+   */
+  friends_list_t find_substr_parse(const string& friends_list) {
+    friends_list_t res {};
+    string::size_type start {0};
+    if (friends_list[start] == pair_separator)
+      start++;
+    for (string::size_type delim {friends_list.find(pair_delimiter, start)};
+         delim != string::npos;
+         delim = friends_list.find(pair_delimiter, start)) {
+      string::size_type end {friends_list.find(pair_separator, start)};
+      if (end == string::npos)
+        end = friends_list.size();
+      if (end <= delim+1)
+        throw std::invalid_argument(string("Misformed friends list: ") + friends_list);
+      res.push_back (make_pair (friends_list.substr (start, delim-start),
+                                friends_list.substr (delim+1, end-delim-1)));
+      start = end+1;
+    }
+    return res;
+  }
+
+  template <typename F>
+  void time_it(const string& name, size_t iterations, F f) {
+    size_t sink {0};
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+      sink += f();
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const double ns {static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count())};
+    cout << "  " << name << ": " << ns / iterations << " ns/op"
+         << (sink == 0 ? " (empty)" : "") << endl;
+  }
+
+  void bench(size_t friends, size_t iterations) {
+    string text {};
+    for (size_t i = 0; i < friends; ++i) {
+      if (i > 0)
+        text += pair_separator;
+      text += "Country" + std::to_string(i % 50) + pair_delimiter + "Surname" + std::to_string(i) + ",Given";
+    }
+    const friends_list_t list {parse_friends_list(text)};
+    const friends_ref_list_t refs {parse_friends_refs(text)};
+
+    const std::vector<unsigned char> binary {encode_friends_binary(list)};
+
+    cout << friends << " friends (" << text.size() << " bytes, "
+         << binary.size() << " binary)" << endl;
+    time_it("find/substr parse        ", iterations, [&text] () { return find_substr_parse(text).size(); });
+    time_it("parse_friends_refs       ", iterations, [&text] () { return parse_friends_refs(text).size(); });
+    time_it("parse_friends_list       ", iterations, [&text] () { return parse_friends_list(text).size(); });
+    time_it("to_string (strings)      ", iterations, [&list] () { return friends_list_to_string(list).size(); });
+    time_it("to_string (refs)         ", iterations, [&refs] () { return friends_list_to_string(refs).size(); });
+    time_it("encode_friends_binary    ", iterations, [&list] () { return encode_friends_binary(list).size(); });
+    time_it("decode_friends_binary    ", iterations, [&binary] () { return decode_friends_binary(binary.data(), binary.size()).size(); });
+  }
+}
+
+int main (int argc, char const * argv[]) {
+  const size_t iterations {argc > 1 ? std::stoul(argv[1]) : 100000};
+  bench(1, iterations);
+  bench(20, iterations / 10 + 1);
+  bench(1000, iterations / 100 + 1);
+}
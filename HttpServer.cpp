@@ -0,0 +1,307 @@
+#include "HttpServer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+using std::size_t;
+using std::string;
+
+using boost::asio::io_service;
+using boost::asio::ip::tcp;
+using boost::system::error_code;
+
+namespace {
+  using reuse_port_option = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+  string lower (string s) {
+    std::transform(s.begin(), s.end(), s.begin(),
+                   [] (unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return s;
+  }
+
+  string trim (const string& s) {
+    const auto first = s.find_first_not_of(" \t");
+    if (first == string::npos)
+      return string {};
+    return s.substr(first, s.find_last_not_of(" \t") - first + 1);
+  }
+
+  // Reason phrases of the statuses the server itself sends
+  string refusal_reason (unsigned short status) {
+    switch (status) {
+    case 400: return "Bad Request";
+    case 411: return "Length Required";
+    case 413: return "Payload Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 505: return "HTTP Version Not Supported";
+    default: return "Error";
+    }
+  }
+}
+
+/*
+  Parse head, a request line and headers ending in a blank line,
+  into call, and set content_length and whether the connection
+  stays open after the response. Returns 0 if the server can take
+  the request, or else the status to refuse it with.
+ */
+unsigned short parse_http_head (const string& head, http_call_t& call,
+                                size_t& content_length, bool& keep_alive) {
+  size_t line_end {head.find("\r\n")};
+  if (line_end == string::npos)
+    return 400;
+  const string request_line {head.substr(0, line_end)};
+  const auto sp1 = request_line.find(' ');
+  const auto sp2 = request_line.rfind(' ');
+  if (sp1 == string::npos || sp2 == sp1)
+    return 400;
+  call.method = request_line.substr(0, sp1);
+  call.target = request_line.substr(sp1 + 1, sp2 - sp1 - 1);
+  const string version {request_line.substr(sp2 + 1)};
+  if (call.method.empty() || call.target.empty() || call.target[0] != '/')
+    return 400;
+  if (version != "HTTP/1.1" && version != "HTTP/1.0")
+    return 505;
+
+  keep_alive = version == "HTTP/1.1";
+  content_length = 0;
+  call.headers.clear();
+  for (size_t start = line_end + 2; start < head.size(); start = line_end + 2) {
+    line_end = head.find("\r\n", start);
+    if (line_end == string::npos || line_end == start)
+      break;
+    const string line {head.substr(start, line_end - start)};
+    const auto colon = line.find(':');
+    if (colon == string::npos || colon == 0)
+      return 400;
+    const string name {line.substr(0, colon)};
+    const string val {trim(line.substr(colon + 1))};
+    const string key {lower(name)};
+    if (key == "transfer-encoding")
+      return 411;
+    if (key == "content-length") {
+      if (val.empty() || val.find_first_not_of("0123456789") != string::npos || val.size() > 9)
+        return 400;
+      content_length = std::stoul(val);
+      if (content_length > max_http_body)
+        return 413;
+    }
+    else if (key == "connection") {
+      const string token {lower(val)};
+      if (token == "close")
+        keep_alive = false;
+      else if (token == "keep-alive")
+        keep_alive = true;
+    }
+    call.headers.emplace_back(name, val);
+  }
+  return 0;
+}
+
+/*
+  Return the status line, headers and body of answer
+ */
+string encode_http_answer (const http_answer_t& answer, bool keep_alive) {
+  string out {"HTTP/1.1 " + std::to_string(answer.status) + " " + answer.reason + "\r\n"};
+  out += "Content-Length: " + std::to_string(answer.body.size()) + "\r\n";
+  if (! answer.content_type.empty())
+    out += "Content-Type: " + answer.content_type + "\r\n";
+  if (! keep_alive)
+    out += "Connection: close\r\n";
+  out += "\r\n";
+  out += answer.body;
+  return out;
+}
+
+/*
+  One client's connection. Reads a request, waits for its
+  response, writes it, and reads the next. Everything but the
+  responder's call runs on the io thread.
+ */
+class HttpServer::connection : public std::enable_shared_from_this<connection> {
+private:
+  std::shared_ptr<io_service> io;
+  tcp::socket socket;
+  io_service::strand strand;
+  dispatcher_t dispatch;
+  boost::asio::streambuf inbox;
+  http_call_t call;
+  bool keep_alive;
+
+  void read_head();
+  void read_body(size_t content_length);
+  void answer();
+  void refuse(unsigned short status);
+  void write(const string& out);
+
+public:
+  connection (const std::shared_ptr<io_service>& io, const dispatcher_t& dispatch) :
+    io {io},
+    socket {*io},
+    strand {*io},
+    dispatch {dispatch},
+    inbox {max_http_head},
+    call {},
+    keep_alive {false}
+    {};
+
+  tcp::socket& get_socket() { return socket; }
+
+  void start() {
+    error_code ec;
+    socket.set_option(tcp::no_delay {true}, ec);
+    read_head();
+  }
+
+  void close() {
+    error_code ec;
+    socket.close(ec);
+  }
+};
+
+void HttpServer::connection::read_head() {
+  auto self (shared_from_this());
+  boost::asio::async_read_until(socket, inbox, "\r\n\r\n",
+    strand.wrap([self] (const error_code& ec, size_t size) {
+        if (ec == boost::asio::error::not_found) {
+          self->refuse(431);
+          return;
+        }
+        if (ec)
+          return;
+        const auto data = self->inbox.data();
+        const string head {boost::asio::buffers_begin(data), boost::asio::buffers_begin(data) + size};
+        self->inbox.consume(size);
+        size_t content_length {0};
+        const auto refused = parse_http_head(head, self->call, content_length, self->keep_alive);
+        if (refused != 0) {
+          self->refuse(refused);
+          return;
+        }
+        self->read_body(content_length);
+      }));
+}
+
+/*
+  Take the body from what was read past the head, reading the
+  rest from the socket if it has not all come yet
+ */
+void HttpServer::connection::read_body(size_t content_length) {
+  const size_t have {std::min(inbox.size(), content_length)};
+  const auto data = inbox.data();
+  call.body.assign(boost::asio::buffers_begin(data), boost::asio::buffers_begin(data) + have);
+  inbox.consume(have);
+  if (have == content_length) {
+    answer();
+    return;
+  }
+
+  call.body.resize(content_length);
+  auto self (shared_from_this());
+  boost::asio::async_read(socket, boost::asio::buffer(&call.body[have], content_length - have),
+    strand.wrap([self] (const error_code& ec, size_t) {
+        if (ec)
+          return;
+        self->answer();
+      }));
+}
+
+void HttpServer::connection::answer() {
+  auto self (shared_from_this());
+  dispatch(call, [self] (const http_answer_t& response) {
+      const string out {encode_http_answer(response, self->keep_alive)};
+      self->strand.post([self, out] () { self->write(out); });
+    });
+}
+
+void HttpServer::connection::refuse(unsigned short status) {
+  keep_alive = false;
+  write(encode_http_answer(http_answer_t {status, refusal_reason(status), string {}, string {}}, false));
+}
+
+void HttpServer::connection::write(const string& out) {
+  auto self (shared_from_this());
+  auto buffer (std::make_shared<string>(out));
+  boost::asio::async_write(socket, boost::asio::buffer(*buffer),
+    strand.wrap([self, buffer] (const error_code& ec, size_t) {
+        if (ec || ! self->keep_alive) {
+          error_code ignored;
+          self->socket.shutdown(tcp::socket::shutdown_both, ignored);
+          self->close();
+          return;
+        }
+        self->read_head();
+      }));
+}
+
+HttpServer::HttpServer (const string& host, unsigned short port, const dispatcher_t& dispatch) :
+  io {std::make_shared<io_service>()},
+  acceptor {*io},
+  host {host},
+  port {port},
+  dispatch {dispatch},
+  connections {},
+  io_thread {}
+{}
+
+HttpServer::~HttpServer () {
+  close();
+}
+
+/*
+  Start listening on host:port, sharing the port with any other
+  socket that set SO_REUSEPORT. Throws boost::system::system_error
+  if the port cannot be bound.
+ */
+void HttpServer::open() {
+  tcp::resolver resolver {*io};
+  const tcp::endpoint endpoint {*resolver.resolve(tcp::resolver::query {host, std::to_string(port)})};
+  acceptor.open(endpoint.protocol());
+  acceptor.set_option(tcp::acceptor::reuse_address {true});
+  acceptor.set_option(reuse_port_option {true});
+  acceptor.bind(endpoint);
+  acceptor.listen();
+  accept();
+  auto io_ref (io);
+  io_thread = std::thread {[io_ref] () { io_ref->run(); }};
+}
+
+void HttpServer::accept() {
+  auto conn (std::make_shared<connection>(io, dispatch));
+  acceptor.async_accept(conn->get_socket(), [this, conn] (const error_code& ec) {
+      if (ec == boost::asio::error::operation_aborted)
+        return;
+      if (! ec) {
+        conn->start();
+        connections.erase(std::remove_if(connections.begin(), connections.end(),
+                                         [] (const std::weak_ptr<connection>& c) { return c.expired(); }),
+                          connections.end());
+        connections.push_back(conn);
+      }
+      accept();
+    });
+}
+
+/*
+  Stop accepting and drop every connection. Responses still being
+  prepared are discarded.
+ */
+void HttpServer::close() {
+  if (! io_thread.joinable())
+    return;
+  io->post([this] () {
+      error_code ec;
+      acceptor.close(ec);
+      for (const auto& c : connections)
+        if (auto conn = c.lock())
+          conn->close();
+      connections.clear();
+    });
+  io_thread.join();
+}
@@ -0,0 +1,82 @@
+#ifndef HttpServer_h
+#define HttpServer_h
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+// Largest request head, and body, the server reads
+constexpr std::size_t max_http_head {64 * 1024};
+constexpr std::size_t max_http_body {16 * 1024 * 1024};
+
+using http_header_list_t = std::vector<std::pair<std::string,std::string>>;
+
+struct http_call_t {
+  std::string method;
+  std::string target;  // Path and query, as in the request line
+  http_header_list_t headers;
+  std::string body;
+};
+
+struct http_answer_t {
+  unsigned short status;
+  std::string reason;
+  std::string content_type;  // Empty for no body
+  std::string body;
+};
+
+unsigned short parse_http_head (const std::string& head, http_call_t& call,
+                                std::size_t& content_length, bool& keep_alive);
+
+std::string encode_http_answer (const http_answer_t& answer, bool keep_alive);
+
+/*
+  A small HTTP/1.1 server whose listening socket sets
+  SO_REUSEPORT, so every worker of a server can bind the server's
+  one port and the kernel spreads new connections among them.
+  cpprest's listener makes its own acceptor and cannot set the
+  option, so workers that share a port use this instead.
+
+  Requests on a connection are answered one at a time, in order;
+  bodies must carry Content-Length (chunked requests are refused
+  with 411). As with RpcServer, socket work runs on one thread of
+  the server's own, dispatch is called there and must hand the
+  work off, and the responder may be called once, from any
+  thread.
+ */
+class HttpServer {
+public:
+  using responder_t = std::function<void(const http_answer_t&)>;
+  using dispatcher_t = std::function<void(const http_call_t&, const responder_t&)>;
+
+private:
+  class connection;
+
+  std::shared_ptr<boost::asio::io_service> io;  // Connections hold it until they are gone
+  boost::asio::ip::tcp::acceptor acceptor;
+  std::string host;
+  unsigned short port;
+  dispatcher_t dispatch;
+  std::vector<std::weak_ptr<connection>> connections;  // Used on the io thread only
+  std::thread io_thread;
+
+  void accept();
+
+public:
+  HttpServer (const std::string& host, unsigned short port, const dispatcher_t& dispatch);
+  ~HttpServer ();
+
+  HttpServer (const HttpServer&) = delete;
+  HttpServer& operator= (const HttpServer&) = delete;
+
+  void open();
+  void close();
+};
+
+#endif
@@ -0,0 +1,332 @@
+#include "InternalRpc.h"
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include <cpprest/base_uri.h>
+#include <cpprest/http_msg.h>
+#include <cpprest/json.h>
+
+#include <pplx/pplxtasks.h>
+
+#include "HttpServer.h"
+#include "RpcChannel.h"
+#include "RpcFrame.h"
+#include "RpcServer.h"
+#include "make_unique.h"
+
+using std::cout;
+using std::endl;
+using std::pair;
+using std::string;
+
+using web::http::http_exception;
+using web::http::http_headers;
+using web::http::http_request;
+using web::http::http_response;
+using web::http::method;
+using web::http::status_code;
+using web::http::status_codes;
+using web::uri;
+
+using web::json::value;
+
+namespace {
+  std::atomic<bool> rpc_on {false};
+
+  /*
+    The client side's connections, one per server, and the thread
+    that runs them. Never destroyed, so calls made while the
+    process exits cannot find them gone.
+   */
+  struct channels_t {
+    std::shared_ptr<boost::asio::io_service> io;
+    boost::asio::io_service::work work;
+    std::thread io_thread;
+    std::unordered_map<string,std::shared_ptr<RpcChannel>> open;
+    // Servers whose RPC port refused us, and when to try it again
+    std::unordered_map<string,std::chrono::steady_clock::time_point> http_only;
+    pplx::extensibility::critical_section_t lock;
+
+    channels_t () :
+      io {std::make_shared<boost::asio::io_service>()},
+      work {*io},
+      io_thread {},
+      open {},
+      http_only {},
+      lock {}
+    {
+      auto io_ref (io);
+      io_thread = std::thread {[io_ref] () { io_ref->run(); }};
+    }
+  };
+
+  channels_t& channels () {
+    static channels_t* c {new channels_t {}};
+    return *c;
+  }
+
+  /*
+    Return a working channel to host:port, connecting a new one if
+    there is none yet or the last one broke. Returns nullptr if
+    the port cannot be reached, or could not within the last
+    rpc_retry_interval; the caller then uses HTTP, which fails in
+    its own way if the server is down altogether.
+
+    The connect is made without the lock, so a slow or unreachable
+    server does not hold up calls to the others. Threads that find
+    no channel at once may each connect; the first to finish keeps
+    its channel and the others use it, dropping their own.
+   */
+  std::shared_ptr<RpcChannel> channel_to (const string& host, unsigned short port) {
+    channels_t& c (channels());
+    const string key {host + ":" + std::to_string(port)};
+    {
+      const auto now = std::chrono::steady_clock::now();
+      pplx::extensibility::scoped_critical_section_t l {c.lock};
+      auto channel (c.open.find(key));
+      if (channel != c.open.end() && ! channel->second->broken())
+        return channel->second;
+      auto refused (c.http_only.find(key));
+      if (refused != c.http_only.end()) {
+        if (now < refused->second)
+          return nullptr;
+        c.http_only.erase(refused);
+      }
+    }
+
+    auto fresh (std::make_shared<RpcChannel>(c.io));
+    try {
+      fresh->connect(host, port);
+    }
+    catch (const std::exception& e) {
+      cout << "No RPC at " << key << ", using HTTP: " << e.what() << endl;
+      pplx::extensibility::scoped_critical_section_t l {c.lock};
+      c.http_only[key] = std::chrono::steady_clock::now() + rpc_retry_interval;
+      return nullptr;
+    }
+
+    pplx::extensibility::scoped_critical_section_t l {c.lock};
+    auto channel (c.open.find(key));
+    if (channel != c.open.end() && ! channel->second->broken()) {
+      fresh->close();
+      return channel->second;
+    }
+    c.open[key] = fresh;
+    return fresh;
+  }
+
+  /*
+    Answer request with the status and any JSON body of response
+   */
+  pplx::task<void> send_response (const rpc_request_t& request, http_response response,
+                                  const RpcServer::responder_t& respond) {
+    const auto id = request.id;
+    const status_code code {response.status_code()};
+    const http_headers& headers {response.headers()};
+    auto content_type (headers.find("Content-Type"));
+    if (content_type == headers.end() || content_type->second != "application/json") {
+      respond(rpc_response_t {id, code, string {}});
+      return pplx::task_from_result();
+    }
+    return response.extract_string(true)
+      .then([id, code, respond] (string body) {
+          respond(rpc_response_t {id, code, body});
+        });
+  }
+
+  /*
+    Pass message to handler, as the listener would, and its response
+    to answer; fail is called instead if the response cannot be read
+   */
+  void serve (const local_handler_t& handler, http_request message,
+              const std::function<pplx::task<void>(http_response)>& answer,
+              const std::function<void()>& fail) {
+    message.get_response()
+      .then(answer)
+      .then([fail] (pplx::task<void> sent) {
+          try {
+            sent.get();
+          }
+          catch (const std::exception&) {
+            fail();
+          }
+        });
+    try {
+      handler(message);
+    }
+    catch (const std::exception&) {
+      message.reply(status_codes::InternalError);
+    }
+  }
+
+  /*
+    Run handler on request in the thread pool, as the listener would
+  */
+  void dispatch (const local_handler_t& handler, const rpc_request_t& request,
+                 const RpcServer::responder_t& respond) {
+    pplx::create_task([handler, request, respond] () {
+        http_request message {request.method};
+        try {
+          message.set_request_uri(uri {request.path});
+        }
+        catch (const web::uri_exception&) {
+          respond(rpc_response_t {request.id, status_codes::BadRequest, string {}});
+          return;
+        }
+        if (! request.body.empty())
+          message.set_body(request.body, "application/json");
+
+        serve(handler, message,
+              [request, respond] (http_response response) {
+                return send_response(request, response, respond);
+              },
+              [request, respond] () {
+                respond(rpc_response_t {request.id, status_codes::InternalError, string {}});
+              });
+      });
+  }
+
+  /*
+    Run handler on call in the thread pool, as the listener would,
+    and answer with whatever the handler replies
+   */
+  void dispatch_http (const local_handler_t& handler, const http_call_t& call,
+                      const HttpServer::responder_t& respond) {
+    pplx::create_task([handler, call, respond] () {
+        http_request message {call.method};
+        try {
+          message.set_request_uri(uri {call.target});
+        }
+        catch (const web::uri_exception&) {
+          respond(http_answer_t {status_codes::BadRequest, "Bad Request", string {}, string {}});
+          return;
+        }
+        for (const auto& header : call.headers)
+          message.headers().add(header.first, header.second);
+        if (! call.body.empty()) {
+          const string content_type {message.headers().content_type()};
+          message.set_body(call.body, content_type.empty() ? string {"application/json"} : content_type);
+        }
+
+        serve(handler, message,
+              [respond] (http_response response) {
+                const status_code code {response.status_code()};
+                const string reason {response.reason_phrase()};
+                const http_headers& headers {response.headers()};
+                auto found (headers.find("Content-Type"));
+                const string type {found == headers.end() ? string {} : found->second};
+                return response.extract_vector()
+                  .then([respond, code, reason, type] (std::vector<unsigned char> body) {
+                      respond(http_answer_t {code, reason, body.empty() ? string {} : type,
+                            string {body.begin(), body.end()}});
+                    });
+              },
+              [respond] () {
+                respond(http_answer_t {status_codes::InternalError, "Internal Error", string {}, string {}});
+              });
+      });
+  }
+}
+
+/*
+  Send every do_request() over RPC, or none
+ */
+void enable_internal_rpc (bool on) {
+  rpc_on = on;
+}
+
+bool internal_rpc_enabled () {
+  return rpc_on;
+}
+
+/*
+  do_request() over RPC: put the same result into result, or
+  throw the same http_exception if the connection is lost or the
+  call times out. Returns false, sending nothing, if the server
+  takes no RPC; the caller then sends the request over HTTP.
+ */
+bool rpc_request (const method& http_method, const string& uri_string,
+                  const value& req_body, pair<status_code,value>& result) {
+  const uri target {uri_string};
+  auto channel (channel_to(target.host(), static_cast<unsigned short>(target.port() + rpc_port_offset)));
+  if (! channel)
+    return false;
+
+  rpc_request_t request {0, http_method, target.resource().to_string(),
+      req_body == value {} ? string {} : req_body.serialize()};
+  rpc_response_t response {};
+  try {
+    response = channel->call(request, rpc_call_timeout);
+  }
+  catch (const std::runtime_error& e) {
+    throw http_exception(e.what());
+  }
+  result = std::make_pair(response.status,
+                          response.body.empty() ? value::object() : value::parse(response.body));
+  return true;
+}
+
+/*
+  Open an RpcServer for the server listening at http_url, passing
+  its requests to handlers. With shared_port, the port is shared
+  with the server's other workers. Returns nullptr, and the server
+  runs with HTTP alone, if the port cannot be bound.
+ */
+std::unique_ptr<RpcServer> open_rpc_server (const string& http_url, const rpc_handlers_t& handlers,
+                                            bool shared_port) {
+  const uri listen_uri {http_url};
+  const unsigned short port {static_cast<unsigned short>(listen_uri.port() + rpc_port_offset)};
+  auto server (std::make_unique<RpcServer>(listen_uri.host(), port, shared_port,
+      [handlers] (const rpc_request_t& request, const RpcServer::responder_t& respond) {
+        auto handler (handlers.find(request.method));
+        if (handler == handlers.end()) {
+          respond(rpc_response_t {request.id, status_codes::MethodNotAllowed, string {}});
+          return;
+        }
+        dispatch(handler->second, request, respond);
+      }));
+  try {
+    server->open();
+  }
+  catch (const boost::system::system_error& e) {
+    cout << "Cannot take RPC on port " << port << ": " << e.what() << endl;
+    return nullptr;
+  }
+  cout << "Taking RPC on port " << port << endl;
+  return server;
+}
+
+/*
+  Open an HttpServer on the port of http_url, shared with the
+  server's other workers, passing its requests to handlers as the
+  server's http_listener would. Throws boost::system::system_error
+  if the port cannot be bound.
+ */
+std::unique_ptr<HttpServer> open_http_server (const string& http_url, const rpc_handlers_t& handlers) {
+  const uri listen_uri {http_url};
+  const unsigned short port {static_cast<unsigned short>(listen_uri.port())};
+  auto server (std::make_unique<HttpServer>(listen_uri.host(), port,
+      [handlers] (const http_call_t& call, const HttpServer::responder_t& respond) {
+        auto handler (handlers.find(call.method));
+        if (handler == handlers.end()) {
+          respond(http_answer_t {status_codes::MethodNotAllowed, "Method Not Allowed", string {}, string {}});
+          return;
+        }
+        dispatch_http(handler->second, call, respond);
+      }));
+  server->open();
+  return server;
+}
@@ -0,0 +1,67 @@
+#ifndef InternalRpc_h
+#define InternalRpc_h
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include <cpprest/http_msg.h>
+#include <cpprest/json.h>
+
+#include "HttpServer.h"
+#include "LocalTransport.h"
+#include "RpcServer.h"
+
+// As http_client's default timeout
+constexpr std::chrono::seconds rpc_call_timeout {30};
+// How long a server without an RPC port is sent HTTP before it is tried again
+constexpr std::chrono::seconds rpc_retry_interval {30};
+
+// A server's handlers, by method
+using rpc_handlers_t = std::unordered_map<web::http::method,local_handler_t>;
+
+/*
+  The servers' requests to each other over RpcFrame connections
+  instead of HTTP.
+
+  A server taking internal calls opens an RpcServer beside its
+  listener, on the port after the listener's, and hands each
+  request to the handler its listener would use, as an
+  http_request built in memory. A server making internal calls
+  turns on enable_internal_rpc(); do_request() then sends every
+  request it makes over the RPC port of the server in the URL, on
+  one connection per server shared by all threads. A server whose
+  RPC port refuses the connection, such as SessionServer, which
+  opens none, is sent HTTP instead, and its RPC port is tried
+  again after rpc_retry_interval.
+
+  A call not answered within rpc_call_timeout fails with
+  http_exception, as http_client's requests time out.
+
+  Handlers are unchanged, so paths are still URL paths and bodies
+  still JSON text; what goes is HTTP's headers, parsing and
+  connection handling.
+ */
+void enable_internal_rpc (bool on);
+bool internal_rpc_enabled ();
+
+bool
+rpc_request (const web::http::method& http_method, const std::string& uri_string,
+             const web::json::value& req_body,
+             std::pair<web::http::status_code,web::json::value>& result);
+
+std::unique_ptr<RpcServer>
+open_rpc_server (const std::string& http_url, const rpc_handlers_t& handlers,
+                 bool shared_port = false);
+
+/*
+  The listener of a server whose workers share its port, which
+  cpprest's http_listener cannot do (see WorkerLauncher.h). Handlers
+  see the same http_request they would from the listener.
+ */
+std::unique_ptr<HttpServer>
+open_http_server (const std::string& http_url, const rpc_handlers_t& handlers);
+
+#endif
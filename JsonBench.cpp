@@ -0,0 +1,98 @@
+/*
+  Benchmark of request body parsing: the servers' old
+  get_json_body(), which built a web::json::value and copied it
+  into a map, against JsonBody.
+
+  Usage: jsonbench [iterations]
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <cpprest/json.h>
+
+#include "JsonBody.h"
+
+using std::cout;
+using std::endl;
+using std::size_t;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+using web::json::value;
+
+namespace {
+  /*
+    The old get_json_body(), less extracting the body from the request
+   */
+  unordered_map<string,string> dom_string_map(const string& body) {
+    unordered_map<string,string> results {};
+    value json {value::parse(body)};
+    if (json.is_object()) {
+      for (const auto& v : json.as_object()) {
+        if (v.second.is_string()) {
+          results[v.first] = v.second.as_string();
+        }
+        else {
+          results[v.first] = v.second.serialize();
+        }
+      }
+    }
+    return results;
+  }
+
+  /*
+    Run f iterations times and print the mean time per call
+   */
+  template <typename F>
+  void time_it(const string& name, size_t iterations, F f) {
+    size_t sink {0};
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+      sink += f();
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const double ns {static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count())};
+    cout << "  " << name << ": " << ns / iterations << " ns/op"
+         << (sink == 0 ? " (empty)" : "") << endl;
+  }
+
+  void bench(const string& label, const string& body, const string& key, size_t iterations) {
+    cout << label << " (" << body.size() << " bytes)" << endl;
+    time_it("json::value + map   ", iterations, [&body] () {
+        return dom_string_map(body).size();
+      });
+    time_it("JsonBody + map      ", iterations, [&body] () {
+        return JsonBody {vector<unsigned char> {body.begin(), body.end()}}.to_string_map().size();
+      });
+    time_it("JsonBody + find     ", iterations, [&body, &key] () {
+        JsonBody parsed {vector<unsigned char> {body.begin(), body.end()}};
+        const JsonBody::field_t* f {parsed.find(key)};
+        return f == nullptr ? size_t {0} : f->second.size();
+      });
+  }
+}
+
+int main (int argc, char const * argv[]) {
+  const size_t iterations {argc > 1 ? std::stoul(argv[1]) : 100000};
+
+  bench("Password", "{\"Password\": \"user\"}", "Password", iterations);
+
+  bench("Entity update",
+        "{\"Friends\": \"USA;Trump,Donald|Canada;Trudeau,Justin\", \"Status\": \"Napping\", "
+        "\"Updates\": \"Hello\\nWorld\", \"born\": 1942, \"verified\": true}",
+        "Status", iterations);
+
+  string friends {};
+  for (int i = 0; i < 2000; ++i) {
+    if (i > 0)
+      friends += "|";
+    friends += "Country" + std::to_string(i % 50) + ";Surname" + std::to_string(i) + ",Given";
+  }
+  bench("Large friends list", "{\"Friends\": \"" + friends + "\"}", "Friends", iterations / 100 + 1);
+}
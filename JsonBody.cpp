@@ -0,0 +1,397 @@
+/*
+  Shared parser for JSON request bodies
+ */
+
+#include "JsonBody.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+
+#include "SimdScan.h"
+#include "StringRef.h"
+
+using std::size_t;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+using web::http::http_headers;
+using web::http::http_request;
+
+namespace {
+  inline bool is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+  }
+
+  inline void skip_space(const char*& p, const char* end) {
+    while (p < end && is_space(*p))
+      ++p;
+  }
+
+  /*
+    Advance p past the literal word, if it is there
+   */
+  bool skip_literal(const char*& p, const char* end, const char* word) {
+    const size_t n {std::strlen(word)};
+    if (static_cast<size_t>(end - p) < n || std::memcmp(p, word, n) != 0)
+      return false;
+    p += n;
+    return true;
+  }
+
+  int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+  }
+
+  /*
+    Read the four hex digits of a \u escape at p
+   */
+  bool read_hex4(const char*& p, const char* end, std::uint32_t& code) {
+    if (end - p < 4)
+      return false;
+    code = 0;
+    for (int i = 0; i < 4; ++i) {
+      const int d {hex_digit(p[i])};
+      if (d < 0)
+        return false;
+      code = (code << 4) | static_cast<std::uint32_t>(d);
+    }
+    p += 4;
+    return true;
+  }
+
+  void append_utf8(vector<char>& out, std::uint32_t code) {
+    if (code < 0x80) {
+      out.push_back(static_cast<char>(code));
+    }
+    else if (code < 0x800) {
+      out.push_back(static_cast<char>(0xC0 | (code >> 6)));
+      out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    }
+    else if (code < 0x10000) {
+      out.push_back(static_cast<char>(0xE0 | (code >> 12)));
+      out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    }
+    else {
+      out.push_back(static_cast<char>(0xF0 | (code >> 18)));
+      out.push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    }
+  }
+
+  /*
+    Return text with whitespace outside strings removed, which is
+    how web::json::value::serialize() writes objects and arrays
+   */
+  string compact(const string_ref& text) {
+    string out {};
+    out.reserve(text.size());
+    const char* p {text.begin()};
+    const char* end {text.end()};
+    while (p < end) {
+      if (*p == '"') {
+        // Copy the whole string, escapes included
+        const char* q {p + 1};
+        while (true) {
+          q = find_first_of2(q, end, '"', '\\');
+          if (q == end || *q == '"')
+            break;
+          q += 2;
+        }
+        const char* stop {q == end ? end : q + 1};
+        out.append(p, stop);
+        p = stop;
+      }
+      else {
+        if (!is_space(*p))
+          out.push_back(*p);
+        ++p;
+      }
+    }
+    return out;
+  }
+}
+
+JsonBody::JsonBody (vector<unsigned char>&& body) :
+  buffer {std::move(body)},
+  arena {},
+  fields {},
+  parsed {false}
+{
+  parsed = parse();
+  if (!parsed)
+    fields.clear();
+}
+
+JsonBody::JsonBody (const string& body) :
+  JsonBody {vector<unsigned char> {body.begin(), body.end()}}
+{}
+
+/*
+  Parse the string whose opening quote is just before p, leaving p
+  after its closing quote. Strings without escapes are referred to
+  where they are; others are unescaped into the arena.
+ */
+bool JsonBody::parse_string(const char*& p, const char* end, string_ref& out) {
+  const char* q {find_first_of2(p, end, '"', '\\')};
+  if (q == end)
+    return false;
+  if (*q == '"') {
+    out = string_ref {p, static_cast<size_t>(q - p)};
+    p = q + 1;
+    return true;
+  }
+
+  // Unescaped text is never longer than its source, so the arena,
+  // reserved to the size of the body, never needs to grow
+  const size_t start {arena.size()};
+  while (true) {
+    arena.insert(arena.end(), p, q);
+    if (q == end)
+      return false;
+    if (*q == '"')
+      break;
+    // *q is a backslash
+    if (end - q < 2)
+      return false;
+    p = q + 2;
+    switch (q[1]) {
+    case '"': arena.push_back('"'); break;
+    case '\\': arena.push_back('\\'); break;
+    case '/': arena.push_back('/'); break;
+    case 'b': arena.push_back('\b'); break;
+    case 'f': arena.push_back('\f'); break;
+    case 'n': arena.push_back('\n'); break;
+    case 'r': arena.push_back('\r'); break;
+    case 't': arena.push_back('\t'); break;
+    case 'u': {
+      std::uint32_t code;
+      if (!read_hex4(p, end, code))
+        return false;
+      if (code >= 0xD800 && code <= 0xDBFF) {
+        std::uint32_t low;
+        if (end - p < 2 || p[0] != '\\' || p[1] != 'u')
+          return false;
+        p += 2;
+        if (!read_hex4(p, end, low) || low < 0xDC00 || low > 0xDFFF)
+          return false;
+        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+      }
+      else if (code >= 0xDC00 && code <= 0xDFFF) {
+        return false;
+      }
+      append_utf8(arena, code);
+      break;
+    }
+    default:
+      return false;
+    }
+    q = find_first_of2(p, end, '"', '\\');
+  }
+  out = string_ref {arena.data() + start, arena.size() - start};
+  p = q + 1;
+  return true;
+}
+
+/*
+  Parse the value starting at p into field.second and field.type,
+  leaving p after it
+ */
+bool JsonBody::parse_value(const char*& p, const char* end, field_t& field) {
+  const char* start {p};
+  switch (*p) {
+  case '"':
+    field.type = json_type::string;
+    ++p;
+    return parse_string(p, end, field.second);
+
+  case '{':
+  case '[': {
+    field.type = *p == '{' ? json_type::object : json_type::array;
+    vector<char> open {};
+    while (p < end) {
+      const char c {*p};
+      if (c == '"') {
+        const char* q {p + 1};
+        while (true) {
+          q = find_first_of2(q, end, '"', '\\');
+          if (q == end)
+            return false;
+          if (*q == '"')
+            break;
+          q += 2;
+        }
+        p = q + 1;
+        continue;
+      }
+      if (c == '{' || c == '[') {
+        open.push_back(c == '{' ? '}' : ']');
+      }
+      else if (c == '}' || c == ']') {
+        if (open.empty() || open.back() != c)
+          return false;
+        open.pop_back();
+        if (open.empty()) {
+          ++p;
+          field.second = string_ref {start, static_cast<size_t>(p - start)};
+          return true;
+        }
+      }
+      ++p;
+    }
+    return false;
+  }
+
+  case 't':
+  case 'f':
+    field.type = json_type::boolean;
+    if (!skip_literal(p, end, "true") && !skip_literal(p, end, "false"))
+      return false;
+    field.second = string_ref {start, static_cast<size_t>(p - start)};
+    return true;
+
+  case 'n':
+    field.type = json_type::null;
+    if (!skip_literal(p, end, "null"))
+      return false;
+    field.second = string_ref {start, static_cast<size_t>(p - start)};
+    return true;
+
+  default: {
+    field.type = json_type::number;
+    bool digits {false};
+    while (p < end && (std::strchr("+-.eE", *p) != nullptr || (*p >= '0' && *p <= '9'))) {
+      digits = digits || (*p >= '0' && *p <= '9');
+      ++p;
+    }
+    field.second = string_ref {start, static_cast<size_t>(p - start)};
+    return digits && (*start == '-' || (*start >= '0' && *start <= '9'));
+  }
+  }
+}
+
+/*
+  Parse the buffer as a single JSON object
+ */
+bool JsonBody::parse() {
+  arena.reserve(buffer.size());
+  const char* p {reinterpret_cast<const char*>(buffer.data())};
+  const char* end {p + buffer.size()};
+
+  skip_space(p, end);
+  if (p == end || *p != '{')
+    return false;
+  ++p;
+  skip_space(p, end);
+  if (p < end && *p == '}') {
+    ++p;
+  }
+  else {
+    while (true) {
+      field_t field {};
+      if (p == end || *p != '"')
+        return false;
+      ++p;
+      if (!parse_string(p, end, field.first))
+        return false;
+      skip_space(p, end);
+      if (p == end || *p != ':')
+        return false;
+      ++p;
+      skip_space(p, end);
+      if (p == end || !parse_value(p, end, field))
+        return false;
+      fields.push_back(field);
+      skip_space(p, end);
+      if (p == end)
+        return false;
+      if (*p == '}') {
+        ++p;
+        break;
+      }
+      if (*p != ',')
+        return false;
+      ++p;
+      skip_space(p, end);
+    }
+  }
+  skip_space(p, end);
+  return p == end;
+}
+
+/*
+  Return the member called name, or nullptr if there is none.
+  If a name appears more than once, its last value is returned.
+ */
+const JsonBody::field_t* JsonBody::find(const string_ref& name) const {
+  for (auto f = fields.rbegin(); f != fields.rend(); ++f) {
+    if (f->first == name)
+      return &*f;
+  }
+  return nullptr;
+}
+
+/*
+  Return the members as a map of names to strings, the form the
+  servers' handlers have always used.
+
+  Strings are their unescaped contents; other values are their
+  JSON text, with objects and arrays compacted as
+  web::json::value::serialize() would write them. Numbers keep
+  the digits the client sent.
+ */
+unordered_map<string,string> JsonBody::to_string_map() const {
+  unordered_map<string,string> results {};
+  results.reserve(fields.size());
+  for (const auto& f : fields) {
+    if (f.type == json_type::object || f.type == json_type::array)
+      results[f.first.to_string()] = compact(f.second);
+    else
+      results[f.first.to_string()] = f.second.to_string();
+  }
+  return results;
+}
+
+/*
+  Read and parse an HTTP message's JSON body.
+
+  If the message has no body with Content-Type: application/json,
+  or the body is not a JSON object, the result is empty and not
+  valid().
+
+  THIS ROUTINE CAN ONLY BE CALLED ONCE FOR A GIVEN MESSAGE, as
+  the body can only be extracted once.
+ */
+JsonBody read_json_body(http_request message) {
+  const http_headers& headers {message.headers()};
+  auto content_type (headers.find("Content-Type"));
+  if (content_type == headers.end() ||
+      content_type->second.compare(0, content_type->second.find(';'), "application/json") != 0)
+    return JsonBody {};
+
+  return JsonBody {message.extract_vector().get()};
+}
+
+/*
+  Given an HTTP message with a JSON body, return the JSON
+  body as an unordered map of strings to strings.
+
+  Note that all types of JSON values are returned as strings.
+  Use C++ conversion utilities to convert to numbers or dates
+  as necessary, or read_json_body() to get the values' types.
+ */
+unordered_map<string,string> get_json_body(http_request message) {
+  return read_json_body(message).to_string_map();
+}
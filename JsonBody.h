@@ -0,0 +1,80 @@
+#ifndef JsonBody_h
+#define JsonBody_h
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+
+#include "StringRef.h"
+
+/*
+  The members of a JSON object request body, parsed in one pass
+  without building a web::json::value.
+
+  Names and values are string_refs into the body itself, or, for
+  strings containing escapes, into an arena holding their unescaped
+  form; either way they live as long as the JsonBody. A value keeps
+  its JSON type: strings are unescaped, other values are their text
+  from the body. Nested objects and arrays are checked only for
+  balanced brackets and quotes.
+
+  A JsonBody owns the buffers its refs point into, so it can be
+  moved but not copied.
+ */
+class JsonBody {
+public:
+  enum class json_type { string, number, boolean, null, object, array };
+
+  struct field_t {
+    string_ref first;   // Member name
+    string_ref second;  // Member value
+    json_type type;
+  };
+
+  using const_iterator = std::vector<field_t>::const_iterator;
+
+private:
+  std::vector<unsigned char> buffer;
+  std::vector<char> arena;  // Reserved up front, so never reallocated
+  std::vector<field_t> fields;
+  bool parsed;
+
+  bool parse();
+  bool parse_string(const char*& p, const char* end, string_ref& out);
+  bool parse_value(const char*& p, const char* end, field_t& field);
+
+public:
+  JsonBody () :
+    buffer {},
+    arena {},
+    fields {},
+    parsed {false}
+    {};
+
+  explicit JsonBody (std::vector<unsigned char>&& body);
+  explicit JsonBody (const std::string& body);
+
+  JsonBody (JsonBody&&) = default;
+  JsonBody& operator= (JsonBody&&) = default;
+  JsonBody (const JsonBody&) = delete;
+  JsonBody& operator= (const JsonBody&) = delete;
+
+  // True if the body was a well-formed JSON object
+  bool valid() const { return parsed; }
+
+  std::size_t size() const { return fields.size(); }
+  const_iterator begin() const { return fields.begin(); }
+  const_iterator end() const { return fields.end(); }
+  const field_t* find(const string_ref& name) const;
+
+  std::unordered_map<std::string,std::string> to_string_map() const;
+};
+
+JsonBody read_json_body(web::http::http_request message);
+
+std::unordered_map<std::string,std::string> get_json_body(web::http::http_request message);
+
+#endif
@@ -0,0 +1,46 @@
+#include "LocalTransport.h"
+
+#include <atomic>
+#include <string>
+
+#include <cpprest/base_uri.h>
+
+#include "ShardedMap.h"
+
+using std::string;
+
+using web::http::method;
+using web::uri;
+
+namespace {
+  // Four servers of at most four methods each
+  ShardedMap<local_handler_t> services {8};
+
+  // Lets processes that register nothing skip the lookup
+  std::atomic<bool> any_registered {false};
+
+  string service_key (const uri& u, const method& http_method) {
+    return http_method + " " + u.scheme() + "://" + u.host() + ":" + std::to_string(u.port());
+  }
+}
+
+/*
+  Register handler for http_method requests to the service
+  listening at base_url. Call before the service is used.
+ */
+void register_local_service (const string& base_url, const method& http_method,
+                             const local_handler_t& handler) {
+  services.assign(service_key(uri {base_url}, http_method), handler);
+  any_registered = true;
+}
+
+/*
+  Copy the handler for http_method requests to the service named
+  by request_url into handler. Returns false if there is none.
+ */
+bool find_local_service (const string& request_url, const method& http_method,
+                         local_handler_t& handler) {
+  if (! any_registered)
+    return false;
+  return services.find(service_key(uri {request_url}, http_method), handler);
+}
@@ -0,0 +1,32 @@
+#ifndef LocalTransport_h
+#define LocalTransport_h
+
+#include <functional>
+#include <string>
+
+#include <cpprest/http_msg.h>
+
+// A listener's handler for one method
+using local_handler_t = std::function<void(web::http::http_request)>;
+
+/*
+  Handlers of the servers running in this process, so that
+  do_request() can call them directly instead of going through
+  HTTP and the loopback interface.
+
+  Services are named by the scheme, host and port of their URL.
+  A request is dispatched locally only if its URL names a
+  registered service, by the same host name, and the service
+  registered the request's method; anything else goes over HTTP
+  as before. A handler must reply to every request it is given,
+  as do_request() waits for that reply.
+ */
+void register_local_service (const std::string& base_url,
+                             const web::http::method& http_method,
+                             const local_handler_t& handler);
+
+bool find_local_service (const std::string& request_url,
+                         const web::http::method& http_method,
+                         local_handler_t& handler);
+
+#endif
@@ -0,0 +1,60 @@
+#include "PartitionSalt.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace {
+  const char salt_separator {'~'};
+
+  /*
+    64-bit FNV-1a, fixed so every server computes the same
+    sub-partition whatever its standard library
+   */
+  std::uint64_t fnv1a (const string& s) {
+    std::uint64_t h {14695981039346656037ull};
+    for (unsigned char c : s) {
+      h ^= c;
+      h *= 1099511628211ull;
+    }
+    return h;
+  }
+}
+
+/*
+  Return the stored partition of the entity (partition, row)
+ */
+string PartitionSalt::salt(const string& partition, const string& row) const {
+  if (subs == 1)
+    return partition;
+  return partition + salt_separator + std::to_string(fnv1a(row) % subs);
+}
+
+/*
+  Return every stored partition that entities of partition may be in
+ */
+vector<string> PartitionSalt::all(const string& partition) const {
+  if (subs == 1)
+    return vector<string> {partition};
+  vector<string> result {};
+  result.reserve(subs);
+  for (unsigned k = 0; k < subs; ++k)
+    result.push_back(partition + salt_separator + std::to_string(k));
+  return result;
+}
+
+/*
+  Return the partition clients know a stored partition by
+ */
+string PartitionSalt::unsalt(const string& stored) const {
+  if (subs == 1)
+    return stored;
+  const auto sep = stored.rfind(salt_separator);
+  if (sep == string::npos || sep + 1 == stored.size() ||
+      stored.find_first_not_of("0123456789", sep + 1) != string::npos)
+    return stored;
+  return stored.substr(0, sep);
+}
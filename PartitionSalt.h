@@ -0,0 +1,39 @@
+#ifndef PartitionSalt_h
+#define PartitionSalt_h
+
+#include <string>
+#include <vector>
+
+/*
+  Spreads each DataTable partition over sub_partitions() stored
+  partitions, so that one popular country is not one hot
+  partition in Azure.
+
+  The entity (partition, row) is stored in partition
+  "<partition>~<k>", where k is the FNV-1a hash of row modulo
+  sub_partitions(). Clients still name it (partition, row): the
+  servers salt keys on the way in and strip the salt from keys on
+  the way out. '~' cannot appear in a country, and, unlike '#',
+  is allowed in a PartitionKey.
+
+  With one sub-partition, the default, keys are stored as given.
+  Every BasicServer and AuthServer sharing a DataTable must use the
+  same number, and changing it moves every entity: entities
+  written under one setting are not found under another.
+ */
+class PartitionSalt {
+private:
+  unsigned subs;
+
+public:
+  PartitionSalt () : subs {1} {};
+
+  void set_sub_partitions(unsigned k) { subs = k > 0 ? k : 1; }
+  unsigned sub_partitions() const { return subs; }
+
+  std::string salt(const std::string& partition, const std::string& row) const;
+  std::vector<std::string> all(const std::string& partition) const;
+  std::string unsalt(const std::string& stored) const;
+};
+
+#endif
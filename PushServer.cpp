@@ -1,5 +1,13 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <iostream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -12,6 +20,16 @@
 #include "make_unique.h"
 
 #include "ClientUtils.h"
+#include "FeedMailbox.h"
+#include "InternalRpc.h"
+#include "JsonBody.h"
+#include "LocalTransport.h"
+#include "ShardRouter.h"
+#include "WorkerLauncher.h"
+
+#ifdef COLOCATED
+namespace push_server {
+#endif
 
 using azure::storage::storage_exception;
 using azure::storage::cloud_table;
@@ -60,46 +78,56 @@ const string data_table_name {"DataTable"};
 const string read_entity_op {"ReadEntityAdmin"};
 const string update_entity_op {"UpdateEntityAdmin"};
 const string push_status_op {"PushStatus"};
+const string set_data_shards_admin {"SetDataShardsAdmin"};
 const string data_addr {"http://localhost:34568"};
+
+/*
+  BasicServer shards owning each DataTable entity. A single shard
+  at data_addr unless --data-shards or SetDataShardsAdmin sets
+  more.
+ */
+ShardRouter data_shards {data_addr};
 const string friend_updates {"Updates"};
+const string friend_prop {"Friends"};
+const string author_timeline {"Timeline"};
+const string feed_seen_prop {"FeedSeen"};  // Newest Timeline status merged into Updates
 
 /*
-  Given an HTTP message with a JSON body, return the JSON
-  body as an unordered map of strings to strings.
-
-  Note that all types of JSON values are returned as strings.
-  Use C++ conversion utilities to convert to numbers or dates
-  as necessary.
- */
-unordered_map<string,string> get_json_body(http_request message) {  
-  unordered_map<string,string> results {};
-  const http_headers& headers {message.headers()};
-  auto content_type (headers.find("Content-Type"));
-  if (content_type == headers.end() ||
-      content_type->second != "application/json")
-    return results;
-
-  value json{};
-  message.extract_json(true)
-    .then([&json](value v) -> bool
-          {
-            json = v;
-            return true;
-          })
-    .wait();
-
-  if (json.is_object()) {
-    for (const auto& v : json.as_object()) {
-      if (v.second.is_string()) {
-        results[v.first] = v.second.as_string();
-      }
-      else {
-        results[v.first] = v.second.serialize();
-      }
-    }
-  }
-  return results;
-}
+  PushTable lists the fan-out authors, one entity each in the
+  Fanout partition, so their timelines can be found after a restart
+ */
+const string create_table_op {"CreateTableAdmin"};
+const string push_table_name {"PushTable"};
+const string fanout_partition {"Fanout"};
+const string country_prop {"Country"};
+const string name_prop {"Name"};
+
+// Newest statuses kept in an author's Timeline
+constexpr std::size_t max_timeline {100};
+
+const string feed_op {"Feed"};
+const string updates_op {"Updates"};
+const string feed_wait_param {"wait"};
+
+// Default and longest time a Feed request is held open
+constexpr std::chrono::seconds def_feed_wait {30};
+constexpr std::chrono::seconds max_feed_wait {60};
+
+/*
+  Authors with more friends than this have their statuses fanned
+  out on read rather than appended to every friend's Updates: each
+  status is written once, to the Timeline of the author's entity,
+  and merged into a friend's Updates when that friend reads
+  (merge_timelines). Friends reading their feed also get it at
+  once (see FeedMailbox::publish). Set with --fanout-threshold.
+ */
+std::size_t fanout_threshold {1000};
+
+/*
+  Mailboxes of users currently reading their feed: at most 100
+  queued statuses each, dropped after 5 minutes without a poll
+ */
+FeedMailbox feed_mailbox {100, std::chrono::seconds {300}};
 
 
 /*
@@ -116,6 +144,222 @@ value build_json_object (const vector<pair<string,string>>& properties) {
 
 
 
+/*
+  Append a status to a newline-separated list property of an entity
+  in DataTable, reading the entity and merging the extended list back.
+
+  Returns the status code of the failing request, or OK.
+ */
+status_code append_status(const string& country, const string& name,
+                          const string& prop, const string& status) {
+  cout << "obtaining get " << country << " and " << name << endl;
+  pair<status_code, value> initial_result {
+    do_retrying_request(methods::GET, data_shards.route(data_table_name, country, name) + "/" + read_entity_op + "/" + 
+      data_table_name + "/" + country + "/" + name)
+  };
+  cout << initial_result.first << endl;
+  if(initial_result.first != status_codes::OK){
+    return initial_result.first;
+  }
+  string updated_status_list {get_json_object_prop(initial_result.second, prop)};
+  //Checks if the obtained new json prop is empty or not
+  if(updated_status_list == "") {
+    updated_status_list = status;
+  }
+  else {
+    //string concatenation of next statuses
+    updated_status_list = updated_status_list + "\n" + status; 
+  }
+  cout << updated_status_list << endl;
+  value updated_json_object {build_json_object(vector<pair<string,string>> {make_pair(prop, updated_status_list)})};
+
+  cout << "modifying and putting " << country << " and " << name << endl;
+  pair<status_code, value> updated_result {
+    do_retrying_request(methods::PUT, data_shards.route(data_table_name, country, name) + "/" + update_entity_op + "/" + 
+      data_table_name + "/" + country + "/" + name, updated_json_object)
+  };
+  return updated_result.first;
+}
+
+/*
+  Return the URI of a DataTable entity operation for a user
+ */
+string user_uri (const string& op, const string& country, const string& name) {
+  return data_shards.route(data_table_name, country, name) + "/" + op + "/" +
+    data_table_name + "/" + country + "/" + name;
+}
+
+/*
+  Parse a Timeline property: one "<seq> <status>" line per status,
+  oldest first. Lines that do not parse are skipped.
+ */
+vector<pair<std::uint64_t,string>> parse_timeline (const string& text) {
+  vector<pair<std::uint64_t,string>> posts {};
+  std::size_t start {0};
+  while (start < text.size()) {
+    std::size_t end {text.find('\n', start)};
+    if (end == string::npos)
+      end = text.size();
+    const std::size_t space {text.find(' ', start)};
+    if (space != string::npos && space > start && space < end) {
+      try {
+        posts.push_back(make_pair(std::stoull(text.substr(start, space - start)),
+                                  text.substr(space + 1, end - space - 1)));
+      }
+      catch (const std::exception&) {}
+    }
+    start = end + 1;
+  }
+  return posts;
+}
+
+/*
+  Append a status to the Timeline of a fan-out author's entity,
+  keeping the newest max_timeline.
+
+  Returns the status code of the failing request, or OK.
+ */
+status_code append_timeline (const string& country, const string& name,
+                             std::uint64_t seq, const string& status) {
+  pair<status_code,value> read_result {
+    do_retrying_request(methods::GET, user_uri(read_entity_op, country, name))};
+  if (read_result.first != status_codes::OK)
+    return read_result.first;
+
+  vector<pair<std::uint64_t,string>> posts {
+    parse_timeline(get_json_object_prop(read_result.second, author_timeline))};
+  posts.push_back(make_pair(seq, status));
+  const std::size_t first {posts.size() > max_timeline ? posts.size() - max_timeline : 0};
+  string timeline {};
+  for (std::size_t i = first; i < posts.size(); ++i) {
+    if (! timeline.empty())
+      timeline += "\n";
+    timeline += std::to_string(posts[i].first) + " " + posts[i].second;
+  }
+  return do_retrying_request(methods::PUT, user_uri(update_entity_op, country, name),
+                             build_json_object(prop_str_vals_t {make_pair(author_timeline, timeline)})).first;
+}
+
+/*
+  Load a fan-out author's stored Timeline and friends list into
+  feed_mailbox
+ */
+status_code load_author (const string& country, const string& name) {
+  pair<status_code,value> read_result {
+    do_retrying_request(methods::GET, user_uri(read_entity_op, country, name))};
+  if (read_result.first != status_codes::OK)
+    return read_result.first;
+  try {
+    feed_mailbox.load_timeline(country, name,
+                               parse_timeline(get_json_object_prop(read_result.second, author_timeline)),
+                               get_friends_prop(read_result.second, friend_prop));
+  }
+  catch (const std::exception& e) {
+    cout << "Bad friends list for " << country << "/" << name << ": " << e.what() << endl;
+    return status_codes::InternalError;
+  }
+  return status_codes::OK;
+}
+
+/*
+  Whether every fan-out author listed in PushTable has been loaded
+ */
+bool fanout_loaded {false};
+pplx::extensibility::critical_section_t fanout_lock {};
+
+/*
+  Load the fan-out authors listed in PushTable, once. Returns false,
+  to be tried again on the next call, if any of them could not be.
+ */
+bool load_fanout_authors () {
+  pplx::extensibility::scoped_critical_section_t lock {fanout_lock};
+  if (fanout_loaded)
+    return true;
+  status_code created {do_request(methods::POST, data_addr + "/" + create_table_op + "/" + push_table_name).first};
+  if (created != status_codes::Created && created != status_codes::Accepted)
+    return false;
+  pair<status_code,value> authors {
+    do_retrying_request(methods::GET, data_addr + "/" + read_entity_op + "/" + push_table_name +
+                        "/" + fanout_partition + "/*")};
+  if (authors.first != status_codes::OK || ! authors.second.is_array())
+    return false;
+  for (const auto& a : authors.second.as_array()) {
+    const string country {get_json_object_prop(a, country_prop)};
+    const string name {get_json_object_prop(a, name_prop)};
+    if (country != "" && name != "" && load_author(country, name) != status_codes::OK)
+      return false;
+  }
+  fanout_loaded = true;
+  return true;
+}
+
+/*
+  Make sure a fan-out author's timeline is in feed_mailbox, and
+  that they are listed in PushTable for the next restart
+ */
+status_code register_author (const string& country, const string& name) {
+  load_fanout_authors();
+  if (feed_mailbox.has_timeline(country, name))
+    return status_codes::OK;
+  status_code loaded {load_author(country, name)};
+  if (loaded != status_codes::OK)
+    return loaded;
+  return do_retrying_request(methods::PUT, data_addr + "/" + update_entity_op + "/" + push_table_name +
+                             "/" + fanout_partition + "/" + country + ";" + name,
+                             build_json_object(prop_str_vals_t {make_pair(country_prop, country),
+                                                                make_pair(name_prop, name)})).first;
+}
+
+/*
+  Merges into one user's Updates are serialized, so two reads do
+  not both append the same statuses
+ */
+constexpr std::size_t merge_stripes {64};
+pplx::extensibility::critical_section_t merge_locks[merge_stripes];
+
+/*
+  Append to a user's Updates the statuses of the fan-out authors
+  they follow that have not been merged yet, recording the newest
+  in FeedSeen. A user no fan-out author follows costs no request.
+
+  Returns the status code of the failing request, or OK, and the
+  user's Updates if it was read.
+ */
+pair<status_code,string> merge_timelines (const string& country, const string& name) {
+  load_fanout_authors();
+  if (feed_mailbox.unseen(country, name, 0).empty())
+    return make_pair(status_codes::OK, string {});
+
+  pplx::extensibility::scoped_critical_section_t lock {
+    merge_locks[std::hash<string> {}(country + "/" + name) % merge_stripes]};
+  pair<status_code,value> read_result {
+    do_retrying_request(methods::GET, user_uri(read_entity_op, country, name))};
+  if (read_result.first != status_codes::OK)
+    return make_pair(read_result.first, string {});
+
+  string updates {get_json_object_prop(read_result.second, friend_updates)};
+  std::uint64_t seen {0};
+  try {
+    seen = std::stoull(get_json_object_prop(read_result.second, feed_seen_prop));
+  }
+  catch (const std::exception&) {}
+  vector<pair<std::uint64_t,string>> posts {feed_mailbox.unseen(country, name, seen)};
+  if (posts.empty())
+    return make_pair(status_codes::OK, updates);
+
+  for (const auto& p : posts) {
+    if (! updates.empty())
+      updates += "\n";
+    updates += p.second;
+  }
+  status_code write_result {
+    do_retrying_request(methods::PUT, user_uri(update_entity_op, country, name),
+                        build_json_object(prop_str_vals_t {
+                            make_pair(friend_updates, updates),
+                            make_pair(feed_seen_prop, std::to_string(posts.back().first))})).first};
+  return make_pair(write_result, updates);
+}
+
 /*
   Top-level routine for processing all HTTP GET requests.
  */
@@ -128,7 +372,75 @@ void handle_get(http_request message) {
     message.reply(status_codes::BadRequest);
     return;
   }
-  message.reply(status_codes::NotImplemented);
+
+  /*
+    Feed/<country>/<name>[?wait=<seconds>]: long-poll for statuses
+    pushed to this user. Replies at once with any queued statuses,
+    otherwise holds the request until a status arrives or the wait
+    elapses (NoContent). wait=0 never holds the request.
+   */
+  /*
+    Updates/<country>/<name>: the user's Updates, with the statuses
+    of fan-out authors they follow merged in first
+   */
+  if (paths[0] == updates_op) {
+    if (paths.size() != 3) {
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+    pair<status_code,string> merged {merge_timelines(paths[1], paths[2])};
+    if (merged.first != status_codes::OK) {
+      message.reply(merged.first);
+      return;
+    }
+    if (merged.second.empty()) {
+      // Nothing to merge, so the entity was not read
+      pair<status_code,value> read_result {
+        do_retrying_request(methods::GET, user_uri(read_entity_op, paths[1], paths[2]))};
+      if (read_result.first != status_codes::OK) {
+        message.reply(read_result.first);
+        return;
+      }
+      merged.second = get_json_object_prop(read_result.second, friend_updates);
+    }
+    message.reply(status_codes::OK, build_json_object(prop_str_vals_t {make_pair(friend_updates, merged.second)}));
+    return;
+  }
+
+  if (paths[0] == feed_op) {
+    if (paths.size() != 3) {
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+    std::chrono::seconds wait {def_feed_wait};
+    auto query = uri::split_query(message.relative_uri().query());
+    auto wait_param = query.find(feed_wait_param);
+    if (wait_param != query.end()) {
+      try {
+        std::size_t used {0};
+        const int seconds {std::stoi(wait_param->second, &used)};
+        // Reject trailing characters, as in "5abc"
+        if (used != wait_param->second.size()) {
+          message.reply(status_codes::BadRequest);
+          return;
+        }
+        wait = std::chrono::seconds {std::max(0, seconds)};
+      }
+      catch (const std::exception&) {
+        message.reply(status_codes::BadRequest);
+        return;
+      }
+      wait = std::min(wait, max_feed_wait);
+    }
+    // A read: fan-out statuses missed while not polling go into Updates now
+    pair<status_code,string> merged {merge_timelines(paths[1], paths[2])};
+    if (merged.first != status_codes::OK)
+      cout << "Timeline merge for " << paths[1] << "/" << paths[2] << " failed: " << merged.first << endl;
+    feed_mailbox.poll(paths[1], paths[2], message, wait);
+    return;
+  }
+
+  message.reply(status_codes::BadRequest);
 }
 
 /*
@@ -139,6 +451,17 @@ void handle_post(http_request message) {
   cout << endl << "**** PushServer POST " << path << endl;
   //split path into paths
   auto paths = uri::split_path(path);
+  //SetDataShardsAdmin/<count>: send DataTable requests to count shards from now on
+  if (paths.size() == 2 && paths[0] == set_data_shards_admin) {
+    try {
+      data_shards.set_shards(shard_addrs(data_addr, paths[1]));
+      message.reply(status_codes::OK);
+    }
+    catch (const std::invalid_argument&) {
+      message.reply(status_codes::BadRequest);
+    }
+    return;
+  }
   //need at least an operation, usercountry, username, and status
   if (paths.size() < 4){
     message.reply(status_codes::BadRequest);
@@ -148,70 +471,68 @@ void handle_post(http_request message) {
   unordered_map<string,string> json_body{get_json_body (message)};
   if(paths[0] != push_status_op) {
     message.reply(status_codes::BadRequest);
+    return;
   }
-  //do push status
-  if(paths[0] == push_status_op && json_body.size() == 1){
+  //do push status; Friends is in text form, or binary as UserServer sends it
+  if(json_body.find(friend_prop) != json_body.end()){
     //store everything in message into individual strings
     string user_country {paths[1]};
     string user_name {paths[2]};
     string user_status {paths[3]};
 
-    //grab the string of friends in a vector
-    string friends_string{};
-    for(const auto v : json_body) {
-      friends_string = string(v.second);
+    //read the friends list in whichever form it came
+    friends_list_t update_list {};
+    try {
+      update_list = get_friends_prop(build_json_object(prop_str_vals_t (json_body.begin(), json_body.end())),
+                                     friend_prop);
+    }
+    catch (const std::exception& e) {
+      cout << "Bad friends list: " << e.what() << endl;
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+
+    //authors with huge friend lists are fanned out on read: one Timeline write,
+    //merged into each friend's Updates when they read
+    if (update_list.size() > fanout_threshold) {
+      cout << "fanning out on read to " << update_list.size() << " friends" << endl;
+      status_code registered {register_author(user_country, user_name)};
+      if (registered != status_codes::OK) {
+        message.reply(registered);
+        return;
+      }
+      const std::uint64_t seq {feed_mailbox.publish(user_country, user_name, user_status, update_list)};
+      message.reply(append_timeline(user_country, user_name, seq, user_status));
+      return;
+    }
+
+    //hand the status straight to friends reading their feed
+    for (const auto& f : update_list) {
+      feed_mailbox.deliver(f.first, f.second, user_status);
     }
-     //parse the the friend string for the first item in vector array
-    friends_list_t update_list = {parse_friends_list(friends_string)};
 
     //Iterates through each item in json body
     cout << "requesting friends list from datatable" << endl;
+    status_code result {status_codes::OK};
     for(int i = 0; i < update_list.size(); i++) {
-      cout << "obtaining get " << update_list[i].first << " and " << update_list[i].second << endl;
-      string friend_country {update_list[i].first};
-      string friend_name {update_list[i].second};
-      //Obtain the friends list from data table using handle GET
-      pair<status_code, value> initial_result {
-        do_request(methods::GET, data_addr + "/" + read_entity_op + "/" + 
-          data_table_name + "/" + friend_country + "/" + friend_name)
-      };
-      cout << initial_result.first << endl;
-      if(initial_result.first == status_codes::OK){
-        //Gives status code OK if obtained
-        cout << "obtained OK" << endl;
-        //Updates the initial friends list
-        string updates = get_json_object_prop(initial_result.second, friend_updates);
-        string updated_status_list {updates};
-        //Checks if the obtained new json prop is empty or not
-        if(updates == "") {
-          //initializses it as first status in parameter
-          updated_status_list = paths[3];
-        }
-        else {
-          //string concatenation of next statuses
-          updated_status_list = updated_status_list + "\n" + paths[3]; 
-        }
-        cout << updated_status_list << endl;
-        //Rebuilds the updated list into the json body
-        value updated_json_object {build_json_object(vector<pair<string,string>> {make_pair(friend_updates, updated_status_list)})};
-
-        //Updates the Update table in datatable using handle PUT
-        cout << "modifying and putting " << update_list[i].first << " and " << update_list[i].second << endl;
-        pair<status_code, value> updated_result {
-          do_request(methods::PUT, data_addr + "/" + update_entity_op + "/" + 
-            data_table_name + "/" + friend_country + "/" + friend_name, updated_json_object)
-        };
-        assert(updated_result.first == status_codes::OK);
-        cout << "updated OK" << endl;
+      status_code updated_result {append_status(update_list[i].first, update_list[i].second, friend_updates, user_status)};
+      if(updated_result == status_codes::NotFound){
+        cout << "Non existant person" << endl;
+      }
+      else if(updated_result != status_codes::OK){
+        //retries are used up; carry on with the other friends
+        cout << "update failed: " << updated_result << endl;
+        result = updated_result;
       }
       else{
-        cout << "Non existant person" << endl;
+        cout << "updated OK" << endl;
       }
     }
-    //After attempting to update, send status OK
-    message.reply(status_codes::OK);
+    //After attempting every update, send OK or the last failure
+    message.reply(result);
     return;  
   }
+  message.reply(status_codes::BadRequest);
 }
 
 /*
@@ -231,20 +552,72 @@ void handle_delete(http_request message) {
 }
 
 
+#ifdef COLOCATED
+int run (int argc, char const * argv[]) {
+#else
 int main (int argc, char const * argv[]) {
+#endif
+  // Feeds live in this process, so it runs as one worker
+  WorkerLauncher launcher {false};
+  retry_policy_t request_policy {};
+  breaker_policy_t breaker_policy {};
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (launcher.parse_option(argv[i], argv[i+1]))
+      continue;
+    else if (parse_retry_option(argv[i], argv[i+1], request_policy))
+      continue;
+    else if (parse_breaker_option(argv[i], argv[i+1], breaker_policy))
+      continue;
+    else if (string(argv[i]) == "--fanout-threshold")
+      fanout_threshold = std::stoul(argv[i+1]);
+    else if (string(argv[i]) == "--data-shards")
+      data_shards.set_shards(shard_addrs(data_addr, string(argv[i+1])));
+    else if (string(argv[i]) == "--internal-rpc")
+      enable_internal_rpc(string(argv[i+1]) == "on");
+  }
+  launcher.start();
+  set_request_policy(request_policy);
+  set_breaker_policy(breaker_policy);
+  cout << "PushServer: Fan-out on read above " << fanout_threshold << " friends" << endl;
+  if (! load_fanout_authors())
+    cout << "PushServer: Fan-out authors not loaded yet; will retry on the next request" << endl;
+
+  cout << "PushServer: Starting feed expiry" << endl;
+  std::atomic<bool> stopping {false};
+  std::thread feed_expiry {[&stopping] () {
+      while (! stopping) {
+        std::this_thread::sleep_for(std::chrono::milliseconds {500});
+        feed_mailbox.expire();
+      }
+    }};
+
   cout << "PushServer: Opening listener" << endl;
-  http_listener listener {def_url};
-  //listener.support(methods::GET, &handle_get);
+  http_listener listener {launcher.url(def_url)};
+  listener.support(methods::GET, &handle_get);
   listener.support(methods::POST, &handle_post);
   //listener.support(methods::PUT, &handle_put);
   //listener.support(methods::DEL, &handle_delete);
   listener.open().wait(); // Wait for listener to complete starting
+#ifdef COLOCATED
+  register_local_service(launcher.url(def_url), methods::GET, &handle_get);
+  register_local_service(launcher.url(def_url), methods::POST, &handle_post);
+#endif
+  auto rpc_server (open_rpc_server(launcher.url(def_url), rpc_handlers_t {
+      {methods::GET, &handle_get},
+      {methods::POST, &handle_post}}));
 
   cout << "Enter carriage return to stop PushServer." << endl;
-  string line;
-  getline(std::cin, line);
+  launcher.wait_for_stop();
 
   // Shut it down
   listener.close().wait();
+  rpc_server.reset();
+  stopping = true;
+  feed_expiry.join();
   cout << "PushServer closed" << endl;
-}
\ No newline at end of file
+  return 0;
+}
+
+#ifdef COLOCATED
+}
+#endif
@@ -0,0 +1,245 @@
+#include "RemoteSessionStore.h"
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_client.h>
+#include <cpprest/json.h>
+
+#include <pplx/pplxtasks.h>
+
+#include "ClientUtils.h"
+
+using std::cout;
+using std::endl;
+using std::make_pair;
+using std::pair;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+using web::http::method;
+using web::http::methods;
+using web::http::status_code;
+using web::http::status_codes;
+
+using web::json::value;
+
+// SessionServer operations
+const string session_op {"Session"};
+const string lookup_op {"Lookup"};
+const string sign_on_op {"SignOn"};
+const string sign_off_op {"SignOff"};
+const string expire_op {"Expire"};
+const string set_token_op {"SetToken"};
+const string size_op {"Size"};
+
+const string token_field {"Token"};
+const string token_expiry_field {"TokenExpiry"};
+const string size_field {"Size"};
+
+/*
+  Make a request of the SessionServer. A SessionServer that cannot
+  be reached gives ServiceUnavailable.
+ */
+pair<status_code,value> RemoteSessionStore::call(const method& m, const string& path, const value& body) {
+  try {
+    return do_request(m, addr + "/" + path, body);
+  }
+  catch (const std::exception& e) {
+    cout << "SessionServer " << path << " failed: " << e.what() << endl;
+    return make_pair(status_codes::ServiceUnavailable, value {});
+  }
+}
+
+/*
+  Drop what this process holds for a session that has ended
+ */
+void RemoteSessionStore::forget(const string& userid) {
+  cache.erase(userid);
+  pushes.erase(userid);
+}
+
+/*
+  Send one Lookup for every user with a lookup waiting, and
+  answer their waiters. Rounds are sent until no lookup is left
+  waiting, on the thread that sent the first: the waiters block
+  pool threads, so a round posted to the pool could wait behind
+  them forever.
+ */
+void RemoteSessionStore::send_lookups() {
+  for (;;) {
+    unordered_map<string,vector<pplx::task_completion_event<found_t>>> batch {};
+    {
+      pplx::extensibility::scoped_critical_section_t lock {pending_lock};
+      batch.swap(pending);
+      if (batch.empty()) {
+        sending = false;
+        return;
+      }
+    }
+
+    value userids {value::array(batch.size())};
+    size_t i {0};
+    for (const auto& b : batch)
+      userids[i++] = value::string(b.first);
+
+    value sessions {};
+    pair<status_code,value> result {call(methods::POST, lookup_op, userids)};
+    if (result.first == status_codes::OK)
+      sessions = result.second;
+    else
+      cout << "Session lookup failed: " << result.first << endl;
+
+    const auto now = std::chrono::steady_clock::now();
+    for (const auto& b : batch) {
+      found_t found {false, session_t {}};
+      if (sessions.is_object() && sessions.has_field(b.first) &&
+          session_from_json(sessions.at(b.first), found.second)) {
+        found.first = true;
+        cache.assign(b.first, cached_t {found.second, now});
+      }
+      for (const auto& waiter : b.second)
+        waiter.set(found);
+    }
+  }
+}
+
+/*
+  Copy a user's session into session, counting it as activity on
+  the SessionServer unless it comes from the cache
+ */
+bool RemoteSessionStore::lookup(const string& userid, session_t& session) {
+  cached_t cached;
+  if (cache.find(userid, cached) &&
+      std::chrono::steady_clock::now() - cached.fetched < cache_ttl) {
+    session = cached.session;
+    return true;
+  }
+
+  pplx::task_completion_event<found_t> answer {};
+  bool send {false};
+  {
+    pplx::extensibility::scoped_critical_section_t lock {pending_lock};
+    pending[userid].push_back(answer);
+    if (! sending)
+      sending = send = true;
+  }
+  if (send)
+    send_lookups();
+
+  const found_t found {pplx::create_task(answer).get()};
+  if (! found.first) {
+    cache.erase(userid);
+    return false;
+  }
+  session = found.second;
+  return true;
+}
+
+/*
+  Copy a user's session as the SessionServer has it now, without
+  counting it as activity or using the cache
+ */
+bool RemoteSessionStore::peek(const string& userid, session_t& session) {
+  pair<status_code,value> result {call(methods::GET, session_op + "/" + userid)};
+  return result.first == status_codes::OK && session_from_json(result.second, session);
+}
+
+/*
+  Record a new session in the SessionServer. Conflict from it means
+  the user is already signed on; any other failure, including no
+  answer, is unavailable.
+ */
+sign_on_result_t RemoteSessionStore::sign_on(const string& userid, const session_t& session) {
+  session_t s {session};
+  s.last_activity = std::chrono::steady_clock::now();
+  s.entity = value {};
+  pair<status_code,value> result {call(methods::PUT, sign_on_op + "/" + userid,
+                                       session_to_json(s))};
+  if (result.first == status_codes::Conflict)
+    return sign_on_result_t::already_signed_on;
+  if (result.first != status_codes::OK)
+    return sign_on_result_t::unavailable;
+  cache.assign(userid, cached_t {s, std::chrono::steady_clock::now()});
+  return sign_on_result_t::signed_on;
+}
+
+bool RemoteSessionStore::sign_off(const string& userid) {
+  forget(userid);
+  pair<status_code,value> result {call(methods::DEL, sign_off_op + "/" + userid)};
+  return result.first == status_codes::OK;
+}
+
+bool RemoteSessionStore::expire(const string& userid, std::uint64_t generation) {
+  pair<status_code,value> result {call(methods::DEL, expire_op + "/" + userid +
+                                       "/" + std::to_string(generation))};
+  if (result.first != status_codes::OK)
+    return false;
+  forget(userid);
+  return true;
+}
+
+bool RemoteSessionStore::set_token(const string& userid, std::uint64_t generation,
+                                   const string& token,
+                                   std::chrono::system_clock::time_point expiry) {
+  const auto expiry_ms = std::chrono::duration_cast<std::chrono::milliseconds>(expiry.time_since_epoch()).count();
+  pair<status_code,value> result {call(methods::PUT, set_token_op + "/" + userid +
+                                       "/" + std::to_string(generation),
+                                       build_json_value(token_field, token,
+                                                        token_expiry_field, std::to_string(expiry_ms)))};
+  if (result.first != status_codes::OK)
+    return false;
+  cache.update(userid, [&token, expiry] (cached_t& c) {
+      c.session.token = token;
+      c.session.token_expiry = expiry;
+    });
+  return true;
+}
+
+bool RemoteSessionStore::cache_entity(const string&, const value&) {
+  return false;
+}
+
+bool RemoteSessionStore::merge_entity(const string&, const vector<pair<string,string>>&) {
+  return false;
+}
+
+bool RemoteSessionStore::drop_entity(const string&) {
+  return false;
+}
+
+/*
+  As LocalSessionStore::queue_push(), for the pushes started by
+  this process. An entry is removed when its push completes,
+  unless a later push has replaced it.
+ */
+pplx::task<void> RemoteSessionStore::queue_push(const string& userid, const pplx::task<void>& push) {
+  pplx::task<void> previous {pplx::task_from_result()};
+  while (! pushes.update(userid, [&previous, &push] (pplx::task<void>& last) {
+        previous = last;
+        last = push;
+      })) {
+    if (pushes.insert(userid, push))
+      break;
+  }
+  push.then([this, userid, push] (pplx::task<void>) {
+      pushes.erase_if(userid, [&push] (const pplx::task<void>& last) {
+          return last == push;
+        });
+    });
+  return previous;
+}
+
+std::size_t RemoteSessionStore::size() {
+  pair<status_code,value> result {call(methods::GET, size_op)};
+  if (result.first != status_codes::OK)
+    return 0;
+  return std::stoul(get_json_object_prop(result.second, size_field));
+}
@@ -0,0 +1,89 @@
+#ifndef RemoteSessionStore_h
+#define RemoteSessionStore_h
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+#include <cpprest/json.h>
+
+#include <pplx/pplxtasks.h>
+
+#include "SessionStore.h"
+#include "ShardedMap.h"
+
+/*
+  Sessions held by a SessionServer, shared by every UserServer
+  that uses it.
+
+  Sessions that lookup() finds are cached here for cache_ttl, so a
+  busy user costs the SessionServer about one request per
+  cache_ttl. A session signed off through another UserServer can
+  therefore still be found here for up to cache_ttl.
+
+  Lookups that miss the cache are sent in batches. The first
+  waiting thread sends one request for every user then waiting;
+  lookups that arrive while it is in flight wait for the next one,
+  which the same thread sends once the first is answered.
+
+  Cached entities are per process, so another UserServer's write
+  would make them stale; this store does not keep them, and every
+  read goes to DataTable. Status pushes are ordered within this
+  process only.
+ */
+class RemoteSessionStore : public SessionStore {
+private:
+  struct cached_t {
+    session_t session;
+    std::chrono::steady_clock::time_point fetched;
+  };
+  using found_t = std::pair<bool,session_t>;
+
+  std::string addr;
+  std::chrono::milliseconds cache_ttl;
+  ShardedMap<cached_t> cache;
+  ShardedMap<pplx::task<void>> pushes;
+
+  std::unordered_map<std::string,std::vector<pplx::task_completion_event<found_t>>> pending;
+  bool sending;
+  pplx::extensibility::critical_section_t pending_lock;
+
+  std::pair<web::http::status_code,web::json::value>
+  call(const web::http::method& m, const std::string& path,
+       const web::json::value& body = web::json::value {});
+  void send_lookups();
+  void forget(const std::string& userid);
+
+public:
+  RemoteSessionStore (const std::string& addr, std::chrono::milliseconds cache_ttl) :
+    addr {addr},
+    cache_ttl {cache_ttl},
+    cache {},
+    pushes {},
+    pending {},
+    sending {false},
+    pending_lock {}
+    {};
+
+  bool lookup(const std::string& userid, session_t& session) override;
+  bool peek(const std::string& userid, session_t& session) override;
+  sign_on_result_t sign_on(const std::string& userid, const session_t& session) override;
+  bool sign_off(const std::string& userid) override;
+  bool expire(const std::string& userid, std::uint64_t generation) override;
+  bool set_token(const std::string& userid, std::uint64_t generation,
+                 const std::string& token,
+                 std::chrono::system_clock::time_point expiry) override;
+  bool cache_entity(const std::string& userid, const web::json::value& entity) override;
+  bool merge_entity(const std::string& userid,
+                    const std::vector<std::pair<std::string,std::string>>& props) override;
+  bool drop_entity(const std::string& userid) override;
+  pplx::task<void> queue_push(const std::string& userid, const pplx::task<void>& push) override;
+  std::size_t size() override;
+};
+
+#endif
@@ -0,0 +1,83 @@
+#include "Resilience.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <random>
+#include <string>
+#include <vector>
+
+using std::size_t;
+using std::string;
+using std::vector;
+
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+
+constexpr size_t LatencyTracker::window;
+constexpr size_t LatencyTracker::min_samples;
+
+/*
+  Take --retry-attempts N, --retry-budget-ms N, --retry-base-ms N,
+  --retry-cap-ms N and --hedge-reads on|off into policy. Returns
+  false if flag is none of them, so the caller can try its own
+  options.
+ */
+bool parse_retry_option (const string& flag, const string& val, retry_policy_t& policy) {
+  if (flag == "--retry-attempts")
+    policy.max_attempts = std::max(1ul, std::stoul(val));
+  else if (flag == "--retry-budget-ms")
+    policy.budget = milliseconds {std::stol(val)};
+  else if (flag == "--retry-base-ms")
+    policy.base_delay = milliseconds {std::max(1l, std::stol(val))};
+  else if (flag == "--retry-cap-ms")
+    policy.max_delay = milliseconds {std::stol(val)};
+  else if (flag == "--hedge-reads")
+    policy.hedge_reads = val == "on";
+  else
+    return false;
+  return true;
+}
+
+Backoff::Backoff (const retry_policy_t& policy) :
+  base {policy.base_delay},
+  cap {std::max(policy.max_delay, policy.base_delay)},
+  previous {policy.base_delay},
+  random {std::random_device {}()}
+{}
+
+/*
+  Return the delay before the next retry
+ */
+milliseconds Backoff::next() {
+  std::uniform_int_distribution<milliseconds::rep> pick {base.count(), std::max(base.count(), 3 * previous.count())};
+  previous = std::min(cap, milliseconds {pick(random)});
+  return previous;
+}
+
+void LatencyTracker::record(microseconds latency) {
+  pplx::extensibility::scoped_critical_section_t l {lock};
+  if (samples.size() < window)
+    samples.push_back(latency);
+  else
+    samples[next] = latency;
+  next = (next + 1) % window;
+}
+
+/*
+  Put the p-th quantile of the recent samples, 0 < p < 1, into
+  latency. Returns false if there are too few samples yet.
+ */
+bool LatencyTracker::percentile(double p, microseconds& latency) {
+  vector<microseconds> sorted;
+  {
+    pplx::extensibility::scoped_critical_section_t l {lock};
+    if (samples.size() < min_samples)
+      return false;
+    sorted = samples;
+  }
+  const size_t k {std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))};
+  std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+  latency = sorted[k];
+  return true;
+}
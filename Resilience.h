@@ -0,0 +1,174 @@
+#ifndef Resilience_h
+#define Resilience_h
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+/*
+  How hard to try one logical call: at most max_attempts attempts,
+  all within budget, with backoff delays between base_delay and
+  max_delay. hedge_reads lets idempotent reads send a second
+  attempt once the first has run longer than most do.
+ */
+struct retry_policy_t {
+  unsigned max_attempts {3};
+  std::chrono::milliseconds base_delay {20};
+  std::chrono::milliseconds max_delay {1000};
+  std::chrono::milliseconds budget {3000};
+  bool hedge_reads {false};
+};
+
+bool parse_retry_option(const std::string& flag, const std::string& val, retry_policy_t& policy);
+
+/*
+  Decorrelated-jitter backoff: each delay is drawn uniformly from
+  [base_delay, 3 * previous delay], capped at max_delay. Callers
+  retrying together spread out instead of returning in waves.
+ */
+class Backoff {
+private:
+  std::chrono::milliseconds base;
+  std::chrono::milliseconds cap;
+  std::chrono::milliseconds previous;
+  std::minstd_rand random;
+
+public:
+  explicit Backoff (const retry_policy_t& policy);
+
+  std::chrono::milliseconds next();
+};
+
+/*
+  Recent latencies of one kind of call, to tell how long one
+  usually takes. Keeps the last window samples.
+ */
+class LatencyTracker {
+public:
+  static constexpr std::size_t window {256};
+  // Fewer samples than this give no percentile
+  static constexpr std::size_t min_samples {20};
+
+private:
+  std::vector<std::chrono::microseconds> samples;
+  std::size_t next;
+  pplx::extensibility::critical_section_t lock;
+
+public:
+  LatencyTracker () :
+    samples {},
+    next {0},
+    lock {}
+    {};
+
+  void record(std::chrono::microseconds latency);
+  bool percentile(double p, std::chrono::microseconds& latency);
+};
+
+/*
+  Call attempt() until it succeeds, it fails in a way that is not
+  worth retrying, or policy runs out.
+
+  attempt() returns a T. retry_result(const T&) says whether a T
+  it returned is a transient failure; retry_error(const
+  std::exception&) says the same of an exception it threw. The
+  last result is returned, or the last exception rethrown, when
+  there are no attempts or budget left. A retry is made only if
+  its backoff delay still fits in the budget.
+ */
+template <typename T, typename Attempt, typename RetryResult, typename RetryError>
+T with_retries (const retry_policy_t& policy, Attempt attempt,
+                RetryResult retry_result, RetryError retry_error) {
+  const auto deadline = std::chrono::steady_clock::now() + policy.budget;
+  Backoff backoff {policy};
+  std::chrono::milliseconds delay {0};
+  unsigned tries {0};
+  auto try_again = [&] () {
+    delay = backoff.next();
+    return ++tries < policy.max_attempts &&
+      std::chrono::steady_clock::now() + delay < deadline;
+  };
+  for (;;) {
+    try {
+      T result {attempt()};
+      if (! retry_result(result) || ! try_again())
+        return result;
+    }
+    catch (const std::exception& e) {
+      if (! retry_error(e) || ! try_again())
+        throw;
+    }
+    std::this_thread::sleep_for(delay);
+  }
+}
+
+/*
+  Run attempt() and, if it has not finished once latency's p95 has
+  passed, a second copy in the thread pool; return whichever
+  succeeds first. Only for idempotent calls. attempt is copied and
+  may outlive this call, so it must own what it uses; latency
+  must live as long as the process.
+
+  Successful attempts are timed into latency. Until latency has
+  enough samples, attempt() is simply called.
+ */
+template <typename T, typename Attempt>
+T hedged (LatencyTracker& latency, Attempt attempt) {
+  std::chrono::microseconds p95;
+  if (! latency.percentile(0.95, p95)) {
+    const auto start = std::chrono::steady_clock::now();
+    T result {attempt()};
+    latency.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+    return result;
+  }
+
+  struct state_t {
+    std::mutex lock;
+    std::condition_variable changed;
+    std::unique_ptr<T> result;
+    std::exception_ptr error;
+    unsigned failures {0};
+  };
+  auto state (std::make_shared<state_t>());
+
+  auto run = [state, attempt, &latency] () mutable {
+    const auto start = std::chrono::steady_clock::now();
+    try {
+      T r {attempt()};
+      latency.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+      std::lock_guard<std::mutex> l {state->lock};
+      if (! state->result)
+        state->result.reset(new T {std::move(r)});
+    }
+    catch (...) {
+      std::lock_guard<std::mutex> l {state->lock};
+      ++state->failures;
+      state->error = std::current_exception();
+    }
+    state->changed.notify_all();
+  };
+
+  pplx::create_task(run);
+  unsigned launched {1};
+  std::unique_lock<std::mutex> l {state->lock};
+  if (! state->changed.wait_for(l, p95, [&state] () { return state->result || state->failures > 0; })) {
+    pplx::create_task(run);
+    ++launched;
+  }
+  state->changed.wait(l, [&state, &launched] () { return state->result || state->failures == launched; });
+  if (state->result)
+    return *state->result;
+  std::rethrow_exception(state->error);
+}
+
+#endif
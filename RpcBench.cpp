@@ -0,0 +1,94 @@
+/*
+  Benchmark of an internal call over HTTP against the same call
+  over RPC. A handler in this process answers a small JSON
+  request through both its listener and an RpcServer, and is
+  called through do_request() each way.
+
+  CPU time is the process's, so it counts both ends of each call.
+
+  Usage: rpcbench [calls] [threads]
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cpprest/http_listener.h>
+#include <cpprest/json.h>
+
+#include "ClientUtils.h"
+#include "InternalRpc.h"
+
+using std::cout;
+using std::endl;
+using std::size_t;
+using std::string;
+using std::vector;
+
+using web::http::http_request;
+using web::http::methods;
+using web::http::status_codes;
+
+using web::json::value;
+
+using web::http::experimental::listener::http_listener;
+
+namespace {
+  const string bench_url {"http://localhost:34900"};
+
+  void handle_put(http_request message) {
+    message.extract_json(true)
+      .then([message] (value body) {
+          message.reply(status_codes::OK, body);
+        });
+  }
+
+  /*
+    Make calls calls to the handler from each of threads threads
+    and report the time per call
+   */
+  void time_calls(const string& name, size_t calls, size_t threads) {
+    const value body {build_json_value("Country", "Canada", "Name", "Smith,Jo")};
+    const string target {bench_url + "/UpdateStatus/Canada/Smith,Jo/Busy"};
+    const std::clock_t cpu_start {std::clock()};
+    const auto start = std::chrono::steady_clock::now();
+    vector<std::thread> callers {};
+    for (size_t t = 0; t < threads; ++t)
+      callers.emplace_back([calls, &body, &target] () {
+          for (size_t i = 0; i < calls; ++i)
+            do_request(methods::PUT, target, body);
+        });
+    for (auto& caller : callers)
+      caller.join();
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const double total {static_cast<double>(calls * threads)};
+    const double us {static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count())};
+    const double cpu_us {1e6 * (std::clock() - cpu_start) / CLOCKS_PER_SEC};
+    cout << "  " << name << ", " << threads << " threads: "
+         << us / total << " us/call, " << cpu_us / total << " CPU us/call" << endl;
+  }
+}
+
+int main (int argc, char const * argv[]) {
+  const size_t calls {argc > 1 ? std::stoul(argv[1]) : 10000};
+  const size_t threads {argc > 2 ? std::stoul(argv[2]) : 8};
+
+  http_listener listener {bench_url};
+  listener.support(methods::PUT, &handle_put);
+  listener.open().wait();
+  auto rpc_server (open_rpc_server(bench_url, rpc_handlers_t {{methods::PUT, &handle_put}}));
+
+  for (size_t t : {size_t {1}, threads}) {
+    enable_internal_rpc(false);
+    time_calls("HTTP", calls / t, t);
+    enable_internal_rpc(true);
+    time_calls("RPC ", calls / t, t);
+  }
+
+  rpc_server.reset();
+  listener.close().wait();
+}
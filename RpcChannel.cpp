@@ -0,0 +1,174 @@
+#include "RpcChannel.h"
+
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include <boost/asio.hpp>
+
+using std::size_t;
+using std::string;
+
+using boost::asio::ip::tcp;
+using boost::system::error_code;
+
+/*
+  Connect to host:port and start reading responses. Throws
+  boost::system::system_error if the server cannot be reached.
+ */
+void RpcChannel::connect(const string& host, unsigned short port) {
+  tcp::resolver resolver {*io};
+  boost::asio::connect(socket, resolver.resolve(tcp::resolver::query {host, std::to_string(port)}));
+  socket.set_option(tcp::no_delay {true});
+  read_prefix();
+}
+
+/*
+  Send request under a fresh id and wait up to timeout for its
+  response. Throws std::runtime_error if the channel is broken,
+  breaks while waiting, or the response is late.
+ */
+rpc_response_t RpcChannel::call(rpc_request_t request, std::chrono::milliseconds timeout) {
+  std::future<rpc_response_t> result;
+  {
+    pplx::extensibility::scoped_critical_section_t l {lock};
+    if (failed)
+      throw std::runtime_error("RPC channel is broken");
+    request.id = next_id++;
+    result = pending[request.id].get_future();
+  }
+
+  string frame;
+  try {
+    frame = encode_rpc_request(request);
+  }
+  catch (const std::exception&) {
+    pplx::extensibility::scoped_critical_section_t l {lock};
+    pending.erase(request.id);
+    throw;
+  }
+  auto self (shared_from_this());
+  strand.post([self, frame] () {
+      // Its call has already failed
+      if (self->closed)
+        return;
+      self->outbox.push_back(frame);
+      if (self->outbox.size() == 1)
+        self->write_next();
+    });
+
+  if (result.wait_for(timeout) != std::future_status::ready) {
+    pplx::extensibility::scoped_critical_section_t l {lock};
+    // fail() may have taken it just now, and then has set it
+    if (pending.erase(request.id) > 0)
+      throw std::runtime_error("RPC call timed out");
+  }
+  return result.get();
+}
+
+bool RpcChannel::broken() {
+  pplx::extensibility::scoped_critical_section_t l {lock};
+  return failed;
+}
+
+/*
+  Close the connection, failing any outstanding calls, as if it
+  had been lost
+ */
+void RpcChannel::close() {
+  auto self (shared_from_this());
+  strand.post([self] () { self->fail("channel closed"); });
+}
+
+void RpcChannel::write_next() {
+  auto self (shared_from_this());
+  boost::asio::async_write(socket, boost::asio::buffer(outbox.front()),
+    strand.wrap([self] (const error_code& ec, size_t) {
+        // fail() has cleared the outbox under this write
+        if (self->closed)
+          return;
+        if (ec) {
+          self->fail(ec.message());
+          return;
+        }
+        self->outbox.pop_front();
+        if (! self->outbox.empty())
+          self->write_next();
+      }));
+}
+
+void RpcChannel::read_prefix() {
+  auto self (shared_from_this());
+  boost::asio::async_read(socket, boost::asio::buffer(prefix),
+    strand.wrap([self] (const error_code& ec, size_t) {
+        if (ec) {
+          self->fail(ec.message());
+          return;
+        }
+        const auto size = rpc_payload_size(self->prefix);
+        if (size > max_rpc_payload) {
+          self->fail("RPC response too long");
+          return;
+        }
+        self->payload.resize(size);
+        self->read_payload();
+      }));
+}
+
+void RpcChannel::read_payload() {
+  auto self (shared_from_this());
+  boost::asio::async_read(socket, boost::asio::buffer(payload),
+    strand.wrap([self] (const error_code& ec, size_t) {
+        if (ec) {
+          self->fail(ec.message());
+          return;
+        }
+        rpc_response_t response {};
+        if (! decode_rpc_response(self->payload.data(), self->payload.size(), response)) {
+          self->fail("Malformed RPC response");
+          return;
+        }
+        std::promise<rpc_response_t> done;
+        bool found {false};
+        {
+          pplx::extensibility::scoped_critical_section_t l {self->lock};
+          auto call (self->pending.find(response.id));
+          if (call != self->pending.end()) {
+            done = std::move(call->second);
+            self->pending.erase(call);
+            found = true;
+          }
+        }
+        if (found)
+          done.set_value(std::move(response));
+        self->read_prefix();
+      }));
+}
+
+/*
+  Close the connection and fail every outstanding call. Runs in
+  the strand.
+ */
+void RpcChannel::fail(const string& why) {
+  if (closed)
+    return;
+  closed = true;
+  std::unordered_map<std::uint64_t,std::promise<rpc_response_t>> calls;
+  {
+    pplx::extensibility::scoped_critical_section_t l {lock};
+    failed = true;
+    calls.swap(pending);
+  }
+  outbox.clear();
+  error_code ec;
+  socket.close(ec);
+  const auto error (std::make_exception_ptr(std::runtime_error("RPC connection lost: " + why)));
+  for (auto& call : calls)
+    call.second.set_exception(error);
+}
@@ -0,0 +1,72 @@
+#ifndef RpcChannel_h
+#define RpcChannel_h
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include <pplx/pplxtasks.h>
+
+#include "RpcFrame.h"
+
+/*
+  A client's persistent connection to an RpcServer. Any number of
+  threads may have calls outstanding on it at once; each call is
+  given a fresh id and matched to its response by that id.
+
+  Once the connection fails, every outstanding call fails with
+  the error and the channel is broken for good; the owner makes
+  a new one. A call whose response does not come within its
+  timeout fails alone, and its response is dropped if it comes.
+ */
+class RpcChannel : public std::enable_shared_from_this<RpcChannel> {
+private:
+  std::shared_ptr<boost::asio::io_service> io;
+  boost::asio::ip::tcp::socket socket;
+  boost::asio::io_service::strand strand;
+  unsigned char prefix[rpc_prefix_size];
+  std::vector<char> payload;
+  std::deque<std::string> outbox;  // Used in the strand only
+  bool closed;                     // Set by fail(); used in the strand only
+
+  std::unordered_map<std::uint64_t,std::promise<rpc_response_t>> pending;
+  std::uint64_t next_id;
+  bool failed;
+  pplx::extensibility::critical_section_t lock;
+
+  void read_prefix();
+  void read_payload();
+  void write_next();
+  void fail(const std::string& why);
+
+public:
+  explicit RpcChannel (const std::shared_ptr<boost::asio::io_service>& io) :
+    io {io},
+    socket {*io},
+    strand {*io},
+    payload {},
+    outbox {},
+    closed {false},
+    pending {},
+    next_id {1},
+    failed {false},
+    lock {}
+    {};
+
+  RpcChannel (const RpcChannel&) = delete;
+  RpcChannel& operator= (const RpcChannel&) = delete;
+
+  void connect(const std::string& host, unsigned short port);
+  rpc_response_t call(rpc_request_t request, std::chrono::milliseconds timeout);
+  bool broken();
+  void close();
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include "RpcFrame.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+using std::size_t;
+using std::string;
+
+namespace {
+  // A method's code is its index here
+  const string method_names[] {"GET", "POST", "PUT", "DELETE"};
+  constexpr size_t method_count {sizeof method_names / sizeof method_names[0]};
+
+  void put_u16 (string& out, std::uint16_t n) {
+    out += static_cast<char>((n >> 8) & 0xff);
+    out += static_cast<char>(n & 0xff);
+  }
+
+  void put_u32 (string& out, std::uint32_t n) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+      out += static_cast<char>((n >> shift) & 0xff);
+  }
+
+  void put_u64 (string& out, std::uint64_t n) {
+    for (int shift = 56; shift >= 0; shift -= 8)
+      out += static_cast<char>((n >> shift) & 0xff);
+  }
+
+  std::uint64_t get_uint (const char* p, size_t bytes) {
+    std::uint64_t n {0};
+    for (size_t i = 0; i < bytes; ++i)
+      n = (n << 8) | static_cast<unsigned char>(p[i]);
+    return n;
+  }
+
+  /*
+    Write the length prefix over the placeholder at the start of
+    frame, or throw std::length_error if the payload is too big
+   */
+  void set_prefix (string& frame) {
+    const size_t size {frame.size() - rpc_prefix_size};
+    if (size > max_rpc_payload)
+      throw std::length_error("RPC frame too long");
+    for (size_t i = 0; i < rpc_prefix_size; ++i)
+      frame[i] = static_cast<char>((size >> (8 * (rpc_prefix_size - 1 - i))) & 0xff);
+  }
+}
+
+/*
+  Return the payload size given by a frame's length prefix
+ */
+std::uint32_t rpc_payload_size (const unsigned char* prefix) {
+  return static_cast<std::uint32_t>(get_uint(reinterpret_cast<const char*>(prefix), rpc_prefix_size));
+}
+
+/*
+  Return request as a whole frame, prefix included. Throws
+  std::invalid_argument for a method the protocol does not carry.
+ */
+string encode_rpc_request (const rpc_request_t& request) {
+  size_t code {0};
+  while (code < method_count && method_names[code] != request.method)
+    ++code;
+  if (code == method_count)
+    throw std::invalid_argument("No RPC code for method " + request.method);
+
+  string frame {};
+  frame.reserve(rpc_prefix_size + 8 + 1 + 4 + request.path.size() + request.body.size());
+  put_u32(frame, 0);
+  put_u64(frame, request.id);
+  frame += static_cast<char>(code);
+  put_u32(frame, static_cast<std::uint32_t>(request.path.size()));
+  frame += request.path;
+  frame += request.body;
+  set_prefix(frame);
+  return frame;
+}
+
+/*
+  Decode the payload of a request frame. Returns false if it is
+  malformed.
+ */
+bool decode_rpc_request (const char* payload, size_t size, rpc_request_t& request) {
+  if (size < 8 + 1 + 4)
+    return false;
+  const size_t code {static_cast<unsigned char>(payload[8])};
+  const std::uint64_t path_size {get_uint(payload + 9, 4)};
+  if (code >= method_count || path_size > size - 13)
+    return false;
+  request.id = get_uint(payload, 8);
+  request.method = method_names[code];
+  request.path.assign(payload + 13, path_size);
+  request.body.assign(payload + 13 + path_size, size - 13 - path_size);
+  return true;
+}
+
+/*
+  Return response as a whole frame, prefix included
+ */
+string encode_rpc_response (const rpc_response_t& response) {
+  string frame {};
+  frame.reserve(rpc_prefix_size + 8 + 2 + response.body.size());
+  put_u32(frame, 0);
+  put_u64(frame, response.id);
+  put_u16(frame, response.status);
+  frame += response.body;
+  set_prefix(frame);
+  return frame;
+}
+
+/*
+  Decode the payload of a response frame. Returns false if it is
+  malformed.
+ */
+bool decode_rpc_response (const char* payload, size_t size, rpc_response_t& response) {
+  if (size < 8 + 2)
+    return false;
+  response.id = get_uint(payload, 8);
+  response.status = static_cast<unsigned short>(get_uint(payload + 8, 2));
+  response.body.assign(payload + 10, size - 10);
+  return true;
+}
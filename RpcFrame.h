@@ -0,0 +1,58 @@
+#ifndef RpcFrame_h
+#define RpcFrame_h
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+  Frames of the binary protocol the servers use between
+  themselves (see RpcServer.h and RpcChannel.h).
+
+  Every frame is a 4-byte big-endian length followed by that many
+  bytes of payload. A request's payload is
+
+    id (8 bytes) | method (1 byte) | path length (4 bytes) | path | body
+
+  and a response's is
+
+    id (8 bytes) | status (2 bytes) | body
+
+  The id is chosen by the client and returned in the response, so
+  one connection carries many calls at once and their responses
+  may come back in any order. The path is the request URI's path
+  and query, as the handler would see it over HTTP. A body is JSON
+  text, or empty for none.
+ */
+
+// Servers take RPC on the port after their HTTP port
+constexpr int rpc_port_offset {1};
+
+// Bytes in the length prefix
+constexpr std::size_t rpc_prefix_size {4};
+
+// Largest payload either end accepts
+constexpr std::uint32_t max_rpc_payload {16 * 1024 * 1024};
+
+struct rpc_request_t {
+  std::uint64_t id;
+  std::string method;  // "GET", "POST", "PUT" or "DELETE"
+  std::string path;
+  std::string body;
+};
+
+struct rpc_response_t {
+  std::uint64_t id;
+  unsigned short status;
+  std::string body;
+};
+
+std::uint32_t rpc_payload_size (const unsigned char* prefix);
+
+std::string encode_rpc_request (const rpc_request_t& request);
+bool decode_rpc_request (const char* payload, std::size_t size, rpc_request_t& request);
+
+std::string encode_rpc_response (const rpc_response_t& response);
+bool decode_rpc_response (const char* payload, std::size_t size, rpc_response_t& response);
+
+#endif
@@ -0,0 +1,195 @@
+#include "RpcServer.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "RpcFrame.h"
+
+using std::size_t;
+using std::string;
+
+using boost::asio::io_service;
+using boost::asio::ip::tcp;
+using boost::system::error_code;
+
+namespace {
+  using reuse_port_option = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+}
+
+/*
+  One client's connection. Reads run back to back; writes are
+  queued and run one at a time. Both go through the strand.
+ */
+class RpcServer::connection : public std::enable_shared_from_this<connection> {
+private:
+  std::shared_ptr<io_service> io;
+  tcp::socket socket;
+  io_service::strand strand;
+  dispatcher_t dispatch;
+  unsigned char prefix[rpc_prefix_size];
+  std::vector<char> payload;
+  std::deque<string> outbox;
+
+  void read_prefix();
+  void read_payload();
+  void write_next();
+
+public:
+  connection (const std::shared_ptr<io_service>& io, const dispatcher_t& dispatch) :
+    io {io},
+    socket {*io},
+    strand {*io},
+    dispatch {dispatch},
+    payload {},
+    outbox {}
+    {};
+
+  tcp::socket& get_socket() { return socket; }
+
+  void start() {
+    error_code ec;
+    socket.set_option(tcp::no_delay {true}, ec);
+    read_prefix();
+  }
+
+  void close() {
+    error_code ec;
+    socket.close(ec);
+  }
+
+  void send(const string& frame);
+};
+
+void RpcServer::connection::read_prefix() {
+  auto self (shared_from_this());
+  boost::asio::async_read(socket, boost::asio::buffer(prefix),
+    strand.wrap([self] (const error_code& ec, size_t) {
+        if (ec)
+          return;
+        const auto size = rpc_payload_size(self->prefix);
+        if (size > max_rpc_payload) {
+          self->close();
+          return;
+        }
+        self->payload.resize(size);
+        self->read_payload();
+      }));
+}
+
+void RpcServer::connection::read_payload() {
+  auto self (shared_from_this());
+  boost::asio::async_read(socket, boost::asio::buffer(payload),
+    strand.wrap([self] (const error_code& ec, size_t) {
+        if (ec)
+          return;
+        rpc_request_t request {};
+        if (! decode_rpc_request(self->payload.data(), self->payload.size(), request)) {
+          self->close();
+          return;
+        }
+        self->read_prefix();
+        self->dispatch(request, [self] (const rpc_response_t& response) {
+            self->send(encode_rpc_response(response));
+          });
+      }));
+}
+
+/*
+  Queue frame to be written. Safe from any thread.
+ */
+void RpcServer::connection::send(const string& frame) {
+  auto self (shared_from_this());
+  strand.post([self, frame] () {
+      self->outbox.push_back(frame);
+      if (self->outbox.size() == 1)
+        self->write_next();
+    });
+}
+
+void RpcServer::connection::write_next() {
+  auto self (shared_from_this());
+  boost::asio::async_write(socket, boost::asio::buffer(outbox.front()),
+    strand.wrap([self] (const error_code& ec, size_t) {
+        if (ec) {
+          self->outbox.clear();
+          self->close();
+          return;
+        }
+        self->outbox.pop_front();
+        if (! self->outbox.empty())
+          self->write_next();
+      }));
+}
+
+RpcServer::RpcServer (const string& host, unsigned short port, bool reuse_port, const dispatcher_t& dispatch) :
+  io {std::make_shared<io_service>()},
+  acceptor {*io},
+  host {host},
+  port {port},
+  reuse_port {reuse_port},
+  dispatch {dispatch},
+  connections {},
+  io_thread {}
+{}
+
+RpcServer::~RpcServer () {
+  close();
+}
+
+/*
+  Start listening on host:port. Throws boost::system::system_error
+  if the port cannot be bound.
+ */
+void RpcServer::open() {
+  tcp::resolver resolver {*io};
+  const tcp::endpoint endpoint {*resolver.resolve(tcp::resolver::query {host, std::to_string(port)})};
+  acceptor.open(endpoint.protocol());
+  acceptor.set_option(tcp::acceptor::reuse_address {true});
+  if (reuse_port)
+    acceptor.set_option(reuse_port_option {true});
+  acceptor.bind(endpoint);
+  acceptor.listen();
+  accept();
+  auto io_ref (io);
+  io_thread = std::thread {[io_ref] () { io_ref->run(); }};
+}
+
+void RpcServer::accept() {
+  auto conn (std::make_shared<connection>(io, dispatch));
+  acceptor.async_accept(conn->get_socket(), [this, conn] (const error_code& ec) {
+      if (ec == boost::asio::error::operation_aborted)
+        return;
+      if (! ec) {
+        conn->start();
+        connections.erase(std::remove_if(connections.begin(), connections.end(),
+                                         [] (const std::weak_ptr<connection>& c) { return c.expired(); }),
+                          connections.end());
+        connections.push_back(conn);
+      }
+      accept();
+    });
+}
+
+/*
+  Stop accepting and drop every connection. Responses still being
+  prepared are discarded.
+ */
+void RpcServer::close() {
+  if (! io_thread.joinable())
+    return;
+  io->post([this] () {
+      error_code ec;
+      acceptor.close(ec);
+      for (const auto& c : connections)
+        if (auto conn = c.lock())
+          conn->close();
+      connections.clear();
+    });
+  io_thread.join();
+}
@@ -0,0 +1,57 @@
+#ifndef RpcServer_h
+#define RpcServer_h
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "RpcFrame.h"
+
+/*
+  Takes RpcFrame requests on persistent TCP connections and
+  answers them through dispatch.
+
+  All socket work runs on one thread of the server's own. dispatch
+  is called on that thread for each request, so it must hand the
+  work off rather than do it; the responder it is given may be
+  called once, from any thread, whenever the response is ready.
+  Responses are written in the order they are ready, not the
+  order the requests came in. With reuse_port, the socket sets
+  SO_REUSEPORT, so the workers of a server sharing its HTTP port
+  (see HttpServer.h) share its RPC port too.
+ */
+class RpcServer {
+public:
+  using responder_t = std::function<void(const rpc_response_t&)>;
+  using dispatcher_t = std::function<void(const rpc_request_t&, const responder_t&)>;
+
+private:
+  class connection;
+
+  std::shared_ptr<boost::asio::io_service> io;  // Connections hold it until they are gone
+  boost::asio::ip::tcp::acceptor acceptor;
+  std::string host;
+  unsigned short port;
+  bool reuse_port;
+  dispatcher_t dispatch;
+  std::vector<std::weak_ptr<connection>> connections;  // Used on the io thread only
+  std::thread io_thread;
+
+  void accept();
+
+public:
+  RpcServer (const std::string& host, unsigned short port, bool reuse_port, const dispatcher_t& dispatch);
+  ~RpcServer ();
+
+  RpcServer (const RpcServer&) = delete;
+  RpcServer& operator= (const RpcServer&) = delete;
+
+  void open();
+  void close();
+};
+
+#endif
@@ -0,0 +1,148 @@
+/*
+  Utilities for checking table shared access signatures locally,
+  without sending them to Azure Storage.
+ */
+
+#include "SasUtils.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include <cpprest/asyncrt_utils.h>
+#include <cpprest/base_uri.h>
+
+#include <was/table.h>
+
+using azure::storage::cloud_table;
+using azure::storage::table_shared_access_policy;
+
+using std::map;
+using std::string;
+
+using web::http::uri;
+
+/*
+  Return the decoded value of a query field, or an empty string
+ */
+static string field (const map<string,string>& fields, const string& name) {
+  auto f (fields.find(name));
+  if (f == fields.end())
+    return string {};
+  return uri::decode(f->second);
+}
+
+/*
+  Split a token, as returned by get_shared_access_signature(), into
+  its fields.
+
+  Returns false if the token lacks a table name, permissions,
+  expiry or signature, or its start or expiry is not an ISO 8601
+  time.
+ */
+bool parse_sas_token (const string& token, sas_token_t& sas) {
+  const string query {! token.empty() && token[0] == '?' ? token.substr(1) : token};
+  const map<string,string> fields {uri::split_query(query)};
+
+  sas.table = field(fields, "tn");
+  sas.start_partition = field(fields, "spk");
+  sas.start_row = field(fields, "srk");
+  sas.end_partition = field(fields, "epk");
+  sas.end_row = field(fields, "erk");
+  sas.permissions = field(fields, "sp");
+  sas.signature = field(fields, "sig");
+  const string start {field(fields, "st")};
+  const string expiry {field(fields, "se")};
+  if (sas.table.empty() || sas.permissions.empty() || sas.signature.empty() || expiry.empty())
+    return false;
+
+  sas.start = utility::datetime {};
+  if (! start.empty()) {
+    sas.start = utility::datetime::from_string(start, utility::datetime::ISO_8601);
+    if (! sas.start.is_initialized())
+      return false;
+  }
+  sas.expiry = utility::datetime::from_string(expiry, utility::datetime::ISO_8601);
+  return sas.expiry.is_initialized();
+}
+
+/*
+  Convert the permissions field of a token to a bitwise OR of
+  table_shared_access_policy::permissions constants
+ */
+uint8_t sas_permissions (const string& permissions) {
+  uint8_t result {table_shared_access_policy::permissions::none};
+  for (char c : permissions) {
+    if (c == 'r')
+      result |= table_shared_access_policy::permissions::read;
+    else if (c == 'a')
+      result |= table_shared_access_policy::permissions::add;
+    else if (c == 'u')
+      result |= table_shared_access_policy::permissions::update;
+    else if (c == 'd')
+      result |= table_shared_access_policy::permissions::del;
+  }
+  return result;
+}
+
+/*
+  Return true if a token's signature is the one the storage
+  account key gives for its fields.
+
+  table must be a reference obtained with the account key, such
+  as one from TableCache. The signature is recomputed by the same
+  library call that issued it and compared in constant time.
+ */
+bool verify_sas_signature (const cloud_table& table, const sas_token_t& sas) {
+  string table_name {table.name()};
+  string token_table {sas.table};
+  std::transform(table_name.begin(), table_name.end(), table_name.begin(), ::tolower);
+  std::transform(token_table.begin(), token_table.end(), token_table.begin(), ::tolower);
+  if (table_name != token_table)
+    return false;
+
+  sas_token_t expected {};
+  const table_shared_access_policy policy {
+    sas.start.is_initialized() ?
+      table_shared_access_policy {sas.start, sas.expiry, sas_permissions(sas.permissions)} :
+      table_shared_access_policy {sas.expiry, sas_permissions(sas.permissions)}
+  };
+  const string reissued {
+    table.get_shared_access_signature(policy,
+                                      string(), // Unnamed policy
+                                      sas.start_partition,
+                                      sas.start_row,
+                                      sas.end_partition,
+                                      sas.end_row)
+  };
+  if (! parse_sas_token(reissued, expected) ||
+      expected.signature.size() != sas.signature.size())
+    return false;
+
+  unsigned char diff {0};
+  for (string::size_type i = 0; i < sas.signature.size(); ++i)
+    diff |= static_cast<unsigned char>(expected.signature[i] ^ sas.signature[i]);
+  return diff == 0;
+}
+
+/*
+  Return true if sas may be exchanged for a fresh token at now
+  without the user's password: it is unexpired, grants exactly
+  permissions on exactly the entity (partition, row), and the
+  sign-on it descends from, dated by its start time, is less than
+  max_session old. A token with no start time is not renewable.
+
+  The signature is not checked; call verify_sas_signature() too.
+ */
+bool sas_renewable (const sas_token_t& sas, const string& partition, const string& row,
+                    uint8_t permissions, const utility::datetime& now,
+                    utility::datetime::interval_type max_session) {
+  return sas.start.is_initialized() &&
+    now.to_interval() < sas.expiry.to_interval() &&
+    now.to_interval() < sas.start.to_interval() + max_session &&
+    sas.start_partition == partition && sas.end_partition == partition &&
+    sas.start_row == row && sas.end_row == row &&
+    sas_permissions(sas.permissions) == permissions;
+}
@@ -0,0 +1,37 @@
+#ifndef SasUtils_h
+#define SasUtils_h
+
+#include <cstdint>
+#include <string>
+
+#include <cpprest/asyncrt_utils.h>
+
+#include <was/table.h>
+
+/*
+  The fields of a table shared access signature that say
+  what it grants, and its signature
+ */
+struct sas_token_t {
+  std::string table;
+  std::string start_partition;
+  std::string start_row;
+  std::string end_partition;
+  std::string end_row;
+  std::string permissions;
+  utility::datetime start;  // Not initialized if the token has none
+  utility::datetime expiry;
+  std::string signature;
+};
+
+bool parse_sas_token(const std::string& token, sas_token_t& sas);
+
+uint8_t sas_permissions(const std::string& permissions);
+
+bool verify_sas_signature(const azure::storage::cloud_table& table, const sas_token_t& sas);
+
+bool sas_renewable(const sas_token_t& sas, const std::string& partition, const std::string& row,
+                   uint8_t permissions, const utility::datetime& now,
+                   utility::datetime::interval_type max_session);
+
+#endif
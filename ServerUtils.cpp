@@ -4,22 +4,31 @@
 
 #include "ServerUtils.h"
 
+#include <cstdint>
+#include <exception>
 #include <iostream>
 #include <string>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include <cpprest/asyncrt_utils.h>
+
 #include <was/table.h>
 
+#include "SasUtils.h"
+
 using azure::storage::cloud_table;
-using azure::storage::cloud_table_client;
+using azure::storage::edm_type;
 using azure::storage::entity_property;
-using azure::storage::storage_credentials;
+using azure::storage::no_retry_policy;
+using azure::storage::operation_context;
 using azure::storage::storage_exception;
 using azure::storage::table_entity;
 using azure::storage::table_operation;
+using azure::storage::table_request_options;
 using azure::storage::table_result;
+using azure::storage::table_shared_access_policy;
 
 using std::cout;
 using std::endl;
@@ -34,6 +43,197 @@ using web::http::status_code;
 using web::http::status_codes;
 using web::http::uri;
 
+using web::json::value;
+
+// Suffix of a property naming the type of the property before it
+const string odata_type_suffix {"@odata.type"};
+const string edm_binary_type {"Edm.Binary"};
+
+/*
+  Set properties from property/value pairs as received in a
+  JSON body.
+
+  All values are strings. A property P is stored as Edm.Binary
+  when props also holds "P@odata.type" with value "Edm.Binary";
+  its value is then the base64 text of the bytes. The annotation
+  itself is not stored.
+ */
+void set_entity_properties (table_entity::properties_type& properties,
+                            const unordered_map<string,string>& props) {
+  for (const auto& v : props) {
+    if (v.first.size() > odata_type_suffix.size() &&
+        v.first.compare(v.first.size() - odata_type_suffix.size(), string::npos, odata_type_suffix) == 0 &&
+        props.find(v.first.substr(0, v.first.size() - odata_type_suffix.size())) != props.end())
+      continue;
+
+    auto type (props.find(v.first + odata_type_suffix));
+    if (type != props.end() && type->second == edm_binary_type)
+      properties[v.first] = entity_property {utility::conversions::from_base64(v.second)};
+    else
+      properties[v.first] = entity_property {v.second};
+  }
+}
+
+/*
+  Convert properties represented in Azure Storage type to
+  property/value pairs, appended to values, as BasicServer
+  returns them.
+
+  A binary property comes as its base64 text followed by a
+  "<name>@odata.type" property of "Edm.Binary", the form
+  set_entity_properties() reads back.
+ */
+vector<pair<string,value>> get_properties (const table_entity::properties_type& properties,
+                                           vector<pair<string,value>> values) {
+  for (const auto& v : properties) {
+    if (v.second.property_type() == edm_type::string) {
+      values.push_back(make_pair(v.first, value::string(v.second.string_value())));
+    }
+    else if (v.second.property_type() == edm_type::datetime) {
+      values.push_back(make_pair(v.first, value::string(v.second.str())));
+    }
+    else if(v.second.property_type() == edm_type::int32) {
+      values.push_back(make_pair(v.first, value::number(v.second.int32_value())));
+    }
+    else if(v.second.property_type() == edm_type::int64) {
+      values.push_back(make_pair(v.first, value::number(v.second.int64_value())));
+    }
+    else if(v.second.property_type() == edm_type::double_floating_point) {
+      values.push_back(make_pair(v.first, value::number(v.second.double_value())));
+    }
+    else if(v.second.property_type() == edm_type::boolean) {
+      values.push_back(make_pair(v.first, value::boolean(v.second.boolean_value())));
+    }
+    else if(v.second.property_type() == edm_type::binary) {
+      values.push_back(make_pair(v.first, value::string(v.second.str())));
+      values.push_back(make_pair(v.first + odata_type_suffix, value::string(edm_binary_type)));
+    }
+    else {
+      values.push_back(make_pair(v.first, value::string(v.second.str())));
+    }
+  }
+  return values;
+}
+
+namespace {
+  // Set once by set_storage_policy(), before any request is served
+  retry_policy_t storage_policy {};
+  // Never destroyed: hedged reads may still be running at exit
+  LatencyTracker& storage_latency {*new LatencyTracker {}};
+
+  /*
+    Options for one attempt. The client library's own retries are
+    off, as execute_read() and execute_write() do the retrying.
+   */
+  table_request_options attempt_options (const retry_policy_t& policy) {
+    table_request_options options {};
+    options.set_retry_policy(no_retry_policy {});
+    options.set_maximum_execution_time(policy.budget);
+    return options;
+  }
+
+  bool retryable_storage_error (const std::exception& e) {
+    auto se (dynamic_cast<const storage_exception*>(&e));
+    return se != nullptr && se->retryable();
+  }
+}
+
+/*
+  Set how execute_read() and execute_write() retry and hedge
+ */
+void set_storage_policy (const retry_policy_t& policy) {
+  storage_policy = policy;
+}
+
+/*
+  Execute a retrieve on table, retrying storage errors that Azure
+  marks retryable (timeouts, 408, most 5xx) with jittered backoff.
+  With --hedge-reads on, an attempt slower than the recent p95 is
+  duplicated and the first reply used.
+
+  Throws the last storage_exception if no attempt succeeds.
+ */
+table_result execute_read (const cloud_table& table, const table_operation& op) {
+  const retry_policy_t policy {storage_policy};
+  auto attempt = [table, op, policy] () {
+    return table.execute(op, attempt_options(policy), operation_context {});
+  };
+  return with_retries<table_result>(policy,
+                                    [&attempt, &policy] () {
+                                      return policy.hedge_reads ?
+                                        hedged<table_result>(storage_latency, attempt) : attempt();
+                                    },
+                                    [] (const table_result&) { return false; },
+                                    &retryable_storage_error);
+}
+
+/*
+  Execute op on table, retrying as execute_read() does but never
+  hedging. op must be idempotent (a retrieve, merge, replace or
+  insert-or-merge without ETag conditions): an attempt that timed
+  out may still have been applied.
+ */
+table_result execute_write (const cloud_table& table, const table_operation& op) {
+  const retry_policy_t policy {storage_policy};
+  return with_retries<table_result>(policy,
+                                    [&table, &op, &policy] () {
+                                      return table.execute(op, attempt_options(policy), operation_context {});
+                                    },
+                                    [] (const table_result&) { return false; },
+                                    &retryable_storage_error);
+}
+
+/*
+  Check a table SAS token locally, as Azure Storage would: Forbidden
+  unless it is well formed, unexpired, signed with the account key
+  of table, and grants permission on the entity (partition, row)
+  of table. Returns OK if it may be used.
+
+  An entity outside the token's range gives NotFound for a read,
+  as a read through such a token finds nothing in Azure, and
+  Forbidden otherwise.
+
+  table must be a reference obtained with the account key, such
+  as one from TableCache. No request is sent to Azure Storage.
+ */
+status_code check_sas_token (const cloud_table& table,
+                             const string& token,
+                             const string& partition,
+                             const string& row,
+                             uint8_t permission) {
+  sas_token_t sas {};
+  if (! parse_sas_token(token, sas)) {
+    cout << "Malformed token" << endl;
+    return status_codes::Forbidden;
+  }
+  if (sas.expiry.to_interval() <= utility::datetime::utc_now().to_interval()) {
+    cout << "Expired token" << endl;
+    return status_codes::Forbidden;
+  }
+  if ((sas_permissions(sas.permissions) & permission) != permission) {
+    cout << "Token lacks permission" << endl;
+    return status_codes::Forbidden;
+  }
+
+  // Empty bounds are open, as in Azure Storage
+  const bool after_start {sas.start_partition.empty() || partition > sas.start_partition ||
+                          (partition == sas.start_partition && (sas.start_row.empty() || row >= sas.start_row))};
+  const bool before_end {sas.end_partition.empty() || partition < sas.end_partition ||
+                         (partition == sas.end_partition && (sas.end_row.empty() || row <= sas.end_row))};
+  if (! after_start || ! before_end) {
+    cout << "Token is for another entity" << endl;
+    return permission == table_shared_access_policy::permissions::read ?
+      status_codes::NotFound : status_codes::Forbidden;
+  }
+
+  // Last, as it is the only costly check
+  if (! verify_sas_signature(table, sas)) {
+    cout << "Bad token signature" << endl;
+    return status_codes::Forbidden;
+  }
+  return status_codes::OK;
+}
+
 /*
   Read from a table using a security token
 
@@ -41,19 +241,24 @@ using web::http::uri;
     URI, as the token may have '/' characters encoded via %2F. After the
     undecoded path is split, the resulting parameters are decoded
     individually.
-  endpoint is the URI endpoint for Azure tables. It takes the form
-    "http://STORAGE.table.core.windows.net/", where STORAGE is
-    replaced by the user's Azure Storage account name.
+  tables gives the table, opened with the account key. The token is
+    checked by check_sas_token() and the entity read through that
+    table, so no client is built for the token.
+    A token that fails the check is answered NotFound if the table
+    does not exist, as TableCache remembers it, so a bad token costs
+    no storage call.
+  salt gives the stored partition of the entity named in the path.
 
   Returns a pair:
     first: HTTP status code from the read
     second: if the status code is OK, the entity read from the table
  */
 pair<status_code,table_entity> read_with_token (const http_request& message,
-                                                 const string& endpoint) {
+                                                 TableCache& tables,
+                                                 const PartitionSalt& salt) {
   /*
     Tokens can contain %2F ('/'). Thus we split the URI path
-    *before* decoding and pass the undecoded values to Azure Storage
+    *before* decoding and check the undecoded token
    */
   const string undecoded_path {message.relative_uri().path()};
   const vector<string> undecoded_paths {uri::split_path(undecoded_path)};
@@ -61,19 +266,21 @@ pair<status_code,table_entity> read_with_token (const http_request& message,
     return make_pair (status_codes::BadRequest, table_entity{});
   }
 
-  const string tname {undecoded_paths[1]};
+  const string tname {uri::decode(undecoded_paths[1])};
   const string token {undecoded_paths[2]};
-  const string partition {undecoded_paths[3]};
-  const string row {undecoded_paths[4]};
+  const string row {uri::decode(undecoded_paths[4])};
+  const string partition {salt.salt(uri::decode(undecoded_paths[3]), row)};
 
   try {
-    uri endpoint_uri {endpoint};
-    storage_credentials creds {token};
-    cloud_table_client client {endpoint_uri, creds};
+    cloud_table table {tables.lookup_table(tname)};
+    status_code allowed {check_sas_token(table, token, partition, row,
+                                         table_shared_access_policy::permissions::read)};
+    if (allowed != status_codes::OK)
+      return make_pair (tables.exists(tname) ? allowed : status_codes::NotFound,
+                         table_entity{});
 
     table_operation op {table_operation::retrieve_entity(partition, row)};
-    cloud_table table_cred {client.get_table_reference(tname)};
-    table_result retrieve_result {table_cred.execute(op)};
+    table_result retrieve_result {execute_read(table, op)};
     if (retrieve_result.http_status_code() == status_codes::NotFound) {
       cout << "Not found" << endl;
       return make_pair (status_codes::NotFound,
@@ -87,8 +294,8 @@ pair<status_code,table_entity> read_with_token (const http_request& message,
   catch (const storage_exception& e) {
     cout << "Azure Table Storage error: " << e.what() << endl;
     cout << e.result().extended_error().message() << endl;
-    if (e.result().http_status_code() == status_codes::Forbidden)
-      return make_pair (status_codes::Forbidden,
+    if (e.result().http_status_code() == status_codes::NotFound)
+      return make_pair (status_codes::NotFound,
                          table_entity{});
     else
       return make_pair (status_codes::InternalError,
@@ -103,21 +310,27 @@ pair<status_code,table_entity> read_with_token (const http_request& message,
     URI, as the token may have '/' characters encoded via %2F. After the
     undecoded path is split, the resulting parameters are decoded
     individually.
-  endpoint is the URI endpoint for Azure tables. It takes the form
-    "http://STORAGE.table.core.windows.net/", where STORAGE is
-    replaced by the user's Azure Storage account name.
+  tables gives the table, opened with the account key. The token is
+    checked by check_sas_token() and the entity written through that
+    table, so no client is built for the token.
+    A token that fails the check is answered NotFound if the table
+    does not exist, as TableCache remembers it, so a bad token costs
+    no storage call.
+  salt gives the stored partition of the entity named in the path.
   props is an unordered_map of properties to be merged into
     the entity. This will typically be the result of get_json_body().
+    Binary properties are marked as set_entity_properties() describes.
 
   Returns:  HTTP status code from the write.
  */
 status_code update_with_token (const http_request& message,
-                               const string& endpoint,
+                               TableCache& tables,
+                               const PartitionSalt& salt,
                                const unordered_map<string,string>& props) {
   
   /*
     Tokens can contain %2F ('/'). Thus we split the URI path
-    *before* decoding and pass the undecoded values to Azure Storage
+    *before* decoding and check the undecoded token
    */
   const string undecoded_path {message.relative_uri().path()};
   const vector<string> undecoded_paths {uri::split_path(undecoded_path)};
@@ -125,24 +338,22 @@ status_code update_with_token (const http_request& message,
     return status_codes::BadRequest;
   }
   
-  const string tname {undecoded_paths[1]};
+  const string tname {uri::decode(undecoded_paths[1])};
   const string token {undecoded_paths[2]};
-  const string partition {undecoded_paths[3]};
-  const string row {undecoded_paths[4]};
+  const string row {uri::decode(undecoded_paths[4])};
+  const string partition {salt.salt(uri::decode(undecoded_paths[3]), row)};
   table_entity entity {partition, row};
   try {
-    uri endpoint_uri {endpoint};
-    storage_credentials creds {token};
-    cloud_table_client client {endpoint_uri, creds};
+    cloud_table table {tables.lookup_table(tname)};
+    status_code allowed {check_sas_token(table, token, partition, row,
+                                         table_shared_access_policy::permissions::update)};
+    if (allowed != status_codes::OK)
+      return tables.exists(tname) ? allowed : status_codes::NotFound;
 
-    table_entity::properties_type& properties = entity.properties();
-    for (const auto v : props) {
-      properties[v.first] = entity_property {v.second};
-    }
+    set_entity_properties(entity.properties(), props);
 
     table_operation op {table_operation::merge_entity(entity)};
-    cloud_table table_cred {client.get_table_reference(tname)};
-    table_result update_result {table_cred.execute(op)};
+    table_result update_result {execute_write(table, op)};
     status_code status {static_cast<status_code> (update_result.http_status_code())};
     if (status == status_codes::NoContent || status == status_codes::OK)
       return status_codes::OK;
@@ -153,8 +364,8 @@ status_code update_with_token (const http_request& message,
   {
     cout << "Azure Table Storage error: " << e.what() << endl;
     cout << e.result().extended_error().message() << endl;
-    if (e.result().http_status_code() == status_codes::Forbidden)
-      return status_codes::Forbidden;
+    if (e.result().http_status_code() == status_codes::NotFound)
+      return status_codes::NotFound;
     else
       return status_codes::InternalError;
   }
@@ -1,20 +1,55 @@
 #ifndef ServerUtils_h
 #define ServerUtils_h
 
+#include <cstdint>
 #include <string>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include <cpprest/http_listener.h>
+#include <cpprest/json.h>
 
 #include <was/table.h>
 
+#include "PartitionSalt.h"
+#include "Resilience.h"
+#include "TableCache.h"
+
+void set_storage_policy (const retry_policy_t& policy);
+
+azure::storage::table_result
+execute_read (const azure::storage::cloud_table& table,
+              const azure::storage::table_operation& op);
+
+azure::storage::table_result
+execute_write (const azure::storage::cloud_table& table,
+               const azure::storage::table_operation& op);
+
+web::http::status_code
+check_sas_token (const azure::storage::cloud_table& table,
+                 const std::string& token,
+                 const std::string& partition,
+                 const std::string& row,
+                 uint8_t permission);
+
 std::pair<web::http::status_code,azure::storage::table_entity>
 read_with_token(const web::http::http_request& message,
-                const std::string& endpoint);
+                TableCache& tables,
+                const PartitionSalt& salt);
+
+void
+set_entity_properties (azure::storage::table_entity::properties_type& properties,
+                       const std::unordered_map<std::string,std::string>& props);
 
+std::vector<std::pair<std::string,web::json::value>>
+get_properties (const azure::storage::table_entity::properties_type& properties,
+                std::vector<std::pair<std::string,web::json::value>> values =
+                  std::vector<std::pair<std::string,web::json::value>> {});
 
 web::http::status_code
 update_with_token (const web::http::http_request& message,
-                   const std::string& endpoint,
+                   TableCache& tables,
+                   const PartitionSalt& salt,
                    const std::unordered_map<std::string,std::string>& props);
 #endif
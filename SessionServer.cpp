@@ -0,0 +1,259 @@
+/*
+  SessionServer: holds the sessions of signed-on users for any
+  number of UserServers started with --session-store, so that a
+  user signed on through one can use all of them.
+
+  Sessions are kept in a LocalSessionStore and exchanged as the
+  JSON objects of session_to_json(). Idle checks and token
+  refreshes are run by the UserServer that signed the user on; it
+  reads the session here to make them. So that a session outlives
+  neither that UserServer nor its timers, this server also drops
+  any session idle for idle_timeout, a while after the UserServer
+  would have.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <cpprest/http_listener.h>
+#include <cpprest/json.h>
+
+#include "JsonBody.h"
+#include "SessionStore.h"
+#include "WorkerLauncher.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+using web::http::http_request;
+using web::http::methods;
+using web::http::status_codes;
+using web::http::uri;
+
+using web::json::value;
+
+using web::http::experimental::listener::http_listener;
+
+constexpr const char* def_url = "http://localhost:34576";
+
+const string session_op {"Session"};
+const string lookup_op {"Lookup"};
+const string sign_on_op {"SignOn"};
+const string sign_off_op {"SignOff"};
+const string expire_op {"Expire"};
+const string set_token_op {"SetToken"};
+const string size_op {"Size"};
+
+const string token_field {"Token"};
+const string token_expiry_field {"TokenExpiry"};
+const string size_field {"Size"};
+
+// Most userids a single Lookup may ask for
+constexpr std::size_t max_lookup {1000};
+
+// UserServer's idle timeout, with time for its own check to run first
+constexpr std::chrono::minutes idle_timeout {35};
+// How often idle sessions are looked for
+constexpr std::chrono::seconds idle_sweep_interval {30};
+
+LocalSessionStore sessions {};
+
+/*
+  Top-level routine for processing all HTTP GET requests.
+
+  Session/<userid>: the user's session, without counting it as
+    activity, or NotFound
+  Size: {"Size": <number of sessions>}
+ */
+void handle_get(http_request message) {
+  string path {uri::decode(message.relative_uri().path())};
+  auto paths = uri::split_path(path);
+  if (paths.size() == 2 && paths[0] == session_op) {
+    session_t session;
+    if (sessions.peek(paths[1], session))
+      message.reply(status_codes::OK, session_to_json(session));
+    else
+      message.reply(status_codes::NotFound);
+    return;
+  }
+  if (paths.size() == 1 && paths[0] == size_op) {
+    value result {value::object()};
+    result[size_field] = value::string(std::to_string(sessions.size()));
+    message.reply(status_codes::OK, result);
+    return;
+  }
+  message.reply(status_codes::BadRequest);
+}
+
+/*
+  Top-level routine for processing all HTTP POST requests.
+
+  Lookup, with a body of a JSON array of userids: an object
+    mapping each of them that is signed on to their session.
+    Each is counted as activity.
+ */
+void handle_post(http_request message) {
+  string path {uri::decode(message.relative_uri().path())};
+  auto paths = uri::split_path(path);
+  if (paths.size() != 1 || paths[0] != lookup_op) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
+
+  value userids {};
+  try {
+    userids = message.extract_json(true).get();
+  }
+  catch (const web::json::json_exception&) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
+  if (!userids.is_array() || userids.size() > max_lookup) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
+
+  value found {value::object()};
+  for (const auto& u : userids.as_array()) {
+    if (! u.is_string())
+      continue;
+    session_t session;
+    if (sessions.lookup(u.as_string(), session))
+      found[u.as_string()] = session_to_json(session);
+  }
+  message.reply(status_codes::OK, found);
+}
+
+/*
+  Top-level routine for processing all HTTP PUT requests.
+
+  SignOn/<userid>, with a session as the body: Conflict if the
+    user is already signed on
+  SetToken/<userid>/<generation>, with {"Token", "TokenExpiry"}:
+    NotFound if that sign-on has ended
+ */
+void handle_put(http_request message) {
+  string path {uri::decode(message.relative_uri().path())};
+  auto paths = uri::split_path(path);
+
+  if (paths.size() == 2 && paths[0] == sign_on_op) {
+    session_t session;
+    try {
+      if (! session_from_json(message.extract_json(true).get(), session)) {
+        message.reply(status_codes::BadRequest);
+        return;
+      }
+    }
+    catch (const web::json::json_exception&) {
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+    message.reply(sessions.sign_on(paths[1], session) == sign_on_result_t::signed_on ?
+                  status_codes::OK : status_codes::Conflict);
+    return;
+  }
+
+  if (paths.size() == 3 && paths[0] == set_token_op) {
+    unordered_map<string,string> json_body {get_json_body(message)};
+    auto token (json_body.find(token_field));
+    auto expiry (json_body.find(token_expiry_field));
+    if (token == json_body.end() || expiry == json_body.end()) {
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+    try {
+      const std::uint64_t generation {std::stoull(paths[2])};
+      const std::chrono::system_clock::time_point expiry_time {
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(
+          std::chrono::milliseconds {std::stoll(expiry->second)})};
+      message.reply(sessions.set_token(paths[1], generation, token->second, expiry_time) ?
+                    status_codes::OK : status_codes::NotFound);
+    }
+    catch (const std::exception&) {
+      message.reply(status_codes::BadRequest);
+    }
+    return;
+  }
+
+  message.reply(status_codes::BadRequest);
+}
+
+/*
+  Top-level routine for processing all HTTP DELETE requests.
+
+  SignOff/<userid>: NotFound if the user was not signed on
+  Expire/<userid>/<generation>: ends the session only if it is
+    still that sign-on; NotFound otherwise
+ */
+void handle_delete(http_request message) {
+  string path {uri::decode(message.relative_uri().path())};
+  auto paths = uri::split_path(path);
+
+  if (paths.size() == 2 && paths[0] == sign_off_op) {
+    message.reply(sessions.sign_off(paths[1]) ? status_codes::OK : status_codes::NotFound);
+    return;
+  }
+
+  if (paths.size() == 3 && paths[0] == expire_op) {
+    try {
+      const std::uint64_t generation {std::stoull(paths[2])};
+      message.reply(sessions.expire(paths[1], generation) ? status_codes::OK : status_codes::NotFound);
+    }
+    catch (const std::exception&) {
+      message.reply(status_codes::BadRequest);
+    }
+    return;
+  }
+
+  message.reply(status_codes::BadRequest);
+}
+
+int main (int argc, char const * argv[]) {
+  // The sessions are the state, so it runs as one worker
+  WorkerLauncher launcher {false};
+  for (int i = 1; i + 1 < argc; i += 2)
+    launcher.parse_option(argv[i], argv[i+1]);
+  launcher.start();
+
+  cout << "SessionServer: Opening listener" << endl;
+  http_listener listener {launcher.url(def_url)};
+  listener.support(methods::GET, &handle_get);
+  listener.support(methods::POST, &handle_post);
+  listener.support(methods::PUT, &handle_put);
+  listener.support(methods::DEL, &handle_delete);
+  listener.open().wait(); // Wait for listener to complete starting
+
+  std::atomic<bool> stopping {false};
+  std::thread idle_sweep {[&stopping] () {
+      auto next = std::chrono::steady_clock::now() + idle_sweep_interval;
+      while (! stopping) {
+        std::this_thread::sleep_for(std::chrono::seconds {1});
+        if (std::chrono::steady_clock::now() < next)
+          continue;
+        next += idle_sweep_interval;
+        const std::size_t removed {sessions.expire_idle(idle_timeout)};
+        if (removed > 0)
+          cout << "Expired " << removed << " idle sessions" << endl;
+      }
+    }};
+
+  cout << "Enter carriage return to stop SessionServer." << endl;
+  launcher.wait_for_stop();
+
+  // Shut it down
+  listener.close().wait();
+  stopping = true;
+  idle_sweep.join();
+  cout << "SessionServer closed" << endl;
+}
@@ -0,0 +1,229 @@
+#include "SessionStore.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cpprest/json.h>
+
+#include <pplx/pplxtasks.h>
+
+using std::pair;
+using std::string;
+using std::vector;
+
+using web::json::value;
+
+/*
+  Copy the session of a signed-on user into session and record
+  the user's activity. Returns false if the user is not signed on.
+ */
+bool LocalSessionStore::lookup(const string& userid, session_t& session) {
+  const auto now = std::chrono::steady_clock::now();
+  return sessions.update(userid, [&session, now] (session_t& s) {
+      s.last_activity = now;
+      session = s;
+    });
+}
+
+/*
+  Copy the session of a signed-on user into session without
+  counting it as activity. Returns false if the user is not signed on.
+ */
+bool LocalSessionStore::peek(const string& userid, session_t& session) {
+  return sessions.find(userid, session);
+}
+
+/*
+  Record a new session, keeping the existing one if the user is
+  already signed on
+ */
+sign_on_result_t LocalSessionStore::sign_on(const string& userid, const session_t& session) {
+  session_t s {session};
+  s.last_activity = std::chrono::steady_clock::now();
+  s.last_push = pplx::task_from_result();
+  return sessions.insert(userid, s) ? sign_on_result_t::signed_on : sign_on_result_t::already_signed_on;
+}
+
+/*
+  Remove a session. Returns false if the user was not signed on.
+ */
+bool LocalSessionStore::sign_off(const string& userid) {
+  return sessions.erase(userid);
+}
+
+/*
+  Remove a session if it is still the one from the sign-on
+  numbered generation, so a timer set for an earlier sign-on
+  cannot end a later one. Returns true if the session was removed.
+ */
+bool LocalSessionStore::expire(const string& userid, std::uint64_t generation) {
+  return sessions.erase_if(userid, [generation] (const session_t& s) {
+      return s.generation == generation;
+    });
+}
+
+/*
+  Remove every session idle for longer than max_idle, returning
+  how many were removed. A session used while this runs is kept.
+ */
+std::size_t LocalSessionStore::expire_idle(std::chrono::steady_clock::duration max_idle) {
+  const auto cutoff = std::chrono::steady_clock::now() - max_idle;
+  vector<string> idle {};
+  sessions.for_each([&idle, cutoff] (const string& userid, const session_t& s) {
+      if (s.last_activity < cutoff)
+        idle.push_back(userid);
+    });
+  std::size_t removed {0};
+  for (const auto& userid : idle)
+    if (sessions.erase_if(userid, [cutoff] (const session_t& s) { return s.last_activity < cutoff; }))
+      ++removed;
+  return removed;
+}
+
+/*
+  Replace the update token of the sign-on numbered generation.
+  Returns false if that session has ended.
+ */
+bool LocalSessionStore::set_token(const string& userid, std::uint64_t generation,
+                             const string& token,
+                             std::chrono::system_clock::time_point expiry) {
+  bool current {false};
+  sessions.update(userid, [&] (session_t& s) {
+      if (s.generation != generation)
+        return;
+      s.token = token;
+      s.token_expiry = expiry;
+      current = true;
+    });
+  return current;
+}
+
+/*
+  Replace the cached copy of a user's entity with one just read
+ */
+bool LocalSessionStore::cache_entity(const string& userid, const value& entity) {
+  const auto now = std::chrono::steady_clock::now();
+  return sessions.update(userid, [&entity, now] (session_t& s) {
+      s.entity = entity;
+      s.entity_fetched = now;
+    });
+}
+
+/*
+  Apply properties just written to a user's entity to its cached
+  copy, if there is one. The copy's age is left unchanged.
+ */
+bool LocalSessionStore::merge_entity(const string& userid,
+                                const vector<pair<string,string>>& props) {
+  return sessions.update(userid, [&props] (session_t& s) {
+      if (! s.entity.is_object())
+        return;
+      for (const auto& p : props)
+        s.entity[p.first] = value::string(p.second);
+    });
+}
+
+/*
+  Discard the cached copy of a user's entity, so the next
+  operation reads it again
+ */
+bool LocalSessionStore::drop_entity(const string& userid) {
+  return sessions.update(userid, [] (session_t& s) {
+      s.entity = value {};
+    });
+}
+
+/*
+  Make push the user's latest status push, returning the one it
+  replaces, which push should wait for so that statuses reach
+  friends in the order they were set. Returns a completed task if
+  the user is not signed on or has no push outstanding.
+ */
+pplx::task<void> LocalSessionStore::queue_push(const string& userid, const pplx::task<void>& push) {
+  pplx::task<void> previous {pplx::task_from_result()};
+  sessions.update(userid, [&previous, &push] (session_t& s) {
+      previous = s.last_push;
+      s.last_push = push;
+    });
+  return previous;
+}
+
+namespace {
+  const string token_field {"Token"};
+  const string partition_field {"Partition"};
+  const string row_field {"Row"};
+  const string token_expiry_field {"TokenExpiry"};  // Milliseconds since the Unix epoch
+  const string idle_field {"IdleMs"};  // Milliseconds since last_activity
+  const string generation_field {"Generation"};
+
+  bool get_field (const value& v, const string& name, string& field) {
+    if (! v.has_field(name) || ! v.at(name).is_string())
+      return false;
+    field = v.at(name).as_string();
+    return true;
+  }
+}
+
+/*
+  Return the parts of a session that are shared between processes
+  as a JSON object of strings. The clocks are converted so another
+  process can rebuild them: token_expiry as milliseconds since the
+  Unix epoch, last_activity as milliseconds before now. The entity
+  and pending push are not sent.
+ */
+value session_to_json (const session_t& session) {
+  using std::chrono::duration_cast;
+  using std::chrono::milliseconds;
+  value v {value::object()};
+  v[token_field] = value::string(session.token);
+  v[partition_field] = value::string(session.partition);
+  v[row_field] = value::string(session.row);
+  v[token_expiry_field] = value::string(std::to_string(
+      duration_cast<milliseconds>(session.token_expiry.time_since_epoch()).count()));
+  const auto idle = std::chrono::steady_clock::now() - session.last_activity;
+  v[idle_field] = value::string(std::to_string(
+      idle.count() > 0 ? duration_cast<milliseconds>(idle).count() : 0));
+  v[generation_field] = value::string(std::to_string(session.generation));
+  return v;
+}
+
+/*
+  Rebuild a session sent by session_to_json(). Returns false,
+  leaving session unchanged, if v is not such an object.
+ */
+bool session_from_json (const value& v, session_t& session) {
+  if (! v.is_object())
+    return false;
+  string token, partition, row, expiry, idle, generation;
+  if (! get_field(v, token_field, token) ||
+      ! get_field(v, partition_field, partition) ||
+      ! get_field(v, row_field, row) ||
+      ! get_field(v, token_expiry_field, expiry) ||
+      ! get_field(v, generation_field, generation))
+    return false;
+  get_field(v, idle_field, idle);
+
+  try {
+    session_t s {};
+    s.token = token;
+    s.partition = partition;
+    s.row = row;
+    s.token_expiry = std::chrono::system_clock::time_point {
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+        std::chrono::milliseconds {std::stoll(expiry)})};
+    s.last_activity = std::chrono::steady_clock::now() -
+      std::chrono::milliseconds {idle.empty() ? 0 : std::stoll(idle)};
+    s.generation = std::stoull(generation);
+    s.last_push = pplx::task_from_result();
+    session = s;
+    return true;
+  }
+  catch (const std::exception&) {
+    return false;
+  }
+}
@@ -0,0 +1,104 @@
+#ifndef SessionStore_h
+#define SessionStore_h
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cpprest/json.h>
+
+#include <pplx/pplxtasks.h>
+
+#include "ShardedMap.h"
+
+/*
+  What UserServer keeps for a signed-on user
+ */
+struct session_t {
+  std::string token;      // Update token for the user's DataTable entity
+  std::string partition;  // Partition and row of that entity
+  std::string row;
+  std::chrono::system_clock::time_point token_expiry;
+  std::chrono::steady_clock::time_point last_activity;
+  web::json::value entity;  // Cached copy of the entity, null if none
+  std::chrono::steady_clock::time_point entity_fetched;
+  std::uint64_t generation;  // Distinguishes this sign-on from earlier ones
+  pplx::task<void> last_push;  // Completes when the user's latest status is pushed
+};
+
+/*
+  Outcome of SessionStore::sign_on()
+ */
+enum class sign_on_result_t {
+  signed_on,
+  already_signed_on,  // The existing session is kept
+  unavailable         // The store could not be reached; nothing is known
+};
+
+/*
+  Sessions of signed-on users, keyed by userid.
+
+  LocalSessionStore keeps them in this process. RemoteSessionStore
+  keeps them in a SessionServer shared by several UserServers, so
+  a user signed on through one can use any of them.
+ */
+class SessionStore {
+public:
+  virtual ~SessionStore () {};
+
+  virtual bool lookup(const std::string& userid, session_t& session) = 0;
+  virtual bool peek(const std::string& userid, session_t& session) = 0;
+  virtual sign_on_result_t sign_on(const std::string& userid, const session_t& session) = 0;
+  virtual bool sign_off(const std::string& userid) = 0;
+  virtual bool expire(const std::string& userid, std::uint64_t generation) = 0;
+  virtual bool set_token(const std::string& userid, std::uint64_t generation,
+                         const std::string& token,
+                         std::chrono::system_clock::time_point expiry) = 0;
+  virtual bool cache_entity(const std::string& userid, const web::json::value& entity) = 0;
+  virtual bool merge_entity(const std::string& userid,
+                            const std::vector<std::pair<std::string,std::string>>& props) = 0;
+  virtual bool drop_entity(const std::string& userid) = 0;
+  virtual pplx::task<void> queue_push(const std::string& userid, const pplx::task<void>& push) = 0;
+  virtual std::size_t size() = 0;
+};
+
+/*
+  Sessions held in this process.
+
+  Every operation is a single hash lookup in one shard of a
+  ShardedMap, so handlers on any thread of the listener's pool
+  can use it concurrently.
+ */
+class LocalSessionStore : public SessionStore {
+private:
+  ShardedMap<session_t> sessions;
+
+public:
+  LocalSessionStore () :
+    sessions {}
+    {};
+
+  bool lookup(const std::string& userid, session_t& session) override;
+  bool peek(const std::string& userid, session_t& session) override;
+  sign_on_result_t sign_on(const std::string& userid, const session_t& session) override;
+  bool sign_off(const std::string& userid) override;
+  bool expire(const std::string& userid, std::uint64_t generation) override;
+  bool set_token(const std::string& userid, std::uint64_t generation,
+                 const std::string& token,
+                 std::chrono::system_clock::time_point expiry) override;
+  bool cache_entity(const std::string& userid, const web::json::value& entity) override;
+  bool merge_entity(const std::string& userid,
+                    const std::vector<std::pair<std::string,std::string>>& props) override;
+  bool drop_entity(const std::string& userid) override;
+  pplx::task<void> queue_push(const std::string& userid, const pplx::task<void>& push) override;
+  std::size_t size() override { return sessions.size(); }
+  std::size_t expire_idle(std::chrono::steady_clock::duration max_idle);
+};
+
+web::json::value session_to_json (const session_t& session);
+bool session_from_json (const web::json::value& v, session_t& session);
+
+#endif
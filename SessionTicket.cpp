@@ -0,0 +1,277 @@
+#include "SessionTicket.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+using std::size_t;
+using std::string;
+using std::vector;
+
+namespace {
+  constexpr unsigned char ticket_version {2};
+  constexpr size_t mac_size {32};  // SHA-256
+
+  const char base64url_chars[] {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"};
+
+  string base64url_encode (const string& in) {
+    string out {};
+    out.reserve((in.size() + 2) / 3 * 4);
+    size_t i {0};
+    for (; i + 2 < in.size(); i += 3) {
+      const std::uint32_t n {(std::uint32_t {static_cast<unsigned char>(in[i])} << 16) |
+                             (std::uint32_t {static_cast<unsigned char>(in[i+1])} << 8) |
+                             static_cast<unsigned char>(in[i+2])};
+      out += base64url_chars[(n >> 18) & 63];
+      out += base64url_chars[(n >> 12) & 63];
+      out += base64url_chars[(n >> 6) & 63];
+      out += base64url_chars[n & 63];
+    }
+    if (i < in.size()) {
+      std::uint32_t n {std::uint32_t {static_cast<unsigned char>(in[i])} << 16};
+      if (i + 1 < in.size())
+        n |= std::uint32_t {static_cast<unsigned char>(in[i+1])} << 8;
+      out += base64url_chars[(n >> 18) & 63];
+      out += base64url_chars[(n >> 12) & 63];
+      if (i + 1 < in.size())
+        out += base64url_chars[(n >> 6) & 63];
+    }
+    return out;
+  }
+
+  /*
+    Decode unpadded base64url into out. Returns false on any
+    character outside the alphabet, an impossible length, or
+    unused trailing bits that are not zero.
+   */
+  bool base64url_decode (const string& in, string& out) {
+    if (in.size() % 4 == 1)
+      return false;
+    out.clear();
+    out.reserve(in.size() / 4 * 3 + 2);
+    std::uint32_t n {0};
+    unsigned bits {0};
+    for (char c : in) {
+      unsigned v;
+      if (c >= 'A' && c <= 'Z') v = c - 'A';
+      else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+      else if (c >= '0' && c <= '9') v = c - '0' + 52;
+      else if (c == '-') v = 62;
+      else if (c == '_') v = 63;
+      else return false;
+      n = (n << 6) | v;
+      bits += 6;
+      if (bits >= 8) {
+        bits -= 8;
+        out += static_cast<char>((n >> bits) & 0xff);
+      }
+    }
+    // Only one spelling of each byte string is accepted
+    return (n & ((1u << bits) - 1)) == 0;
+  }
+
+  void put_u64 (string& out, std::uint64_t n) {
+    for (int shift = 56; shift >= 0; shift -= 8)
+      out += static_cast<char>((n >> shift) & 0xff);
+  }
+
+  void put_string (string& out, const string& s) {
+    out += static_cast<char>((s.size() >> 8) & 0xff);
+    out += static_cast<char>(s.size() & 0xff);
+    out += s;
+  }
+
+  /*
+    Bounds-checked reader over a decoded payload
+   */
+  class reader {
+  private:
+    const string& in;
+    size_t pos;
+  public:
+    explicit reader (const string& in) : in (in), pos {0} {};
+
+    bool get_u8 (unsigned char& b) {
+      if (pos + 1 > in.size())
+        return false;
+      b = static_cast<unsigned char>(in[pos++]);
+      return true;
+    }
+
+    bool get_u64 (std::uint64_t& n) {
+      if (pos + 8 > in.size())
+        return false;
+      n = 0;
+      for (int i = 0; i < 8; ++i)
+        n = (n << 8) | static_cast<unsigned char>(in[pos++]);
+      return true;
+    }
+
+    bool get_string (string& s) {
+      if (pos + 2 > in.size())
+        return false;
+      const size_t len {(size_t {static_cast<unsigned char>(in[pos])} << 8) |
+                        static_cast<unsigned char>(in[pos+1])};
+      pos += 2;
+      if (pos + len > in.size())
+        return false;
+      s = in.substr(pos, len);
+      pos += len;
+      return true;
+    }
+
+    bool at_end () const { return pos == in.size(); }
+  };
+
+  std::uint64_t to_ms (std::chrono::system_clock::time_point t) {
+    return static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(t.time_since_epoch()).count());
+  }
+
+  std::chrono::system_clock::time_point from_ms (std::uint64_t ms) {
+    return std::chrono::system_clock::time_point {
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+        std::chrono::milliseconds {static_cast<std::chrono::milliseconds::rep>(ms)})};
+  }
+}
+
+/*
+  Start with a random key. Tickets then only verify in this
+  process until set_key() gives the key shared by all UserServers.
+ */
+TicketSigner::TicketSigner (std::chrono::system_clock::duration max_life) :
+  key (mac_size),
+  max_life {max_life},
+  revoked {}
+{
+  RAND_bytes(key.data(), static_cast<int>(key.size()));
+}
+
+void TicketSigner::set_key(const string& secret) {
+  key.assign(secret.begin(), secret.end());
+}
+
+/*
+  Return the raw HMAC-SHA256 of payload under the key
+ */
+string TicketSigner::mac(const string& payload) const {
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int md_len {0};
+  HMAC(EVP_sha256(), key.data(), static_cast<int>(key.size()),
+       reinterpret_cast<const unsigned char*>(payload.data()), payload.size(),
+       md, &md_len);
+  return string(reinterpret_cast<const char*>(md), md_len);
+}
+
+/*
+  Stamp ticket with its issue time, cap its expiry at max_life
+  from then, and return it signed. A ticket issued in the same
+  millisecond as the user's last revocation is stamped just after
+  it, so it is not refused.
+  Strings longer than 65535 bytes are not representable and
+  throw std::length_error.
+ */
+string TicketSigner::issue(ticket_t& ticket) {
+  for (const string* s : {&ticket.userid, &ticket.partition, &ticket.row, &ticket.token})
+    if (s->size() > 0xffff)
+      throw std::length_error("Session ticket field too long");
+  ticket.issued = from_ms(to_ms(std::chrono::system_clock::now()));
+  std::chrono::system_clock::time_point revoked_before;
+  if (revoked.find(ticket.userid, revoked_before) && ticket.issued < revoked_before)
+    ticket.issued = revoked_before;
+  if (ticket.expiry > ticket.issued + max_life)
+    ticket.expiry = ticket.issued + max_life;
+
+  string payload {};
+  payload.reserve(1 + 8 + 8 + 8 + ticket.userid.size() + ticket.partition.size() +
+                  ticket.row.size() + ticket.token.size());
+  payload += static_cast<char>(ticket_version);
+  put_u64(payload, to_ms(ticket.issued));
+  put_u64(payload, to_ms(ticket.expiry));
+  put_string(payload, ticket.userid);
+  put_string(payload, ticket.partition);
+  put_string(payload, ticket.row);
+  put_string(payload, ticket.token);
+  return base64url_encode(payload) + "." + base64url_encode(mac(payload));
+}
+
+/*
+  Decode a ticket into result if its MAC is right, it has not
+  expired and it was issued after the user's last revocation. The MAC is compared in
+  constant time, and nothing in the payload is read before it
+  has been verified.
+ */
+bool TicketSigner::check(const string& ticket, ticket_t& result) {
+  const auto dot = ticket.find('.');
+  if (dot == string::npos)
+    return false;
+  string payload, given_mac;
+  if (! base64url_decode(ticket.substr(0, dot), payload) ||
+      ! base64url_decode(ticket.substr(dot + 1), given_mac) ||
+      given_mac.size() != mac_size)
+    return false;
+  const string expected_mac {mac(payload)};
+  if (CRYPTO_memcmp(expected_mac.data(), given_mac.data(), mac_size) != 0)
+    return false;
+
+  reader r {payload};
+  unsigned char version {0};
+  std::uint64_t issued_ms {0};
+  std::uint64_t expiry_ms {0};
+  ticket_t t {};
+  if (! r.get_u8(version) || version != ticket_version ||
+      ! r.get_u64(issued_ms) || ! r.get_u64(expiry_ms) ||
+      ! r.get_string(t.userid) || ! r.get_string(t.partition) ||
+      ! r.get_string(t.row) || ! r.get_string(t.token) || ! r.at_end())
+    return false;
+  t.issued = from_ms(issued_ms);
+  t.expiry = from_ms(expiry_ms);
+  if (t.expiry <= std::chrono::system_clock::now())
+    return false;
+
+  std::chrono::system_clock::time_point revoked_before;
+  if (revoked.find(t.userid, revoked_before) && t.issued < revoked_before)
+    return false;
+  result = t;
+  return true;
+}
+
+/*
+  Refuse every ticket issued to userid up to now
+ */
+void TicketSigner::revoke(const string& userid) {
+  // Just past this millisecond, the resolution of issue times
+  const auto before = from_ms(to_ms(std::chrono::system_clock::now()) + 1);
+  if (! revoked.insert(userid, before))
+    revoked.update(userid, [before] (std::chrono::system_clock::time_point& t) {
+        if (t < before)
+          t = before;
+      });
+}
+
+/*
+  Forget revocations older than max_life, as every ticket they
+  cover has expired and check() would refuse it anyway
+ */
+void TicketSigner::prune() {
+  const auto now = std::chrono::system_clock::now();
+  const auto life = max_life;
+  vector<string> expired {};
+  revoked.for_each([&expired, now, life] (const string& userid, std::chrono::system_clock::time_point& before) {
+      if (before + life <= now)
+        expired.push_back(userid);
+    });
+  for (const auto& userid : expired)
+    revoked.erase_if(userid, [now, life] (const std::chrono::system_clock::time_point& before) {
+        return before + life <= now;
+      });
+}
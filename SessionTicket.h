@@ -0,0 +1,54 @@
+#ifndef SessionTicket_h
+#define SessionTicket_h
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "ShardedMap.h"
+
+/*
+  What a session ticket vouches for
+ */
+struct ticket_t {
+  std::string userid;
+  std::string partition;  // Partition and row of the user's DataTable entity
+  std::string row;
+  std::string token;      // Update token for that entity
+  std::chrono::system_clock::time_point expiry;
+  std::chrono::system_clock::time_point issued;  // Set by issue(), to the millisecond
+};
+
+/*
+  Issues and checks session tickets: a ticket_t and its
+  HMAC-SHA256 under a key shared by every UserServer, in
+  base64url as "<payload>.<mac>".
+
+  A UserServer given a ticket needs no session lookup: check()
+  recomputes the MAC and compares it in constant time. The only
+  state is, per user, the time of their last revocation: tickets
+  issued before it are refused. A ticket lives at most max_life,
+  so each revocation is held until every ticket it covers has
+  expired anyway. Revocations are held in each process; a ticket
+  revoked through one UserServer is still accepted by the others.
+ */
+class TicketSigner {
+private:
+  std::vector<unsigned char> key;
+  std::chrono::system_clock::duration max_life;
+  ShardedMap<std::chrono::system_clock::time_point> revoked;  // Userid -> tickets issued before are refused
+
+  std::string mac(const std::string& payload) const;
+
+public:
+  explicit TicketSigner (std::chrono::system_clock::duration max_life);
+
+  void set_key(const std::string& secret);
+  std::string issue(ticket_t& ticket);
+  bool check(const std::string& ticket, ticket_t& result);
+  void revoke(const std::string& userid);
+  void prune();
+};
+
+#endif
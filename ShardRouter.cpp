@@ -0,0 +1,111 @@
+#include "ShardRouter.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cpprest/uri.h>
+
+#include "RpcFrame.h"
+#include "WorkerLauncher.h"
+
+using std::make_pair;
+using std::pair;
+using std::size_t;
+using std::string;
+using std::vector;
+
+using web::uri;
+
+/*
+  Return the addresses of count shards on the ports WorkerLauncher
+  gives the shards of a server at base_addr. Throws
+  std::invalid_argument if count is 0 or the last shard's ports
+  would be past 65535.
+ */
+vector<string> shard_addrs (const string& base_addr, unsigned count) {
+  const uri base {base_addr};
+  if (count == 0 ||
+      base.port() + static_cast<long>(shard_port_stride) * (count - 1) + rpc_port_offset > 65535)
+    throw std::invalid_argument("No room for " + std::to_string(count) + " shards above " + base_addr);
+  vector<string> addrs {};
+  for (unsigned i = 0; i < count; ++i) {
+    web::uri_builder builder {base};
+    builder.set_port(base.port() + shard_port_stride * static_cast<int>(i));
+    addrs.push_back(builder.to_string());
+  }
+  return addrs;
+}
+
+/*
+  As above, for count given as text, such as a command-line flag
+  or a path segment. Throws std::invalid_argument if it is not a
+  number.
+ */
+vector<string> shard_addrs (const string& base_addr, const string& count) {
+  if (count.empty() || count.size() > 5 || count.find_first_not_of("0123456789") != string::npos)
+    throw std::invalid_argument("Not a shard count: " + count);
+  return shard_addrs(base_addr, static_cast<unsigned>(std::stoul(count)));
+}
+
+namespace {
+  /*
+    FNV-1a, with a final mix so that keys differing only in their
+    last characters still land far apart on the ring
+   */
+  std::uint64_t ring_hash (const string& s) {
+    std::uint64_t h {14695981039346656037ULL};
+    for (unsigned char c : s) {
+      h ^= c;
+      h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+  }
+}
+
+constexpr unsigned ShardRouter::points_per_shard;
+
+/*
+  Route to the shards at addrs, replacing the current set. Shards
+  kept from the current set keep the entities they had, less
+  those taken by new shards.
+ */
+void ShardRouter::set_shards (const vector<string>& addrs) {
+  if (addrs.empty())
+    throw std::invalid_argument("ShardRouter needs at least one shard");
+  auto fresh (std::make_shared<ring_t>());
+  fresh->shards = addrs;
+  fresh->points.reserve(addrs.size() * points_per_shard);
+  for (size_t s = 0; s < addrs.size(); ++s)
+    for (unsigned i = 0; i < points_per_shard; ++i)
+      fresh->points.push_back(make_pair(ring_hash(addrs[s] + "#" + std::to_string(i)), s));
+  std::sort(fresh->points.begin(), fresh->points.end());
+
+  std::atomic_store(&ring, std::shared_ptr<const ring_t> {fresh});
+}
+
+vector<string> ShardRouter::shards () const {
+  return std::atomic_load(&ring)->shards;
+}
+
+/*
+  Return the address of the shard owning entity (partition, row)
+  of table
+ */
+string ShardRouter::route (const string& table, const string& partition, const string& row) const {
+  const std::uint64_t h {ring_hash(std::to_string(table.size()) + ':' + table +
+                                   std::to_string(partition.size()) + ':' + partition + row)};
+  const std::shared_ptr<const ring_t> current {std::atomic_load(&ring)};
+  auto point (std::lower_bound(current->points.begin(), current->points.end(), make_pair(h, size_t {0})));
+  if (point == current->points.end())
+    point = current->points.begin();
+  return current->shards[point->second];
+}
@@ -0,0 +1,59 @@
+#ifndef ShardRouter_h
+#define ShardRouter_h
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+std::vector<std::string>
+shard_addrs (const std::string& base_addr, unsigned count);
+
+std::vector<std::string>
+shard_addrs (const std::string& base_addr, const std::string& count);
+
+/*
+  Routes requests for DataTable entities to one of a set of
+  BasicServer shards by consistent hashing.
+
+  Each shard is placed at many points on a 64-bit hash ring, and
+  an entity belongs to the first shard point at or after the hash
+  of its (table, partition, row). Hashing the row as well spreads
+  a popular country over every shard. When a shard is added it
+  takes over about 1/N of the entities, spread evenly over the
+  others, and the rest keep their shard, so per-shard caches stay
+  warm across a reshard. Every shard can serve every entity, so
+  requests in flight during a reshard are still answered
+  correctly.
+
+  The ring is never changed once built. set_shards() builds a new
+  one and swaps it in with atomic_store, so route() takes no lock
+  and may run alongside a reshard.
+ */
+class ShardRouter {
+private:
+  static constexpr unsigned points_per_shard {128};
+
+  struct ring_t {
+    std::vector<std::string> shards;
+    std::vector<std::pair<std::uint64_t,std::size_t>> points;  // (point, shard), sorted
+  };
+
+  std::shared_ptr<const ring_t> ring;  // Read and replaced with atomic_load/atomic_store
+
+public:
+  explicit ShardRouter (const std::string& addr) :
+    ring {}
+  {
+    set_shards(std::vector<std::string> {addr});
+  };
+
+  void set_shards(const std::vector<std::string>& addrs);
+  std::vector<std::string> shards() const;
+  std::string route(const std::string& table, const std::string& partition,
+                    const std::string& row) const;
+};
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef ShardedMap_h
+#define ShardedMap_h
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+/*
+  Hash map from strings to V that is safe to use from every
+  thread of the listener's pool.
+
+  Keys are spread over a fixed number of shards, each an
+  unordered_map with its own lock, so lookups stay O(1) and
+  threads working on different keys rarely wait for each other.
+  Values are copied in and out; update() changes a value in place
+  while its shard is locked.
+ */
+template <typename V>
+class ShardedMap {
+private:
+  struct shard_t {
+    std::unordered_map<std::string,V> entries;
+    pplx::extensibility::critical_section_t lock;
+  };
+
+  std::vector<shard_t> shards;
+
+  shard_t& shard_for(const std::string& key) {
+    return shards[std::hash<std::string> {}(key) % shards.size()];
+  }
+
+public:
+  explicit ShardedMap (std::size_t shard_count = 64) :
+    shards (shard_count)
+    {};
+
+  /*
+    Copy the value for key into value. Returns false if key is absent.
+   */
+  bool find(const std::string& key, V& value) {
+    shard_t& shard = shard_for(key);
+    pplx::extensibility::scoped_critical_section_t lock {shard.lock};
+    auto entry (shard.entries.find(key));
+    if (entry == shard.entries.end())
+      return false;
+    value = entry->second;
+    return true;
+  }
+
+  /*
+    Add key with value. Returns false, leaving the map unchanged,
+    if key is already present.
+   */
+  bool insert(const std::string& key, const V& value) {
+    shard_t& shard = shard_for(key);
+    pplx::extensibility::scoped_critical_section_t lock {shard.lock};
+    return shard.entries.insert(std::make_pair(key, value)).second;
+  }
+
+  /*
+    Return the value for key, first adding key with the value
+    make() returns if it is absent. make is called with the shard
+    locked, so at most once for a key however many threads ask.
+
+    make must not call back into this map.
+   */
+  template <typename F>
+  V find_or_insert(const std::string& key, F make) {
+    shard_t& shard = shard_for(key);
+    pplx::extensibility::scoped_critical_section_t lock {shard.lock};
+    auto entry (shard.entries.find(key));
+    if (entry == shard.entries.end())
+      entry = shard.entries.insert(std::make_pair(key, make())).first;
+    return entry->second;
+  }
+
+  /*
+    Add key with value, replacing any existing value
+   */
+  void assign(const std::string& key, const V& value) {
+    shard_t& shard = shard_for(key);
+    pplx::extensibility::scoped_critical_section_t lock {shard.lock};
+    shard.entries[key] = value;
+  }
+
+  /*
+    Remove key. Returns false if key was absent.
+   */
+  bool erase(const std::string& key) {
+    shard_t& shard = shard_for(key);
+    pplx::extensibility::scoped_critical_section_t lock {shard.lock};
+    return shard.entries.erase(key) == 1;
+  }
+
+  /*
+    Remove key if pred(const V&) holds for its value, deciding and
+    removing with the shard locked. Returns true if key was removed.
+   */
+  template <typename P>
+  bool erase_if(const std::string& key, P pred) {
+    shard_t& shard = shard_for(key);
+    pplx::extensibility::scoped_critical_section_t lock {shard.lock};
+    auto entry (shard.entries.find(key));
+    if (entry == shard.entries.end() || !pred(entry->second))
+      return false;
+    shard.entries.erase(entry);
+    return true;
+  }
+
+  /*
+    Call f(V&) on the value for key with its shard locked.
+    Returns false, without calling f, if key is absent.
+
+    f must not call back into this map.
+   */
+  template <typename F>
+  bool update(const std::string& key, F f) {
+    shard_t& shard = shard_for(key);
+    pplx::extensibility::scoped_critical_section_t lock {shard.lock};
+    auto entry (shard.entries.find(key));
+    if (entry == shard.entries.end())
+      return false;
+    f(entry->second);
+    return true;
+  }
+
+  /*
+    Call f(const std::string&, V&) on every entry, locking one shard
+    at a time. Entries added or removed meanwhile in other shards
+    may or may not be seen.
+   */
+  template <typename F>
+  void for_each(F f) {
+    for (auto& shard : shards) {
+      pplx::extensibility::scoped_critical_section_t lock {shard.lock};
+      for (auto& entry : shard.entries)
+        f(entry.first, entry.second);
+    }
+  }
+
+  std::size_t size() {
+    std::size_t total {0};
+    for (auto& shard : shards) {
+      pplx::extensibility::scoped_critical_section_t lock {shard.lock};
+      total += shard.entries.size();
+    }
+    return total;
+  }
+};
+
+#endif
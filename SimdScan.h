@@ -0,0 +1,48 @@
+#ifndef SimdScan_h
+#define SimdScan_h
+
+#include <cstdint>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+  Byte scanning helpers for the parsers, using SSE2 to test 16
+  bytes per step where the compiler targets it and a plain loop
+  everywhere else.
+ */
+
+/*
+  Return a pointer to the first byte in [p, end) that is a or b,
+  or end if there is none.
+ */
+inline const char* find_first_of2(const char* p, const char* end, char a, char b) {
+#if defined(__SSE2__)
+  const __m128i va {_mm_set1_epi8(a)};
+  const __m128i vb {_mm_set1_epi8(b)};
+  while (end - p >= 16) {
+    const __m128i chunk {_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))};
+    const int mask {_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va),
+                                                   _mm_cmpeq_epi8(chunk, vb)))};
+    if (mask != 0)
+      return p + __builtin_ctz(static_cast<unsigned>(mask));
+    p += 16;
+  }
+#endif
+  for (; p < end; ++p) {
+    if (*p == a || *p == b)
+      return p;
+  }
+  return end;
+}
+
+/*
+  Return a pointer to the first byte in [p, end) that is c,
+  or end if there is none.
+ */
+inline const char* find_first(const char* p, const char* end, char c) {
+  return find_first_of2(p, end, c, c);
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef StringRef_h
+#define StringRef_h
+
+#include <cstddef>
+#include <cstring>
+#include <ostream>
+#include <string>
+
+/*
+  A reference to characters owned by something else: a pointer
+  and a length, cheap to copy. The characters must outlive it.
+ */
+struct string_ref {
+  const char* ptr;
+  std::size_t len;
+
+  string_ref () : ptr {nullptr}, len {0} {}
+  string_ref (const char* d, std::size_t n) : ptr {d}, len {n} {}
+  string_ref (const char* s) : ptr {s}, len {std::strlen(s)} {}
+  string_ref (const std::string& s) : ptr {s.data()}, len {s.size()} {}
+
+  const char* data() const { return ptr; }
+  std::size_t size() const { return len; }
+  bool empty() const { return len == 0; }
+  const char* begin() const { return ptr; }
+  const char* end() const { return ptr + len; }
+  std::string to_string() const { return std::string(ptr, len); }
+};
+
+inline bool operator== (const string_ref& a, const string_ref& b) {
+  return a.len == b.len && (a.len == 0 || std::memcmp(a.ptr, b.ptr, a.len) == 0);
+}
+
+inline bool operator!= (const string_ref& a, const string_ref& b) {
+  return !(a == b);
+}
+
+inline std::ostream& operator<< (std::ostream& os, const string_ref& s) {
+  return os.write(s.data(), static_cast<std::streamsize>(s.size()));
+}
+
+#endif
@@ -1,6 +1,7 @@
 #include "TableCache.h"
 
 #include <cassert>
+#include <chrono>
 #include <string>
 #include <unordered_map>
 
@@ -21,6 +22,8 @@ using web::http::uri;
 
 using cache_t = std::unordered_map<string,cloud_table>;
 
+constexpr std::chrono::seconds TableCache::missing_ttl;
+
 cloud_table TableCache::lookup_table(const string& table_name) {
   assert (client.base_uri ().path() != "");
   scoped_critical_section_t lock {resplock};
@@ -38,5 +41,42 @@ bool TableCache::delete_entry(const string& table_name) {
   scoped_critical_section_t lock {resplock};
 
   cache_t::size_type count {table_cache.erase(table_name)};
+  existing.erase(table_name);
   return count == 1;
 }
+
+/*
+  Return whether table_name exists, asking Azure Storage only if
+  there is no remembered answer. Throws storage_exception if it
+  has to ask and cannot.
+ */
+bool TableCache::exists(const string& table_name) {
+  const auto now = std::chrono::steady_clock::now();
+  {
+    scoped_critical_section_t lock {resplock};
+    if (existing.find(table_name) != existing.end())
+      return true;
+    auto m (missing.find(table_name));
+    if (m != missing.end() && now < m->second)
+      return false;
+  }
+
+  const bool found {lookup_table(table_name).exists()};
+  scoped_critical_section_t lock {resplock};
+  if (found) {
+    existing.insert(table_name);
+    missing.erase(table_name);
+  }
+  else
+    missing[table_name] = now + missing_ttl;
+  return found;
+}
+
+/*
+  Note that table_name has just been created
+ */
+void TableCache::created(const string& table_name) {
+  scoped_critical_section_t lock {resplock};
+  missing.erase(table_name);
+  existing.insert(table_name);
+}
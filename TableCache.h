@@ -1,25 +1,44 @@
 #ifndef TableCache_h
 #define TableCache_h
 
+#include <chrono>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <pplx/pplxtasks.h>
 
 #include <was/storage_account.h>
 #include <was/table.h>
 
+/*
+  Table references by name, opened once with the account key.
+
+  exists() remembers the answer, so most checks cost no call to
+  Azure Storage: a table seen to exist is taken to exist until
+  delete_entry(), and one seen missing is taken to be missing for
+  missing_ttl or until created(). Tables created or deleted
+  through another process are noticed within missing_ttl, or
+  when a storage operation on them fails.
+ */
 class TableCache {
+public:
+  static constexpr std::chrono::seconds missing_ttl {5};
+
 private:
   azure::storage::cloud_storage_account account;
   azure::storage::cloud_table_client client;
   std::unordered_map<std::string,azure::storage::cloud_table> table_cache;
+  std::unordered_set<std::string> existing;
+  std::unordered_map<std::string,std::chrono::steady_clock::time_point> missing;  // Until when
   pplx::extensibility::critical_section_t resplock;
 public:
   TableCache () : 
     account {},
     client {},
     table_cache {},
+    existing {},
+    missing {},
     resplock {}
     {};
 
@@ -30,6 +49,8 @@ public:
 
   azure::storage::cloud_table lookup_table(const std::string& table_name);
   bool delete_entry(const std::string& table_name);
+  bool exists(const std::string& table_name);
+  void created(const std::string& table_name);
 };
 
 #endif
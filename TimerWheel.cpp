@@ -0,0 +1,102 @@
+#include "TimerWheel.h"
+
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::vector;
+
+constexpr unsigned TimerWheel::slot_bits;
+constexpr unsigned TimerWheel::slots;
+constexpr unsigned TimerWheel::levels;
+
+/*
+  Put a timer in the slot for its due tick, on the lowest wheel
+  whose span covers the distance from the current tick.
+
+  Must be called with resplock held.
+ */
+void TimerWheel::place(entry_t&& timer) {
+  std::uint64_t distance {timer.due > current ? timer.due - current : 0};
+  unsigned level {0};
+  while (level + 1 < levels && distance >= (std::uint64_t {1} << (slot_bits * (level + 1))))
+    ++level;
+
+  const std::uint64_t span {std::uint64_t {1} << (slot_bits * levels)};
+  std::uint64_t due {timer.due};
+  if (distance >= span)
+    due = current + span - 1;  // Parked; rescheduled when this slot cascades
+  else if (distance == 0)
+    due = current;
+
+  const unsigned slot {static_cast<unsigned>((due >> (slot_bits * level)) & (slots - 1))};
+  wheels[level][slot].push_back(std::move(timer));
+}
+
+/*
+  Move the timers of the current slot of a higher wheel down to
+  the wheels below it.
+
+  Must be called with resplock held.
+ */
+void TimerWheel::cascade(unsigned level) {
+  const unsigned slot {static_cast<unsigned>((current >> (slot_bits * level)) & (slots - 1))};
+  slot_t timers {};
+  timers.swap(wheels[level][slot]);
+  for (auto& t : timers)
+    place(std::move(t));
+}
+
+/*
+  Schedule callback to be returned by the first advance() at
+  or after when. Times in the past fire on the next tick.
+ */
+void TimerWheel::schedule(std::chrono::steady_clock::time_point when, callback_t callback) {
+  scoped_critical_section_t lock {resplock};
+  std::uint64_t due {current + 1};
+  if (when > start) {
+    const auto ticks = std::chrono::duration_cast<std::chrono::milliseconds>(when - start).count() / tick.count();
+    // Round up, so a timer never fires early
+    const std::uint64_t when_tick {static_cast<std::uint64_t>(ticks) + 1};
+    if (when_tick > due)
+      due = when_tick;
+  }
+  place(entry_t {due, std::move(callback)});
+}
+
+/*
+  Process every tick up to now and return the callbacks of the
+  timers that came due, in the order they were due.
+ */
+vector<TimerWheel::callback_t> TimerWheel::advance(std::chrono::steady_clock::time_point now) {
+  vector<callback_t> due {};
+  scoped_critical_section_t lock {resplock};
+  const std::uint64_t target {static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count() / tick.count())};
+
+  while (current < target) {
+    ++current;
+    // When a wheel wraps, refill it from the wheel above
+    for (unsigned level = 1; level < levels; ++level) {
+      if ((current & ((std::uint64_t {1} << (slot_bits * level)) - 1)) != 0)
+        break;
+      cascade(level);
+    }
+
+    slot_t& fired = wheels[0][current & (slots - 1)];
+    slot_t later {};
+    for (auto& t : fired) {
+      if (t.due <= current)
+        due.push_back(std::move(t.callback));
+      else
+        later.push_back(std::move(t));  // Parked far-future timer
+    }
+    fired.clear();
+    for (auto& t : later)
+      place(std::move(t));
+  }
+  return due;
+}
@@ -0,0 +1,65 @@
+#ifndef TimerWheel_h
+#define TimerWheel_h
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+/*
+  Hierarchical timer wheel.
+
+  Four wheels of 64 slots each hold timers due within 64, 64^2,
+  64^3 and 64^4 ticks. Scheduling a timer and firing it are O(1);
+  a timer is moved down a wheel at most three times on the way.
+  Timers further away than 64^4 ticks are held in the last slot
+  reachable and rescheduled from there.
+
+  The wheel does not run on its own: advance() is called
+  periodically, typically from a background thread, and returns
+  the callbacks of the timers that have come due, so they can be
+  run without holding the wheel's lock. Timers cannot be
+  cancelled; callbacks check whether they are still wanted.
+ */
+class TimerWheel {
+public:
+  using callback_t = std::function<void()>;
+
+private:
+  static constexpr unsigned slot_bits {6};
+  static constexpr unsigned slots {1u << slot_bits};
+  static constexpr unsigned levels {4};
+
+  struct entry_t {
+    std::uint64_t due;  // Tick at which to fire
+    callback_t callback;
+  };
+
+  using slot_t = std::vector<entry_t>;
+
+  std::array<std::array<slot_t,slots>,levels> wheels;
+  std::chrono::steady_clock::time_point start;
+  std::chrono::milliseconds tick;
+  std::uint64_t current;  // Ticks since start that have been processed
+  pplx::extensibility::critical_section_t resplock;
+
+  void place(entry_t&& timer);
+  void cascade(unsigned level);
+
+public:
+  explicit TimerWheel (std::chrono::milliseconds tick) :
+    wheels {},
+    start {std::chrono::steady_clock::now()},
+    tick {tick},
+    current {0},
+    resplock {}
+    {};
+
+  void schedule(std::chrono::steady_clock::time_point when, callback_t callback);
+  std::vector<callback_t> advance(std::chrono::steady_clock::time_point now);
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include "TokenCache.h"
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using std::string;
+
+using std::chrono::steady_clock;
+
+/*
+  Key for a token, with the table and partition prefixed by their
+  lengths so no two distinct entities share a key
+ */
+string TokenCache::key(const string& table, const string& partition,
+                       const string& row, std::uint8_t permissions) {
+  return std::to_string(table.size()) + ':' + table +
+    std::to_string(partition.size()) + ':' + partition +
+    std::to_string(permissions) + ':' + row;
+}
+
+/*
+  True if e has no more than min_life of its lifetime left at now,
+  so it will not be handed out again
+ */
+bool TokenCache::spent(const entry_t& e, steady_clock::time_point now) const {
+  const auto lifetime = e.expiry - e.issued;
+  const auto remaining = e.expiry - now;
+  // remaining / lifetime, without converting to floating point durations
+  return static_cast<double>(remaining.count()) / lifetime.count() <= min_life;
+}
+
+/*
+  Copy a cached token for the entity and permissions into token.
+  Returns false if there is none with min_life of its lifetime left,
+  dropping the one there is.
+
+  refresh is set if the token is due for replacement and this
+  caller should issue the replacement and store() it, or release()
+  the claim if issuing fails. Only one caller at a time is asked.
+ */
+bool TokenCache::lookup(const string& table, const string& partition,
+                        const string& row, std::uint8_t permissions,
+                        string& token, bool& refresh) {
+  const string k {key(table, partition, row, permissions)};
+  const auto now = steady_clock::now();
+  bool usable {false};
+  refresh = false;
+  const bool found {tokens.update(k, [&] (entry_t& e) {
+      const auto lifetime = e.expiry - e.issued;
+      const auto remaining = e.expiry - now;
+      // remaining / lifetime, without converting to floating point durations
+      const double left {static_cast<double>(remaining.count()) / lifetime.count()};
+      if (left <= min_life)
+        return;
+      usable = true;
+      token = e.token;
+      if (left <= min_life + refresh_ahead && !e.refreshing) {
+        e.refreshing = true;
+        refresh = true;
+      }
+    })};
+  if (found && !usable) {
+    // Only drop a spent token, not a replacement stored since
+    tokens.erase_if(k, [this, now] (const entry_t& e) { return spent(e, now); });
+  }
+  return usable;
+}
+
+/*
+  Cache a newly issued token, replacing any earlier one for the same
+  entity and permissions. issued must be taken no later than the
+  token's own expiry time was set.
+ */
+void TokenCache::store(const string& table, const string& partition,
+                       const string& row, std::uint8_t permissions,
+                       const string& token,
+                       steady_clock::time_point issued,
+                       steady_clock::duration lifetime) {
+  tokens.assign(key(table, partition, row, permissions),
+                entry_t {token, issued, issued + lifetime, false});
+  if (++stores % prune_interval == 0)
+    prune();
+}
+
+/*
+  Give up a claim to refresh a token made by lookup()
+ */
+void TokenCache::release(const string& table, const string& partition,
+                         const string& row, std::uint8_t permissions) {
+  tokens.update(key(table, partition, row, permissions), [] (entry_t& e) {
+      e.refreshing = false;
+    });
+}
+
+/*
+  Drop every token that will not be handed out again
+ */
+void TokenCache::prune() {
+  const auto now = steady_clock::now();
+  std::vector<string> spent_keys {};
+  tokens.for_each([this, now, &spent_keys] (const string& k, entry_t& e) {
+      if (spent(e, now))
+        spent_keys.push_back(k);
+    });
+  for (const auto& k : spent_keys)
+    tokens.erase_if(k, [this, now] (const entry_t& e) { return spent(e, now); });
+}
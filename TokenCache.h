@@ -0,0 +1,68 @@
+#ifndef TokenCache_h
+#define TokenCache_h
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "ShardedMap.h"
+
+/*
+  Shared access signature tokens already issued, keyed by the
+  table, entity and permissions they grant.
+
+  A token is handed out again while at least min_life of its
+  lifetime remains. Once it is within refresh_ahead of that point,
+  lookup() asks one caller to issue a replacement, while the
+  others keep getting the cached token until the replacement is
+  stored.
+
+  A token past min_life is dropped when it is next looked up, and
+  every prune_interval stores the whole cache is swept for tokens
+  that are never looked up again.
+ */
+class TokenCache {
+private:
+  struct entry_t {
+    std::string token;
+    std::chrono::steady_clock::time_point issued;
+    std::chrono::steady_clock::time_point expiry;
+    bool refreshing;  // A caller is issuing a replacement
+  };
+
+  static constexpr unsigned prune_interval {1024};
+
+  ShardedMap<entry_t> tokens;
+  double min_life;
+  double refresh_ahead;
+  std::atomic<unsigned> stores;
+
+  static std::string key(const std::string& table, const std::string& partition,
+                         const std::string& row, std::uint8_t permissions);
+  bool spent(const entry_t& e, std::chrono::steady_clock::time_point now) const;
+
+public:
+  explicit TokenCache (double min_life = 0.5, double refresh_ahead = 0.1) :
+    tokens {},
+    min_life {min_life},
+    refresh_ahead {refresh_ahead},
+    stores {0}
+    {};
+
+  void set_min_life(double fraction) { min_life = fraction; }
+
+  bool lookup(const std::string& table, const std::string& partition,
+              const std::string& row, std::uint8_t permissions,
+              std::string& token, bool& refresh);
+  void store(const std::string& table, const std::string& partition,
+             const std::string& row, std::uint8_t permissions,
+             const std::string& token,
+             std::chrono::steady_clock::time_point issued,
+             std::chrono::steady_clock::duration lifetime);
+  void release(const std::string& table, const std::string& partition,
+               const std::string& row, std::uint8_t permissions);
+  void prune();
+};
+
+#endif
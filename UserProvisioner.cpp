@@ -0,0 +1,206 @@
+#include "UserProvisioner.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+#include <cpprest/json.h>
+
+#include <pplx/pplxtasks.h>
+
+#include <was/common.h>
+#include <was/table.h>
+
+using azure::storage::cloud_table;
+using azure::storage::entity_property;
+using azure::storage::storage_exception;
+using azure::storage::table_batch_operation;
+using azure::storage::table_entity;
+using azure::storage::table_operation;
+using azure::storage::table_result;
+
+using std::make_pair;
+using std::pair;
+using std::size_t;
+using std::string;
+using std::vector;
+
+using web::http::status_codes;
+
+using web::json::value;
+
+constexpr size_t UserProvisioner::batch_limit;
+constexpr size_t UserProvisioner::chunk_size;
+
+namespace {
+  const string auth_table_userid_partition {"Userid"};
+  const string auth_table_password_prop {"Password"};
+  const string auth_table_partition_prop {"DataPartition"};
+  const string auth_table_row_prop {"DataRow"};
+  const vector<string> data_table_props {"Friends", "Status", "Updates"};
+
+  bool succeeded(int status) {
+    return status >= 200 && status < 300;
+  }
+
+  /*
+    Write one entity, returning the HTTP status of the write
+   */
+  int write_entity(cloud_table& table, const table_entity& entity, bool replace) {
+    try {
+      table_operation operation {replace ?
+          table_operation::insert_or_replace_entity(entity) :
+          table_operation::insert_entity(entity)};
+      return table.execute(operation).http_status_code();
+    }
+    catch (const storage_exception& e) {
+      return e.result().http_status_code();
+    }
+  }
+}
+
+/*
+  Write entities to table, returning the HTTP status of each write.
+  With replace, existing entities are replaced; otherwise they are
+  left alone and reported as Conflict.
+ */
+vector<int> UserProvisioner::write_entities(cloud_table& table,
+                                            const vector<table_entity>& entities,
+                                            bool replace) {
+  // Batches may hold only one partition
+  std::map<string,vector<size_t>> partitions {};
+  for (size_t i = 0; i < entities.size(); ++i)
+    partitions[entities[i].partition_key()].push_back(i);
+
+  vector<vector<size_t>> batches {};
+  for (const auto& p : partitions) {
+    for (size_t start = 0; start < p.second.size(); start += batch_limit) {
+      const size_t end {std::min(start + batch_limit, p.second.size())};
+      batches.push_back(vector<size_t> {p.second.begin() + start, p.second.begin() + end});
+    }
+  }
+
+  // Each entity's status is written by the one worker holding its batch
+  vector<int> statuses (entities.size(), 0);
+  std::atomic<size_t> next_batch {0};
+  vector<pplx::task<void>> workers {};
+  const size_t worker_count {std::min(parallelism, batches.size())};
+  for (size_t w = 0; w < worker_count; ++w) {
+    workers.push_back(pplx::create_task([&] () {
+          for (size_t b = next_batch++; b < batches.size(); b = next_batch++) {
+            const vector<size_t>& batch = batches[b];
+            table_batch_operation operation {};
+            for (size_t i : batch) {
+              if (replace)
+                operation.insert_or_replace_entity(entities[i]);
+              else
+                operation.insert_entity(entities[i]);
+            }
+            try {
+              vector<table_result> results {table.execute_batch(operation)};
+              for (size_t k = 0; k < batch.size(); ++k)
+                statuses[batch[k]] = k < results.size() ? results[k].http_status_code() : status_codes::NoContent;
+            }
+            catch (const storage_exception&) {
+              // Find out which entities were at fault
+              for (size_t i : batch)
+                statuses[i] = write_entity(table, entities[i], replace);
+            }
+          }
+        }));
+  }
+  pplx::when_all(workers.begin(), workers.end()).wait();
+  return statuses;
+}
+
+/*
+  Write the pending users
+ */
+void UserProvisioner::flush() {
+  if (pending.empty())
+    return;
+
+  vector<table_entity> data_entities {};
+  for (const auto& user : pending) {
+    table_entity entity {salt.salt(user.partition, user.row), user.row};
+    for (const auto& prop : data_table_props)
+      entity.properties()[prop] = entity_property {string {}};
+    data_entities.push_back(entity);
+  }
+  vector<int> data_statuses {write_entities(data_table, data_entities, false)};
+
+  vector<const user_record_t*> ready {};
+  vector<table_entity> auth_entities {};
+  for (size_t i = 0; i < pending.size(); ++i) {
+    const user_record_t& user = pending[i];
+    if (!succeeded(data_statuses[i]) && data_statuses[i] != status_codes::Conflict) {
+      failures.push_back(failure_t {user.userid, data_table.name(), data_statuses[i], "DataTable entity not written"});
+      continue;
+    }
+    table_entity entity {auth_table_userid_partition, user.userid};
+    table_entity::properties_type& properties = entity.properties();
+    properties[auth_table_password_prop] = entity_property {user.password};
+    properties[auth_table_partition_prop] = entity_property {user.partition};
+    properties[auth_table_row_prop] = entity_property {user.row};
+    auth_entities.push_back(entity);
+    ready.push_back(&user);
+  }
+  vector<int> auth_statuses {write_entities(auth_table, auth_entities, true)};
+
+  for (size_t i = 0; i < ready.size(); ++i) {
+    if (succeeded(auth_statuses[i])) {
+      ++provisioned;
+      on_provisioned(ready[i]->userid);
+    }
+    else {
+      failures.push_back(failure_t {ready[i]->userid, auth_table.name(), auth_statuses[i], "AuthTable entity not written"});
+    }
+  }
+  pending.clear();
+}
+
+/*
+  Queue a user for creation, writing a chunk once enough are queued
+ */
+void UserProvisioner::add(const user_record_t& user) {
+  ++received;
+  pending.push_back(user);
+  if (pending.size() >= chunk_size)
+    flush();
+}
+
+/*
+  Record input that does not describe a user
+ */
+void UserProvisioner::reject(const string& item, const string& error) {
+  ++received;
+  failures.push_back(failure_t {item, string {}, status_codes::BadRequest, error});
+}
+
+/*
+  Write any users still queued and return the report:
+    {"Received": <users and rejected items>,
+     "Provisioned": <users created>,
+     "Failures": [{"Item": ..., "Table": ..., "Status": ..., "Error": ...}, ...]}
+ */
+value UserProvisioner::finish() {
+  flush();
+  vector<value> failure_values {};
+  for (const auto& f : failures) {
+    failure_values.push_back(value::object(vector<pair<string,value>> {
+          make_pair("Item", value::string(f.item)),
+          make_pair("Table", value::string(f.table)),
+          make_pair("Status", value::number(f.status)),
+          make_pair("Error", value::string(f.error))}));
+  }
+  return value::object(vector<pair<string,value>> {
+      make_pair("Received", value::number(static_cast<std::uint64_t>(received))),
+      make_pair("Provisioned", value::number(static_cast<std::uint64_t>(provisioned))),
+      make_pair("Failures", value::array(failure_values))});
+}
@@ -0,0 +1,98 @@
+#ifndef UserProvisioner_h
+#define UserProvisioner_h
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <cpprest/json.h>
+
+#include <was/table.h>
+
+#include "PartitionSalt.h"
+
+/*
+  One user to create: their AuthTable entity and the key of their
+  DataTable entity
+ */
+struct user_record_t {
+  std::string userid;
+  std::string password;
+  std::string partition;
+  std::string row;
+};
+
+/*
+  Creates users in bulk.
+
+  Users are added one at a time and written a chunk at a time, so
+  a provisioning request of any length needs only a chunk's worth
+  of memory. For each chunk, the DataTable entities are written
+  first, then the AuthTable entities of the users whose DataTable
+  entity is in place, so a failure never leaves a user who can
+  sign on but has no entity.
+
+  Entities are written in batch transactions of up to 100
+  entities of one partition, at most parallelism batches at a
+  time. When a batch fails, its entities are written one by one,
+  so one bad row costs only itself.
+
+  An existing DataTable entity is left as it is; an existing
+  AuthTable entity is replaced, so provisioning a user again
+  resets their password. DataTable entities are written under
+  the stored partition salt gives them.
+ */
+class UserProvisioner {
+public:
+  // Most entities Azure accepts in one batch
+  static constexpr std::size_t batch_limit {100};
+  // Users buffered before they are written
+  static constexpr std::size_t chunk_size {1000};
+
+private:
+  struct failure_t {
+    std::string item;   // Userid, or line number for unparseable input
+    std::string table;  // Table whose write failed, empty for bad input
+    int status;
+    std::string error;
+  };
+
+  azure::storage::cloud_table auth_table;
+  azure::storage::cloud_table data_table;
+  PartitionSalt salt;
+  std::size_t parallelism;
+  std::function<void(const std::string&)> on_provisioned;
+  std::vector<user_record_t> pending;
+  std::vector<failure_t> failures;
+  std::size_t received;
+  std::size_t provisioned;
+
+  std::vector<int> write_entities(azure::storage::cloud_table& table,
+                                  const std::vector<azure::storage::table_entity>& entities,
+                                  bool replace);
+  void flush();
+
+public:
+  UserProvisioner (const azure::storage::cloud_table& auth_table,
+                   const azure::storage::cloud_table& data_table,
+                   const PartitionSalt& salt,
+                   std::size_t parallelism,
+                   std::function<void(const std::string&)> on_provisioned) :
+    auth_table {auth_table},
+    data_table {data_table},
+    salt {salt},
+    parallelism {parallelism > 0 ? parallelism : 1},
+    on_provisioned {on_provisioned},
+    pending {},
+    failures {},
+    received {0},
+    provisioned {0}
+    {};
+
+  void add(const user_record_t& user);
+  void reject(const std::string& item, const std::string& error);
+  web::json::value finish();
+};
+
+#endif
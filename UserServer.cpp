@@ -1,20 +1,44 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
-#include <tuple>
-#include <map>
 
 #include <cpprest/http_listener.h>
 #include <cpprest/json.h>
 
+#include <pplx/pplxtasks.h>
+
 #include <was/common.h>
 #include <was/table.h>
 
 #include "make_unique.h"
 
 #include "ClientUtils.h"
-
+#include "InternalRpc.h"
+#include "JsonBody.h"
+#include "LocalTransport.h"
+#include "RemoteSessionStore.h"
+#include "SessionStore.h"
+#include "SessionTicket.h"
+#include "ShardRouter.h"
+#include "ShardedMap.h"
+#include "TimerWheel.h"
+#include "WorkerLauncher.h"
+
+
+#ifdef COLOCATED
+namespace user_server {
+#endif
 
 using azure::storage::storage_exception;
 using azure::storage::cloud_table;
@@ -36,10 +60,6 @@ using std::pair;
 using std::string;
 using std::unordered_map;
 using std::vector;
-using std::map;
-using std::tuple;
-using std::make_tuple;
-using std::get;
 
 using web::http::http_headers;
 using web::http::http_request;
@@ -65,28 +85,269 @@ const string auth_table_password_prop {"Password"};
 const string auth_table_partition_prop {"DataPartition"};
 const string auth_table_row_prop {"DataRow"};
 const string token_prop {"token"};
+const string entity_prop {"Entity"};
 const string friend_prop {"Friends"};
 const string status_prop {"Status"};
 
 const string data_addr {"http://localhost:34568"};
 const string data_table_name {"DataTable"};
 
+/*
+  BasicServer shards owning each DataTable entity. A single shard
+  at data_addr unless --data-shards or SetDataShardsAdmin sets
+  more.
+ */
+ShardRouter data_shards {data_addr};
+
 const string push_addr {"http://localhost:34574"};
 const string push_status_op {"PushStatus"};
 
 const string sign_on_op {"SignOn"};
 const string sign_off_op {"SignOff"};
+const string ticket_prop {"Ticket"};
+const string ticket_scheme {"Ticket "};  // Authorization: Ticket <ticket>
 const string add_friend_op {"AddFriend"};
 const string unfriend_op {"UnFriend"};
 const string update_status_op {"UpdateStatus"};
 const string read_friend_list_op {"ReadFriendList"};
+const string friends_form_param {"form"};  // ReadFriendList?form=array
+const string friends_array_form {"array"};
+const string country_prop {"Country"};
+const string name_prop {"Name"};
+const string set_data_shards_admin {"SetDataShardsAdmin"};
 
 const string read_entity_op {"ReadEntityAuth"};
 const string update_entity_op {"UpdateEntityAuth"};
 
 const string get_update_data_op {"GetUpdateData"};
+const string refresh_token_op {"RefreshToken"};
+
+// Lifetime of the tokens AuthServer issues, if a token does not say
+constexpr std::chrono::hours token_lifetime {24};
+
+// How long a session's cached copy of its entity is trusted
+constexpr std::chrono::seconds entity_ttl {30};
+
+// Sessions with no operations for this long are signed off
+constexpr std::chrono::minutes idle_timeout {30};
+
+// Tokens are refreshed this long before they expire
+constexpr std::chrono::minutes refresh_margin {10};
+
+// Wait before trying a failed refresh again
+constexpr std::chrono::minutes refresh_retry {1};
+
+// How long a session read from --session-store is reused before it is read again
+constexpr std::chrono::milliseconds def_session_cache_ttl {1000};
 
-map<string,tuple<string,string,string>> signed_on_users {};
+/*
+  Sessions of signed-on users: in this process, or in the
+  SessionServer given by --session-store, which lets several
+  UserServers share them
+ */
+std::unique_ptr<SessionStore> signed_on_users {std::make_unique<LocalSessionStore>()};
+
+/*
+  Signs the tickets SignOn returns. UserServers given the same
+  --ticket-key-file accept each other's tickets. A ticket lives
+  no longer than the token it carries.
+ */
+TicketSigner tickets {token_lifetime};
+
+/*
+  When each user last made a request with a ticket, which skips
+  the session lookup that counts as activity. The idle check
+  takes the later of the two.
+ */
+ShardedMap<std::chrono::steady_clock::time_point> ticket_activity {};
+
+/*
+  Refuse the tickets issued to a user so far, once their session
+  has ended
+ */
+void revoke_tickets (const string& userid) {
+  tickets.revoke(userid);
+  ticket_activity.erase(userid);
+}
+
+/*
+  First sign-on generation of this process: a random multiple of
+  2^32, so UserServers sharing a SessionServer do not hand out the
+  same generations.
+ */
+std::uint64_t initial_generation () {
+  std::random_device rd {};
+  return (static_cast<std::uint64_t>(rd()) << 32) | 1;
+}
+
+/*
+  Idle checks and token refreshes for every session. Each timer
+  carries the generation of the sign-on it was set for and does
+  nothing if that session has since ended.
+ */
+TimerWheel session_timers {std::chrono::seconds {1}};
+std::atomic<std::uint64_t> next_generation {initial_generation()};
+
+/*
+  Sessions whose tokens came due for refresh on the current tick,
+  refreshed together once the tick's timers have run
+ */
+vector<pair<string,std::uint64_t>> refresh_due {};
+pplx::extensibility::critical_section_t refresh_lock {};
+
+/*
+  Return the URI of a DataTable operation on a signed-on user's entity,
+  authorized by the session's token
+ */
+string entity_uri (const string& op, const session_t& session) {
+  return data_shards.route(data_table_name, session.partition, session.row) + "/" + op + "/" + data_table_name + "/" + session.token + "/" + session.partition + "/" + session.row;
+}
+
+/*
+  Return the steady clock time at which the system clock will read t
+ */
+std::chrono::steady_clock::time_point steady_time (std::chrono::system_clock::time_point t) {
+  return std::chrono::steady_clock::now() +
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>(t - std::chrono::system_clock::now());
+}
+
+/*
+  Sign off the session of sign-on generation if it has been idle
+  for idle_timeout by when; otherwise check again when it might be.
+ */
+void schedule_idle_check (const string& userid, std::uint64_t generation,
+                          std::chrono::steady_clock::time_point when) {
+  session_timers.schedule(when, [userid, generation] () {
+      session_t session;
+      if (!signed_on_users->peek(userid, session) || session.generation != generation)
+        return;
+      auto last_activity = session.last_activity;
+      std::chrono::steady_clock::time_point last_ticket;
+      if (ticket_activity.find(userid, last_ticket) && last_ticket > last_activity)
+        last_activity = last_ticket;
+      const auto idle_until = last_activity + idle_timeout;
+      if (idle_until <= std::chrono::steady_clock::now()) {
+        if (signed_on_users->expire(userid, generation)) {
+          revoke_tickets(userid);
+          cout << "Signed off idle user " << userid << endl;
+        }
+      }
+      else {
+        schedule_idle_check(userid, generation, idle_until);
+      }
+    });
+}
+
+/*
+  Queue the token of sign-on generation for refresh at when
+ */
+void schedule_refresh (const string& userid, std::uint64_t generation,
+                       std::chrono::steady_clock::time_point when) {
+  session_timers.schedule(when, [userid, generation] () {
+      pplx::extensibility::scoped_critical_section_t lock {refresh_lock};
+      refresh_due.push_back(make_pair(userid, generation));
+    });
+}
+
+/*
+  Return the time a token expiring at expiry should be refreshed
+ */
+std::chrono::steady_clock::time_point refresh_time (std::chrono::system_clock::time_point expiry) {
+  return steady_time(expiry - refresh_margin);
+}
+
+/*
+  Replace the tokens of the sessions queued by schedule_refresh(),
+  asking AuthServer for all of them at once.
+
+  A failed refresh is retried after refresh_retry while the old
+  token has that long to run; after that the session is ended,
+  as its token no longer works.
+ */
+void refresh_tokens () {
+  vector<pair<string,std::uint64_t>> due {};
+  {
+    pplx::extensibility::scoped_critical_section_t lock {refresh_lock};
+    due.swap(refresh_due);
+  }
+  if (due.empty())
+    return;
+
+  vector<pplx::task<void>> refreshes {};
+  for (const auto& d : due) {
+    const string userid {d.first};
+    const std::uint64_t generation {d.second};
+    session_t session;
+    if (!signed_on_users->peek(userid, session) || session.generation != generation)
+      continue;
+
+    refreshes.push_back(pplx::create_task([userid, generation, session] () {
+          const auto now = std::chrono::system_clock::now();
+          try {
+            pair<status_code,value> refresh_result {
+              do_request(methods::GET, auth_addr + "/" + refresh_token_op + "/" + userid,
+                         build_json_value(token_prop, session.token))};
+            if (refresh_result.first == status_codes::OK) {
+              string token {get_json_object_prop(refresh_result.second, token_prop)};
+              auto expiry = sas_token_expiry(token);
+              if (expiry == std::chrono::system_clock::time_point {})
+                expiry = now + token_lifetime;
+              if (signed_on_users->set_token(userid, generation, token, expiry))
+                schedule_refresh(userid, generation, refresh_time(expiry));
+              return;
+            }
+            cout << "Token refresh for " << userid << " failed: " << refresh_result.first << endl;
+          }
+          catch (const std::exception& e) {
+            cout << "Token refresh for " << userid << " failed: " << e.what() << endl;
+          }
+
+          if (session.token_expiry - now > refresh_retry)
+            schedule_refresh(userid, generation, std::chrono::steady_clock::now() + refresh_retry);
+          else if (signed_on_users->expire(userid, generation))
+            revoke_tickets(userid);
+        }));
+  }
+  pplx::when_all(refreshes.begin(), refreshes.end()).wait();
+}
+
+/*
+  Copy the ticket of a request sent with "Authorization: Ticket
+  <ticket>" into ticket. Returns false if it has no such header.
+ */
+bool ticket_header (const http_request& message, string& ticket) {
+  auto auth (message.headers().find(web::http::header_names::authorization));
+  if (auth == message.headers().end() ||
+      auth->second.compare(0, ticket_scheme.size(), ticket_scheme) != 0)
+    return false;
+  ticket = auth->second.substr(ticket_scheme.size());
+  return true;
+}
+
+/*
+  Copy the session of a signed-on user into session.
+
+  A request with a ticket is decided by the ticket alone, with no
+  lookup: it must be valid and for userid, and counts as activity
+  for the idle check. Other requests are
+  looked up as SessionStore::lookup() does, treating a session
+  whose token has expired as signed off.
+ */
+bool find_session (const http_request& message, const string& userid, session_t& session) {
+  string ticket_text;
+  if (ticket_header(message, ticket_text)) {
+    ticket_t ticket;
+    if (! tickets.check(ticket_text, ticket) || ticket.userid != userid)
+      return false;
+    ticket_activity.assign(userid, std::chrono::steady_clock::now());
+    session = session_t {ticket.token, ticket.partition, ticket.row, ticket.expiry,
+                         std::chrono::steady_clock::now(), value {}, {}, 0,
+                         pplx::task_from_result()};
+    return true;
+  }
+  return signed_on_users->lookup(userid, session) &&
+    session.token_expiry > std::chrono::system_clock::now();
+}
 
 /*
   Utility to create JSON object value from vector of properties
@@ -101,45 +362,49 @@ value build_json_object (const vector<pair<string,string>>& properties) {
 
 
 /*
-  Given an HTTP message with a JSON body, return the JSON
-  body as an unordered map of strings to strings.
+  Return a signed-on user's entity.
 
-  Note that all types of JSON values are returned as strings.
-  Use C++ conversion utilities to convert to numbers or dates
-  as necessary.
+  The copy cached in the session is used while it is younger than
+  entity_ttl; otherwise the entity is read from BasicServer and,
+  unless cache is false, the cache refreshed. Reads running
+  alongside a write to the entity pass false, so the copy they read
+  cannot replace the one the write updates.
  */
-unordered_map<string,string> get_json_body(http_request message) {  
-  unordered_map<string,string> results {};
-  const http_headers& headers {message.headers()};
-  auto content_type (headers.find("Content-Type"));
-  if (content_type == headers.end() ||
-      content_type->second != "application/json")
-    return results;
-
-  value json{};
-  message.extract_json(true)
-    .then([&json](value v) -> bool
-          {
-            json = v;
-            return true;
-          })
-    .wait();
-
-  if (json.is_object()) {
-    for (const auto& v : json.as_object()) {
-      if (v.second.is_string()) {
-        results[v.first] = v.second.as_string();
-      }
-      else {
-        results[v.first] = v.second.serialize();
-      }
-    }
-  }
-  return results;
+pair<status_code,value> read_entity (const string& userid, const session_t& session, bool cache = true) {
+  if (session.entity.is_object() &&
+      std::chrono::steady_clock::now() - session.entity_fetched < entity_ttl)
+    return make_pair(status_codes::OK, session.entity);
+
+  pair<status_code,value> read_result {do_retrying_request(methods::GET, entity_uri(read_entity_op, session))};
+  if (cache && read_result.first == status_codes::OK)
+    signed_on_users->cache_entity(userid, read_result.second);
+  return read_result;
+}
+
+/*
+  Merge properties into a signed-on user's entity, writing them
+  through to the session's cached copy. If the write fails the
+  cached copy is dropped, as the entity's state is then unknown.
+ */
+status_code update_entity (const string& userid, const session_t& session,
+                           const vector<pair<string,string>>& props) {
+  pair<status_code,value> update_result {do_retrying_request(methods::PUT, entity_uri(update_entity_op, session),
+                                                             build_json_object(props))};
+  if (update_result.first == status_codes::OK)
+    signed_on_users->merge_entity(userid, props);
+  else
+    signed_on_users->drop_entity(userid);
+  return update_result.first;
 }
 
 /*
   Top-level routine for processing all HTTP GET requests.
+
+  ReadFriendList/<userid> answers {"Friends": "<text form>"}, the
+  "country;name|..." form clients have always seen, whichever form
+  the list is stored in. That form cannot hold a country or name
+  containing ';' or '|', so ReadFriendList/<userid>?form=array
+  answers {"Friends": [{"Country": ..., "Name": ...}, ...]} instead.
  */
 void handle_get(http_request message) { 
   string path {uri::decode(message.relative_uri().path())};
@@ -153,24 +418,26 @@ void handle_get(http_request message) {
   //read friend list
   if (paths[0] == read_friend_list_op){
     string user_name {paths[1]};
-    string user_token;
-    string user_part;
-    string user_row;
-    bool signed_on {false};
-    map<string,tuple<string,string,string>>::iterator it {signed_on_users.find(user_name)};
-    if(it != signed_on_users.end()){
-      signed_on = true;
-      for(auto v : signed_on_users){
-        if(v.first == user_name){
-          user_token = get<0>(v.second);
-          user_part = get<1>(v.second);
-          user_row = get<2>(v.second);
-        }
+    session_t session;
+    if(find_session(message, user_name, session)){
+      pair<status_code,value> read_result {read_entity(user_name, session)};
+      const friends_list_t friends {get_friends_prop(read_result.second, friend_prop)};
+      auto query = uri::split_query(message.relative_uri().query());
+      auto form = query.find(friends_form_param);
+      if (form != query.end() && form->second == friends_array_form) {
+        vector<value> friend_objects {};
+        friend_objects.reserve(friends.size());
+        for (const auto& f : friends)
+          friend_objects.push_back(value::object(vector<pair<string,value>>{make_pair(country_prop, value::string(f.first)),
+                                                                            make_pair(name_prop, value::string(f.second))}));
+        message.reply(status_codes::OK, value::object(vector<pair<string,value>>{make_pair(friend_prop, value::array(friend_objects))}));
+        return;
       }
-    }
-    if(signed_on){
-      pair<status_code,value> read_result = do_request(methods::GET, data_addr + "/" + read_entity_op + "/" + data_table_name + "/" + user_token + "/" + user_part + "/" + user_row );
-      string friend_list = get_json_object_prop(read_result.second, friend_prop);
+      if (form != query.end()) {
+        message.reply(status_codes::BadRequest);
+        return;
+      }
+      string friend_list {friends_list_to_string(friends)};
       cout << friend_list << endl;
       message.reply(status_codes::OK, value::object(vector<pair<string,value>>{make_pair(friend_prop, value::string(friend_list))}));
     }
@@ -193,6 +460,17 @@ void handle_post(http_request message) {
     message.reply(status_codes::BadRequest);
     return;
   }
+  //SetDataShardsAdmin/<count>: send DataTable requests to count shards from now on
+  if (paths.size() == 2 && paths[0] == set_data_shards_admin) {
+    try {
+      data_shards.set_shards(shard_addrs(data_addr, paths[1]));
+      message.reply(status_codes::OK);
+    }
+    catch (const std::invalid_argument&) {
+      message.reply(status_codes::BadRequest);
+    }
+    return;
+  }
   //get json crap
   unordered_map<string,string> json_body {get_json_body (message)};
   string command;
@@ -207,7 +485,7 @@ void handle_post(http_request message) {
     }
     cout << "password provided is: " << user_pass << endl;
     command = auth_addr + "/" + paths[1];
-    pair<status_code,value> token_request_result = do_request(methods::GET,  auth_addr + "/" + get_update_data_op + "/" + user_name, value::object(vector<pair<string,value>>{make_pair(auth_table_password_prop, value::string(user_pass))}));
+    pair<status_code,value> token_request_result = do_retrying_request(methods::GET,  auth_addr + "/" + get_update_data_op + "/" + user_name, value::object(vector<pair<string,value>>{make_pair(auth_table_password_prop, value::string(user_pass))}));
     if (token_request_result.first == status_codes::OK){//since we're able to get a token we now check data table for such user
       unordered_map <string,string> update_data {unpack_json_object(token_request_result.second)};
       string user_token;
@@ -225,18 +503,32 @@ void handle_post(http_request message) {
         }
       }
       cout << "authentication success!! token is: " << user_token << endl;
-      pair<status_code,value> read_result = do_request(methods::GET, data_addr + "/" + read_entity_op + "/" + data_table_name + "/" + user_token + "/" + user_part + "/" + user_row);
-      if(read_result.first == status_codes::OK){
-        bool already_signed_in {false};
-        map<string,tuple<string,string,string>>::iterator it {signed_on_users.find(user_name)};
-        if(it != signed_on_users.end()){
+      auto token_expiry = sas_token_expiry(user_token);
+      if (token_expiry == std::chrono::system_clock::time_point {})
+        token_expiry = std::chrono::system_clock::now() + token_lifetime;
+      session_t session {user_token, user_part, user_row,
+          token_expiry, {}, value {}, {}, next_generation++};
+      // AuthServer only answers if the entity exists, and sends it with the token
+      value entity {get_json_object_prop_val(token_request_result.second, entity_prop)};
+      if(entity.is_object()){
+        session.entity = entity;
+        session.entity_fetched = std::chrono::steady_clock::now();
+        sign_on_result_t signed_on {signed_on_users->sign_on(user_name, session)};
+        if(signed_on == sign_on_result_t::unavailable){
+          cout << "Session store unavailable" << endl;
+          message.reply(status_codes::ServiceUnavailable);
+          return;
+        }
+        else if(signed_on == sign_on_result_t::already_signed_on){
           cout << "User already signed in" << endl;
-          already_signed_in = true;
         }
-        if(!already_signed_in){
-          signed_on_users.insert(pair<string,tuple<string,string,string>>(user_name, make_tuple(user_token, user_part, user_row)));
+        else{
+          schedule_idle_check(user_name, session.generation, std::chrono::steady_clock::now() + idle_timeout);
+          schedule_refresh(user_name, session.generation, refresh_time(token_expiry));
         }
-        message.reply(status_codes::OK);
+        // The ticket lets later requests skip the session lookup
+        ticket_t ticket {user_name, user_part, user_row, user_token, token_expiry, {}};
+        message.reply(status_codes::OK, build_json_value(ticket_prop, tickets.issue(ticket)));
         return;
       }
     }
@@ -247,9 +539,14 @@ void handle_post(http_request message) {
 
   if(paths[0] == sign_off_op && json_body.size() == 0){
     string user_name {paths[1]};
-    map<string,tuple<string,string,string>>::iterator it {signed_on_users.find(user_name)};
-    if(it != signed_on_users.end()){
-      signed_on_users.erase(it);
+    // Every ticket issued so far is revoked along with any session,
+    // whether or not the request carries one
+    string ticket_text;
+    ticket_t ticket;
+    const bool had_ticket {ticket_header(message, ticket_text) &&
+                           tickets.check(ticket_text, ticket) && ticket.userid == user_name};
+    revoke_tickets(user_name);
+    if(signed_on_users->sign_off(user_name) || had_ticket){
       message.reply(status_codes::OK);
       return;
     }
@@ -281,60 +578,32 @@ void handle_put(http_request message) {
     string friend_name {paths[3]};
 
     //if the user is signed on
-    auto user_check = signed_on_users.find(userid);
-    if (user_check != signed_on_users.end()){
+    session_t session;
+    if (find_session(message, userid, session)){
 
-      //get users info from the map
-      string user_token;
-      string user_part;
-      string user_row;
-      for(const auto v : signed_on_users){
-        if(v.first == userid){
-          user_token = get<0>(v.second);
-          user_part = get<1>(v.second);
-          user_row = get<2>(v.second); 
-        }
+      pair<status_code,value> read_result {read_entity(userid, session)};
+      if (read_result.first != status_codes::OK) {
+        message.reply(read_result.first);
+        return;
       }
-
-      pair<status_code,value> read_result = do_request(methods::GET, data_addr + "/" + read_entity_op + "/" + data_table_name + "/" + user_token + "/" + user_part + "/" + user_row);
       
-      bool is_friend = false;
-
-      //getting friends list
-      string friend_list = get_json_object_prop(read_result.second, friend_prop);
-
-      //Turning the friends list string to a friends list object
-      friends_list_t friends_list_op = parse_friends_list(friend_list);
-
-      int i =0; 
-      for (i=0; i < friends_list_op.size(); i++){
-
-        //Looking to see is there is a matching country and name in the friends list since we don't know if user is adding an existing friends which is really bad as why would you forget who you added; I mean that's a bad friendship right there
-        if ((friends_list_op[i].first == friend_country) && friends_list_op[i].second == friend_name){
-          is_friend = true;
-        }
-      }
+      //getting friends list, stored as binary or as a string
+      friends_list_t friends {get_friends_prop(read_result.second, friend_prop)};
+      const pair<string,string> new_friend {friend_country, friend_name};
 
-      //Returns ok if the friend is already in the list
-      if (is_friend){
+      //Returns ok if the friend is already in the list, otherwise appends them
+      if (std::find(friends.begin(), friends.end(), new_friend) != friends.end()){
         message.reply(status_codes::OK);
         return;
-      }  
-
-      //Appends new friend to the friends list
-      friends_list_op.push_back(make_pair(friend_country, friend_name)) ;
-
-      //Turning the friends list object back to a string
-      string updated_friend_list = friends_list_to_string(friends_list_op);
-      cout << updated_friend_list << endl;
+      }
+      friends.push_back(new_friend);
 
-      //puts the updated list back to the user
-      value friend_json_object {build_json_object(vector<pair<string,string>> {make_pair(friend_prop, updated_friend_list)})};
+      cout << friends_list_to_string(friends) << endl;
 
-      pair<status_code, value> new_result = do_request(methods::PUT, data_addr + "/" + update_entity_op + "/" + data_table_name + "/" + user_token + "/" + user_part + "/" + user_row, friend_json_object);
+      //puts the updated list back to the user, in binary form
+      status_code new_result {update_entity(userid, session, friends_props(friend_prop, friends))};
 
-      assert(new_result.first == status_codes::OK);
-      message.reply(status_codes::OK);
+      message.reply(new_result);
       return;
     }
     //if the user isn't signed in
@@ -359,58 +628,33 @@ void handle_put(http_request message) {
     string friend_name {paths[3]};
 
     //if the user is signed on
-    auto user_check = signed_on_users.find(userid);
-    if (user_check != signed_on_users.end()){
-
-      //get users info from the map
-      string user_token;
-      string user_part;
-      string user_row;
-      for(const auto v : signed_on_users){
-        if(v.first == userid){
-          user_token = get<0>(v.second);
-          user_part = get<1>(v.second);
-          user_row = get<2>(v.second); 
-        }
-      }
+    session_t session;
+    if (find_session(message, userid, session)){
 
       //gets user data
-      pair<status_code,value> read_result = do_request(methods::GET, data_addr + "/" + read_entity_op + "/" + data_table_name + "/" + user_token + "/" + user_part + "/" + user_row);
-      bool is_friend = false;
-
-      //getting friends list
-      string friend_list = get_json_object_prop(read_result.second, friend_prop);
-
-      //Turning the friends list string to a friends list object
-      friends_list_t friends_list_op = parse_friends_list(friend_list);
-
-      int i =0; 
-      for (i=0; i < friends_list_op.size(); i++){
-
-        //Looking to see is there is a matching country and name in the friends list and if there's match, the friend is deleted
-        if ((friends_list_op[i].first == friend_country) && friends_list_op[i].second == friend_name){
-          friends_list_op.erase(friends_list_op.begin()+i);
-          is_friend = true;
-        }
+      pair<status_code,value> read_result {read_entity(userid, session)};
+      if (read_result.first != status_codes::OK) {
+        message.reply(read_result.first);
+        return;
       }
 
-      //Returns true if the friend wasn't there in the firstplace
-      if (is_friend == false){
+      //getting friends list, stored as binary or as a string
+      friends_list_t friends {get_friends_prop(read_result.second, friend_prop)};
+      const pair<string,string> old_friend {friend_country, friend_name};
+
+      //Returns ok if the friend wasn't there in the firstplace;
+      //otherwise drops every copy of them, leaving the rest as it was
+      auto kept (std::remove(friends.begin(), friends.end(), old_friend));
+      if (kept == friends.end()){
         message.reply(status_codes::OK);
         return;
       }
       else{
-        //Turning the friends list object back to a string
-        string updated_friend_list = friends_list_to_string(friends_list_op);
-
-        //puts the updated list back to the user
-        value friend_json_object {build_json_object(vector<pair<string,string>> {make_pair(friend_prop, updated_friend_list)})};
-
-        pair<status_code, value> new_result = do_request(methods::PUT, data_addr + "/" + update_entity_op + "/" + data_table_name + "/" + user_token + "/" + user_part + "/" + user_row, friend_json_object);
+        friends.erase(kept, friends.end());
+        //puts the updated list back to the user, in binary form
+        status_code new_result {update_entity(userid, session, friends_props(friend_prop, friends))};
 
-        //checks if it's there
-        assert(new_result.first == status_codes::OK);
-        message.reply(status_codes::OK);
+        message.reply(new_result);
         return;
       }
     }
@@ -438,66 +682,85 @@ void handle_put(http_request message) {
 
     cout << "User Status: " << userstatus << endl;
 
-    //if the user is signed on
-    auto user_check = signed_on_users.find(userid);
-    if (user_check != signed_on_users.end()){
-
-      //get users info from the map
-      string user_token;
-      string user_part;
-      string user_row;
-      for(const auto v : signed_on_users){
-        if(v.first == userid){
-          user_token = get<0>(v.second);
-          user_part = get<1>(v.second);
-          user_row = get<2>(v.second);
+    /*
+      The friends list is read while the status is written. Once
+      the write succeeds, and any earlier push of this user's has
+      finished, the status goes to PushServer, and its answer is
+      the reply, as when these ran one after another: a failed
+      write is Forbidden and no push is made, and an unreachable
+      PushServer is ServiceUnavailable.
+     */
+    session_t session;
+    if (find_session(message, userid, session)){
+      // get user stuff in order to send to push server
+      string user_name {session.row};
+      string user_country {session.partition};
+      cout << "User Name: " << user_name << " | User Country: " << user_country << endl;
 
-        }
-      }
-      // get user stuff in order to send to push server 
-      string user_name {user_row};
-      string user_country {user_part};
       //grabing friend list
-      pair<status_code,value> read_result {do_request(methods::GET, data_addr + "/" + read_entity_op + "/" + data_table_name + "/" + user_token + "/" + user_part + "/" + user_row)};
-      string friend_list {get_json_object_prop(read_result.second, friend_prop)};
-
-      cout << "User Name: " << user_name << " | User Country: " << user_country << endl;
+      pplx::task<friends_list_t> friends_task {pplx::create_task([userid, session] () {
+            pair<status_code,value> read_result {read_entity(userid, session, false)};
+            return get_friends_prop(read_result.second, friend_prop);
+          })};
 
       // Update the user's status property
-      value status_json_object {build_json_object(vector<pair<string,string>> {make_pair(status_prop, userstatus)})};
-
-      pair<status_code, value> status_result = do_request(methods::PUT, data_addr + "/" + update_entity_op +
-                                                          "/" + data_table_name + "/" + user_token + "/" +
-                                                          "/" + user_part + "/" + user_row,
-                                                          status_json_object
-                                                          );
+      pplx::task<status_code> status_task {pplx::create_task([userid, session, userstatus] () {
+            return update_entity(userid, session, vector<pair<string,string>> {make_pair(status_prop, userstatus)});
+          })};
 
-      if(status_result.first != status_codes::OK){
-        message.reply(status_codes::Forbidden);
-        return;
-      }
       // put status into everyone else's updates by calling our push server
-      string updatestatus = userstatus + "\n";
-
-      //atempts to connect to push server
-      try{
-        cout << "trying to push now!" << endl;
-        cout << "friend list is: " << friend_list << endl;
-        cout << "Http request is: " << push_addr + "/" + push_status_op + "/" + user_country + "/" + user_name + "/" + userstatus << endl;
-        value friend_json_object {build_json_object(vector<pair<string,string>> {make_pair(friend_prop, friend_list)})};
-        pair<status_code, value> push_result = do_request(methods::POST, push_addr + "/" + push_status_op +
-                                                          "/" + user_country + "/" + user_name + "/" + userstatus,
-                                                          friend_json_object);
-        cout << push_result.first << endl;
-        message.reply(push_result.first);
-        return;
-      }
-      // if the server isn't running
-      catch (const web::uri_exception& e){
-        cout << "caught exception!!!" << endl;
-        message.reply(status_codes::ServiceUnavailable);
-        return;
-      }
+      pplx::task_completion_event<void> pushed {};
+      pplx::task<void> previous_push {signed_on_users->queue_push(userid, pplx::create_task(pushed))};
+      status_task.then([message, friends_task, previous_push, pushed, user_country, user_name, userstatus]
+                       (pplx::task<status_code> t) -> pplx::task<void> {
+          status_code written {status_codes::InternalError};
+          try{
+            written = t.get();
+          }
+          catch (const web::uri_exception&){
+            written = status_codes::ServiceUnavailable;
+          }
+          catch (const std::exception& e){
+            cout << "Status update failed: " << e.what() << endl;
+          }
+          if (written != status_codes::OK) {
+            pushed.set();
+            message.reply(written == status_codes::ServiceUnavailable || written == status_codes::InternalError ?
+                          written : status_codes::Forbidden);
+            return pplx::task_from_result();
+          }
+
+          return (previous_push && friends_task.then([] (friends_list_t) {}))
+            .then([message, friends_task, pushed, user_country, user_name, userstatus] (pplx::task<void> ready) {
+                try{
+                  ready.get();
+                  friends_list_t friend_list {friends_task.get()};
+                  cout << "friend list has " << friend_list.size() << " friends" << endl;
+                  // PushServer gets the list in binary form, as it is stored
+                  value friend_json_object {build_json_object(friends_props(friend_prop, friend_list))};
+                  pair<status_code, value> push_result = do_request(methods::POST, push_addr + "/" + push_status_op +
+                                                                    "/" + user_country + "/" + user_name + "/" + userstatus,
+                                                                    friend_json_object);
+                  cout << "Push of " << userstatus << ": " << push_result.first << endl;
+                  message.reply(push_result.first);
+                }
+                // if the server isn't running
+                catch (const web::http::http_exception& e){
+                  cout << "Push of " << userstatus << " failed: " << e.what() << endl;
+                  message.reply(status_codes::ServiceUnavailable);
+                }
+                catch (const web::uri_exception& e){
+                  cout << "Push of " << userstatus << " failed: " << e.what() << endl;
+                  message.reply(status_codes::ServiceUnavailable);
+                }
+                catch (const std::exception& e){
+                  cout << "Push of " << userstatus << " failed: " << e.what() << endl;
+                  message.reply(status_codes::InternalError);
+                }
+                pushed.set();
+              });
+        });
+      return;
     }
     else  {
       // Declines not logged in
@@ -522,20 +785,103 @@ void handle_delete(http_request message) {
 }
 
 
+#ifdef COLOCATED
+int run (int argc, char const * argv[]) {
+#else
 int main (int argc, char const * argv[]) {
+#endif
+  // With sessions in this process it runs as one worker
+  WorkerLauncher launcher {false};
+  string session_store_addr {};
+  std::chrono::milliseconds session_cache_ttl {def_session_cache_ttl};
+  retry_policy_t request_policy {};
+  breaker_policy_t breaker_policy {};
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (launcher.parse_option(argv[i], argv[i+1]))
+      continue;
+    else if (parse_retry_option(argv[i], argv[i+1], request_policy))
+      continue;
+    else if (parse_breaker_option(argv[i], argv[i+1], breaker_policy))
+      continue;
+    else if (string(argv[i]) == "--data-shards")
+      data_shards.set_shards(shard_addrs(data_addr, string(argv[i+1])));
+    else if (string(argv[i]) == "--internal-rpc")
+      enable_internal_rpc(string(argv[i+1]) == "on");
+    else if (string(argv[i]) == "--session-store")
+      session_store_addr = argv[i+1];
+    else if (string(argv[i]) == "--session-cache-ttl")
+      session_cache_ttl = std::chrono::milliseconds {std::stol(argv[i+1])};
+    else if (string(argv[i]) == "--ticket-key-file") {
+      std::ifstream key_file {argv[i+1]};
+      string key {};
+      if (! getline(key_file, key) || key.empty()) {
+        cout << "UserServer: Cannot read a ticket key from " << argv[i+1] << endl;
+        return 1;
+      }
+      tickets.set_key(key);
+    }
+  }
+  if (! session_store_addr.empty()) {
+    cout << "UserServer: Sessions at " << session_store_addr << endl;
+    signed_on_users = std::make_unique<RemoteSessionStore>(session_store_addr, session_cache_ttl);
+    launcher.set_stateless(true);
+  }
+  launcher.start();
+  set_request_policy(request_policy);
+  set_breaker_policy(breaker_policy);
+  next_generation = initial_generation();  // Each worker draws its own
+
+  cout << "UserServer: Starting session timers" << endl;
+  std::atomic<bool> stopping {false};
+  std::thread session_expiry {[&stopping] () {
+      while (! stopping) {
+        std::this_thread::sleep_for(std::chrono::seconds {1});
+        for (auto& callback : session_timers.advance(std::chrono::steady_clock::now()))
+          callback();
+        refresh_tokens();
+        tickets.prune();
+      }
+    }};
+
   cout << "UserServer: Opening listener" << endl;
-  http_listener listener {def_url};
-  listener.support(methods::GET, &handle_get);
-  listener.support(methods::POST, &handle_post);
-  listener.support(methods::PUT, &handle_put);
-  //listener.support(methods::DEL, &handle_delete);
-  listener.open().wait(); // Wait for listener to complete starting
+  // Workers sharing sessions through a SessionServer share the port,
+  // which http_listener cannot do
+  std::unique_ptr<http_listener> listener {};
+  std::unique_ptr<HttpServer> shared_listener {};
+  if (launcher.shared_port()) {
+    shared_listener = open_http_server(launcher.url(def_url), rpc_handlers_t {
+        {methods::GET, &handle_get},
+        {methods::POST, &handle_post},
+        {methods::PUT, &handle_put}});
+  }
+  else {
+    listener = std::make_unique<http_listener>(launcher.url(def_url));
+    listener->support(methods::GET, &handle_get);
+    listener->support(methods::POST, &handle_post);
+    listener->support(methods::PUT, &handle_put);
+    //listener->support(methods::DEL, &handle_delete);
+    listener->open().wait(); // Wait for listener to complete starting
+  }
+#ifdef COLOCATED
+  register_local_service(launcher.url(def_url), methods::GET, &handle_get);
+  register_local_service(launcher.url(def_url), methods::POST, &handle_post);
+  register_local_service(launcher.url(def_url), methods::PUT, &handle_put);
+#endif
 
-  cout << "Enter carriage return to stop UserServer." << endl;
-  string line;
-  getline(std::cin, line);
+  if (launcher.worker() == 0)
+    cout << "Enter carriage return to stop UserServer." << endl;
+  launcher.wait_for_stop();
 
   // Shut it down
-  listener.close().wait();
+  if (listener)
+    listener->close().wait();
+  shared_listener.reset();
+  stopping = true;
+  session_expiry.join();
   cout << "UserServer closed" << endl;
-}
\ No newline at end of file
+  return 0;
+}
+
+#ifdef COLOCATED
+}
+#endif
@@ -0,0 +1,185 @@
+#include "WorkerLauncher.h"
+
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cpprest/uri.h>
+#include <cpprest/version.h>
+
+#include <pplx/pplxtasks.h>
+
+#include "RpcFrame.h"
+
+// The thread pool's size can only be set from cpprest 2.10 on
+#if defined(CPPREST_VERSION) && CPPREST_VERSION >= 201000
+#define HAVE_THREADPOOL_SIZE 1
+#include <pplx/threadpool.h>
+#endif
+
+using std::cout;
+using std::endl;
+using std::string;
+
+using web::uri;
+using web::uri_builder;
+
+#ifdef COLOCATED
+namespace {
+  pplx::extensibility::event_t colocated_stop {};
+  std::once_flag threadpool_sized {};
+}
+
+/*
+  Release every server's wait_for_stop()
+ */
+void WorkerLauncher::stop_all() {
+  colocated_stop.set();
+}
+#endif
+
+/*
+  Take --workers N, --threads N and --shard I. Returns false if
+  flag is none of them, so the caller can try its own options.
+ */
+bool WorkerLauncher::parse_option(const string& flag, const string& val) {
+  if (flag == "--workers")
+    workers = std::stoul(val);
+  else if (flag == "--threads")
+    threads = std::stoul(val);
+  else if (flag == "--shard")
+    shard = std::stoul(val);
+  else
+    return false;
+  if (workers == 0)
+    workers = 1;
+  return true;
+}
+
+/*
+  Fork the other workers and size this worker's thread pool.
+  Must be called before anything starts a thread, including any
+  use of cpprest or pplx.
+ */
+void WorkerLauncher::start() {
+#ifdef COLOCATED
+  // The servers share this process and its thread pool
+  if (workers > 1)
+    cout << "Colocated servers run as one process; ignoring --workers " << workers << endl;
+  if (threads > 0) {
+#ifdef HAVE_THREADPOOL_SIZE
+    std::call_once(threadpool_sized, [this] () {
+        crossplat::threadpool::initialize_with_threads(threads);
+      });
+#else
+    cout << "This cpprest cannot size its thread pool; ignoring --threads " << threads << endl;
+#endif
+  }
+  workers = 1;
+  shard = 0;
+  return;
+#endif
+
+  if (workers > 1 && ! stateless) {
+    cout << "This server keeps per-user state; ignoring --workers " << workers << endl;
+    workers = 1;
+  }
+  if (shard > 0 && ! stateless) {
+    cout << "This server cannot be sharded; ignoring --shard " << shard << endl;
+    shard = 0;
+  }
+
+  const pid_t parent {getpid()};
+  for (unsigned i = 1; i < workers; ++i) {
+    pid_t pid {fork()};
+    if (pid < 0) {
+      cout << "Could not start worker " << i << "; running " << i << " workers" << endl;
+      workers = i;
+      break;
+    }
+    if (pid == 0) {
+      index = i;
+      children.clear();
+      // Stop signals are taken by wait_for_stop()
+      sigset_t stop_signals;
+      sigemptyset(&stop_signals);
+      sigaddset(&stop_signals, SIGTERM);
+      sigaddset(&stop_signals, SIGINT);
+      sigprocmask(SIG_BLOCK, &stop_signals, nullptr);
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+      if (getppid() != parent)
+        std::exit(0);  // Worker 0 died before prctl() took effect
+      break;
+    }
+    children.push_back(pid);
+  }
+
+  if (threads > 0) {
+#ifdef HAVE_THREADPOOL_SIZE
+    crossplat::threadpool::initialize_with_threads(threads);
+#else
+    cout << "This cpprest cannot size its thread pool; ignoring --threads " << threads << endl;
+#endif
+  }
+  if (workers > 1)
+    cout << "Worker " << index << " of " << workers << " (pid " << getpid() << ")" << endl;
+}
+
+/*
+  Return def_url with its port moved up for this shard. Every
+  worker of the shard gets the same URL.
+ */
+string WorkerLauncher::url(const string& def_url) const {
+  uri_builder builder {uri {def_url}};
+  const long port {builder.port() + static_cast<long>(shard_port_stride) * shard};
+  if (port + rpc_port_offset > 65535)
+    throw std::out_of_range("Shard " + std::to_string(shard) + " would listen on port " + std::to_string(port));
+  builder.set_port(static_cast<int>(port));
+  return builder.to_string();
+}
+
+/*
+  Block until this worker is told to stop: a carriage return on
+  standard input for worker 0, a signal for the others.
+  Colocated servers wait for stop_all() instead.
+ */
+void WorkerLauncher::wait_for_stop() {
+#ifdef COLOCATED
+  colocated_stop.wait();
+  return;
+#endif
+
+  if (index == 0) {
+    string line;
+    getline(std::cin, line);
+    return;
+  }
+
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGTERM);
+  sigaddset(&stop_signals, SIGINT);
+  int sig {0};
+  sigwait(&stop_signals, &sig);
+}
+
+/*
+  In worker 0, stop the other workers and wait for them to exit.
+  Does nothing in the others.
+ */
+void WorkerLauncher::stop() {
+  for (pid_t pid : children)
+    kill(pid, SIGTERM);
+  for (pid_t pid : children) {
+    int status {0};
+    waitpid(pid, &status, 0);
+  }
+  children.clear();
+}
@@ -0,0 +1,83 @@
+#ifndef WorkerLauncher_h
+#define WorkerLauncher_h
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+// Distance between the ports of consecutive BasicServer shards
+constexpr int shard_port_stride {1000};
+
+/*
+  Runs a server as several worker processes sharing its port, each
+  with its own thread pool.
+
+  start() forks workers - 1 children before any thread exists.
+  Every worker listens on the server's one port through an
+  HttpServer, whose socket sets SO_REUSEPORT, and the kernel spreads
+  new connections among them; cpprest's http_listener, which cannot
+  set the option, is used only by a server running one worker.
+  The workers' RPC ports are shared the same way.
+
+  --shard i moves a stateless server's port up by
+  i * shard_port_stride, so several BasicServers, each with its own
+  workers, can run side by side as the shards ShardRouter routes
+  to. url() throws std::out_of_range if the shard's port, or the RPC
+  port after it, would be past 65535. Shard ports should also lie
+  outside the host's ephemeral range
+  (/proc/sys/net/ipv4/ip_local_port_range), or be reserved in
+  ip_local_reserved_ports, so outgoing connections cannot take
+  them first.
+
+  Nothing is shared between workers. Each has its own TableCache
+  and its own caches of tokens and credentials, so a cache entry
+  invalidated through one worker can stay live in the others until
+  it expires. Servers that keep per-user state (sessions, feeds),
+  or whose cache invalidations must take effect at once
+  (AuthServer's credentials), run as a single worker; they pass
+  stateless = false and --workers is then ignored.
+
+  Worker 0 is the original process. It stops on a carriage return,
+  as the servers always have, and then stops and reaps the others.
+  The other workers stop on SIGTERM or SIGINT, and receive SIGTERM
+  if worker 0 dies.
+
+  Built with COLOCATED, every server runs as a single worker in
+  one shared process; --workers is ignored and wait_for_stop()
+  returns once stop_all() is called.
+ */
+class WorkerLauncher {
+private:
+  bool stateless;
+  unsigned workers;
+  std::size_t threads;  // 0 for cpprest's default
+  unsigned shard;
+  unsigned index;
+  std::vector<pid_t> children;
+
+public:
+  explicit WorkerLauncher (bool stateless) :
+    stateless {stateless},
+    workers {1},
+    threads {0},
+    shard {0},
+    index {0},
+    children {}
+    {};
+
+  void set_stateless(bool s) { stateless = s; }
+  bool parse_option(const std::string& flag, const std::string& val);
+  void start();
+  unsigned worker() const { return index; }
+  bool shared_port() const { return workers > 1; }
+  std::string url(const std::string& def_url) const;
+  void wait_for_stop();
+  void stop();
+#ifdef COLOCATED
+  static void stop_all();
+#endif
+};
+
+#endif
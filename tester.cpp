@@ -3,9 +3,13 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <exception>
 #include <iostream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -16,6 +20,11 @@
 
 #include <UnitTest++/UnitTest++.h>
 
+#include "CircuitBreaker.h"
+#include "Resilience.h"
+#include "SasUtils.h"
+#include "ShardRouter.h"
+
 using std::cerr;
 using std::cout;
 using std::endl;
@@ -50,6 +59,10 @@ const string update_entity_auth {"UpdateEntityAuth"};
 
 const string get_read_token_op  {"GetReadToken"};
 const string get_update_token_op {"GetUpdateToken"};
+const string invalidate_credentials_admin {"InvalidateCredentialsAdmin"};
+const string get_tokens_op {"GetTokens"};
+const string refresh_token_op {"RefreshToken"};
+const string provision_users_admin {"ProvisionUsersAdmin"};
 
 // The two optional operations from Assignment 1
 const string add_property_admin {"AddPropertyAdmin"};
@@ -64,6 +77,9 @@ const string unfriend_op {"UnFriend"};
 const string update_status_op {"UpdateStatus"};
 const string read_friend_list_op {"ReadFriendList"};
 const string push_status_op {"PushStatus"};
+const string feed_op {"Feed"};
+const string updates_op {"Updates"};
+const string set_data_shards_admin {"SetDataShardsAdmin"};
 // End of our extensions =================================================================================================================
 
 
@@ -122,6 +138,71 @@ pair<status_code,value> do_request (const method& http_method, const string& uri
   return do_request (http_method, uri_string, value {});
 }
 
+/*
+  Make a POST request with a plain text body, returning the status
+  code and any JSON value in the body as do_request() does
+ */
+pair<status_code,value> post_text (const string& uri_string, const string& text) {
+  http_request request {methods::POST};
+  request.set_body(text, "text/plain");
+
+  status_code code;
+  value resp_body;
+  http_client client {uri_string};
+  client.request (request)
+    .then([&code](http_response response)
+          {
+            code = response.status_code();
+            const http_headers& headers {response.headers()};
+            auto content_type (headers.find("Content-Type"));
+            if (content_type == headers.end() ||
+                content_type->second != "application/json")
+              return pplx::task<value> ([] { return value {};});
+            else
+              return response.extract_json();
+          })
+    .then([&resp_body](value v) -> void
+          {
+            resp_body = v;
+            return;
+          })
+    .wait();
+  return make_pair(code, resp_body);
+}
+
+/*
+  Make a request with no body, authorized by a session ticket,
+  returning the status code and any JSON value in the body as
+  do_request() does
+ */
+pair<status_code,value> ticket_request (const method& http_method, const string& uri_string, const string& ticket) {
+  http_request request {http_method};
+  request.headers().add("Authorization", "Ticket " + ticket);
+
+  status_code code;
+  value resp_body;
+  http_client client {uri_string};
+  client.request (request)
+    .then([&code](http_response response)
+          {
+            code = response.status_code();
+            const http_headers& headers {response.headers()};
+            auto content_type (headers.find("Content-Type"));
+            if (content_type == headers.end() ||
+                content_type->second != "application/json")
+              return pplx::task<value> ([] { return value {};});
+            else
+              return response.extract_json();
+          })
+    .then([&resp_body](value v) -> void
+          {
+            resp_body = v;
+            return;
+          })
+    .wait();
+  return make_pair(code, resp_body);
+}
+
 /*
   Utility to create a table
 
@@ -372,6 +453,26 @@ int delete_entity (const string& addr, const string& table, const string& partit
 
 
 
+/*
+  Utility to query a table for entities whose property prop is pval,
+  retrying for up to two seconds until there are count of them.
+
+  Used to check the effects of operations that finish in the
+  background, such as the push that follows UpdateStatus.
+ */
+pair<status_code,value> wait_for_entities(const string& addr, const string& table, const string& prop, const string& pval, size_t count) {
+  pair<status_code,value> result {};
+  for (int tries = 0; tries < 20; ++tries) {
+    result = do_request (methods::GET, addr + read_entity_admin + "/" + table,
+                         value::object(vector<pair<string,value>>{make_pair(prop, value::string(pval))}));
+    if (result.first == status_codes::OK && result.second.is_array() &&
+        result.second.as_array().size() == count)
+      break;
+    std::this_thread::sleep_for(std::chrono::milliseconds {100});
+  }
+  return result;
+}
+
 /*
   Utility to get a token good for updating a specific entry
   from a specific table for one day.
@@ -410,6 +511,34 @@ pair<status_code,string> get_read_token(const string& addr,  const string& useri
   }
 }
 
+/*
+  Utility to exchange an update token for a fresh one, without
+  the password
+ */
+pair<status_code,string> refresh_token(const string& addr, const string& userid, const string& token) {
+  value old_token {build_json_object (vector<pair<string,string>> {make_pair("token", token)})};
+  pair<status_code,value> result {do_request (methods::GET,
+                                              addr +
+                                              refresh_token_op + "/" +
+                                              userid,
+                                              old_token
+                                              )};
+  if (result.first != status_codes::OK)
+    return make_pair (result.first, "");
+  return make_pair (result.first, result.second["token"].as_string());
+}
+
+/*
+  Utility to make AuthServer forget its cached copy of a user's
+  AuthTable entity, after the entity has been changed or deleted.
+ */
+int invalidate_credentials(const string& auth_addr, const string& userid) {
+  pair<status_code,value> result {
+    do_request (methods::DEL,
+                auth_addr + invalidate_credentials_admin + "/" + userid)};
+  return result.first;
+}
+
 // Our extensions ========================================================================================================================
 //these 2 functions will make and delete users with ease :)
 
@@ -504,6 +633,7 @@ int delete_user(const string& user_name, const string& user_part, const string&
   if (del_ent_result != status_codes::OK) {
     throw std::exception();
   }
+  invalidate_credentials("http://localhost:34570/", user_name);
 
   return status_codes::OK;
 }
@@ -518,6 +648,7 @@ int delete_ghost(const string& user_name){
   if (del_ent_result != status_codes::OK) {
     throw std::exception();
   }
+  invalidate_credentials("http://localhost:34570/", user_name);
 
   return status_codes::OK;
 }
@@ -1073,6 +1204,8 @@ public:
     if (del_ent_result != status_codes::OK){
     	throw std::exception();
     }
+    invalidate_credentials(auth_addr, userid);
+    invalidate_credentials(auth_addr, user_bob);
     // End of our extensions =================================================================================================================
   }
 };
@@ -1246,6 +1379,32 @@ SUITE(UPDATE_AUTH) {
                   );
     CHECK_EQUAL(status_codes::BadRequest, result.first);
   }
+
+  TEST_FIXTURE(AuthFixture, PasswordChange) {
+    cout << "Requesting update token to get the credentials cached" << endl;
+    pair<status_code,string> token_res {
+      get_update_token(AuthFixture::auth_addr,
+                       AuthFixture::userid,
+                       AuthFixture::user_pwd)};
+    CHECK_EQUAL (status_codes::OK, token_res.first);
+
+    cout << "Changing the password" << endl;
+    const string new_pwd {"newuser"};
+    int put_result {put_entity (AuthFixture::addr,
+                                AuthFixture::auth_table,
+                                AuthFixture::auth_table_partition,
+                                AuthFixture::userid,
+                                AuthFixture::auth_pwd_prop,
+                                new_pwd)};
+    CHECK_EQUAL (status_codes::OK, put_result);
+    CHECK_EQUAL (status_codes::OK, invalidate_credentials(AuthFixture::auth_addr, AuthFixture::userid));
+
+    token_res = get_update_token(AuthFixture::auth_addr, AuthFixture::userid, AuthFixture::user_pwd);
+    CHECK_EQUAL (status_codes::NotFound, token_res.first);
+
+    token_res = get_update_token(AuthFixture::auth_addr, AuthFixture::userid, new_pwd);
+    CHECK_EQUAL (status_codes::OK, token_res.first);
+  }
 }
 
 
@@ -1375,6 +1534,48 @@ SUITE(GET_AUTH){
                   )};
     CHECK_EQUAL(status_codes::NotFound, result3.first);
   }
+
+  TEST_FIXTURE(AuthFixture, GetAuthBadToken){
+    cout << "Requesting read token" << endl;
+    pair<status_code,string> token_res {
+        get_read_token(AuthFixture::auth_addr,
+                         AuthFixture::userid,
+                           AuthFixture::user_pwd)};
+    cout << "Token response " << token_res.first << endl;
+    CHECK_EQUAL (token_res.first, status_codes::OK);
+
+    //change one character of the signature
+    string tampered {token_res.second};
+    string::size_type sig {tampered.find("sig=")};
+    CHECK(sig != string::npos && sig + 4 < tampered.size());
+    if (sig != string::npos && sig + 4 < tampered.size())
+      tampered[sig + 4] = tampered[sig + 4] == 'A' ? 'B' : 'A';
+    pair<status_code,value> result1 {
+      do_request (methods::GET,
+                  string(AuthFixture::addr)
+                  + read_entity_auth + "/"
+                  + AuthFixture::table + "/"
+                  + tampered + "/"
+                  + AuthFixture::partition + "/"
+                  + AuthFixture::row)};
+    CHECK_EQUAL(status_codes::Forbidden, result1.first);
+
+    //move the expiry into the past
+    string expired {token_res.second};
+    string::size_type se {expired.find("se=")};
+    CHECK(se != string::npos && se + 7 <= expired.size());
+    if (se != string::npos && se + 7 <= expired.size())
+      expired.replace(se + 3, 4, "2000");
+    pair<status_code,value> result2 {
+      do_request (methods::GET,
+                  string(AuthFixture::addr)
+                  + read_entity_auth + "/"
+                  + AuthFixture::table + "/"
+                  + expired + "/"
+                  + AuthFixture::partition + "/"
+                  + AuthFixture::row)};
+    CHECK_EQUAL(status_codes::Forbidden, result2.first);
+  }
 }
 
 SUITE(TOKEN_OPS)
@@ -1502,6 +1703,132 @@ SUITE(TOKEN_OPS)
     cout << "Token response " << token_res2.first << endl;
     CHECK_EQUAL (token_res2.first, status_codes::NotFound);
   }
+
+  TEST_FIXTURE(AuthFixture, RefreshTokens){
+    pair<status_code,string> token_res {
+      get_update_token(AuthFixture::auth_addr,
+                       AuthFixture::userid,
+                       AuthFixture::user_pwd)};
+    CHECK_EQUAL (status_codes::OK, token_res.first);
+
+    cout << "Refreshing the user's own token" << endl;
+    pair<status_code,string> fresh {
+      refresh_token(AuthFixture::auth_addr, AuthFixture::userid, token_res.second)};
+    CHECK_EQUAL (status_codes::OK, fresh.first);
+    pair<status_code,value> result {
+      do_request (methods::GET,
+                  string(AuthFixture::addr)
+                  + read_entity_auth + "/"
+                  + AuthFixture::table + "/"
+                  + fresh.second + "/"
+                  + AuthFixture::partition + "/"
+                  + AuthFixture::row)};
+    CHECK_EQUAL (status_codes::OK, result.first);
+
+    //the fresh token keeps the sign-on's start time
+    sas_token_t old_sas {};
+    sas_token_t fresh_sas {};
+    CHECK (parse_sas_token(token_res.second, old_sas));
+    CHECK (parse_sas_token(fresh.second, fresh_sas));
+    CHECK (old_sas.start.is_initialized());
+    CHECK_EQUAL (old_sas.start.to_interval(), fresh_sas.start.to_interval());
+
+    cout << "Refreshing the user's token as Bob" << endl;
+    CHECK_EQUAL (status_codes::Forbidden,
+                 refresh_token(AuthFixture::auth_addr, AuthFixture::user_bob, token_res.second).first);
+
+    cout << "Refreshing a token with a forged signature" << endl;
+    string forged {token_res.second};
+    const auto sig = forged.find("sig=");
+    CHECK (sig != string::npos && sig + 4 < forged.size());
+    if (sig != string::npos && sig + 4 < forged.size()) {
+      forged[sig + 4] = forged[sig + 4] == 'A' ? 'B' : 'A';
+      CHECK_EQUAL (status_codes::Forbidden,
+                   refresh_token(AuthFixture::auth_addr, AuthFixture::userid, forged).first);
+    }
+
+    cout << "Refreshing a read token" << endl;
+    pair<status_code,string> read_res {
+      get_read_token(AuthFixture::auth_addr, AuthFixture::userid, AuthFixture::user_pwd)};
+    CHECK_EQUAL (status_codes::Forbidden,
+                 refresh_token(AuthFixture::auth_addr, AuthFixture::userid, read_res.second).first);
+
+    CHECK_EQUAL (status_codes::BadRequest,
+                 refresh_token(AuthFixture::auth_addr, AuthFixture::userid, "").first);
+  }
+
+  TEST_FIXTURE(AuthFixture, BulkTokens){
+    auto token_request = [] (const string& userid, const string& password, const string& permission) {
+      return value::object (vector<pair<string,value>> {make_pair("Userid", value::string(userid)),
+                                                        make_pair("Password", value::string(password)),
+                                                        make_pair("Permission", value::string(permission))});
+    };
+    cout << "Requesting four tokens at once" << endl;
+    pair<status_code,value> result {
+      do_request (methods::POST,
+                  string(AuthFixture::auth_addr) + get_tokens_op,
+                  value::array (vector<value> {
+                      token_request(AuthFixture::userid, AuthFixture::user_pwd, "read"),
+                      token_request(AuthFixture::user_bob, AuthFixture::bob_pass, "update"),
+                      token_request(AuthFixture::userid, AuthFixture::bob_pass, "update"),
+                      token_request(AuthFixture::user_bob, AuthFixture::bob_pass, "delete")}))};
+    CHECK_EQUAL (status_codes::OK, result.first);
+    CHECK (result.second.is_array());
+    CHECK_EQUAL (4, result.second.size());
+    if (! result.second.is_array() || result.second.size() != 4)
+      return;
+
+    value& tokens = result.second;
+    CHECK_EQUAL (status_codes::OK, tokens[0]["Status"].as_integer());
+    CHECK (tokens[0]["token"].as_string() != "");
+    CHECK_EQUAL (status_codes::OK, tokens[1]["Status"].as_integer());
+    CHECK_EQUAL (string(AuthFixture::user_bob), tokens[1]["Userid"].as_string());
+    CHECK_EQUAL (status_codes::NotFound, tokens[2]["Status"].as_integer());
+    CHECK_EQUAL (status_codes::BadRequest, tokens[3]["Status"].as_integer());
+
+    cout << "Using the read token to read the user's entity" << endl;
+    result = do_request (methods::GET,
+                         string(AuthFixture::addr)
+                         + read_entity_auth + "/"
+                         + AuthFixture::table + "/"
+                         + tokens[0]["token"].as_string() + "/"
+                         + AuthFixture::partition + "/"
+                         + AuthFixture::row);
+    CHECK_EQUAL (status_codes::OK, result.first);
+
+    result = do_request (methods::POST,
+                         string(AuthFixture::auth_addr) + get_tokens_op,
+                         value::string("not an array"));
+    CHECK_EQUAL (status_codes::BadRequest, result.first);
+  }
+
+  TEST_FIXTURE(AuthFixture, ProvisionUsers){
+    cout << "Provisioning two users, with a line that is not a user between them" << endl;
+    const string first_user {"{\"Userid\": \"prov_one\", \"Password\": \"one\", \"DataPartition\": \"Prov\", \"DataRow\": \"One\"}"};
+    const string second_user {"{\"Userid\": \"prov_two\", \"Password\": \"two\", \"DataPartition\": \"Prov\", \"DataRow\": \"Two\"}"};
+    pair<status_code,value> result {
+      post_text (string(AuthFixture::auth_addr) + provision_users_admin,
+                 first_user + "\n{\"Userid\": \"prov_bad\"}\n" + second_user + "\n")};
+    CHECK_EQUAL (status_codes::OK, result.first);
+    CHECK_EQUAL (3, result.second["Received"].as_integer());
+    CHECK_EQUAL (2, result.second["Provisioned"].as_integer());
+    CHECK_EQUAL (1, result.second["Failures"].size());
+
+    pair<status_code,string> token_res {
+      get_update_token(AuthFixture::auth_addr, "prov_two", "two")};
+    CHECK_EQUAL (status_codes::OK, token_res.first);
+
+    result = do_request (methods::GET,
+                         string(AuthFixture::addr)
+                         + read_entity_auth + "/"
+                         + AuthFixture::table + "/"
+                         + token_res.second + "/"
+                         + "Prov/Two");
+    CHECK_EQUAL (status_codes::OK, result.first);
+
+    CHECK_EQUAL (status_codes::OK, delete_user("prov_one", "Prov", "One"));
+    CHECK_EQUAL (status_codes::OK, delete_user("prov_two", "Prov", "Two"));
+  }
 }
 
 
@@ -1911,6 +2238,76 @@ SUITE(USER_SERVER){
     CHECK_EQUAL(status_codes::NotFound, result.first);
   }
 
+  TEST_FIXTURE(UserFixture, sign_on_tickets){
+    const string pwd_prop {UserFixture::auth_pwd_prop};
+    cout << endl << "Kino signs in and keeps the ticket she is given" << endl;
+    pair<status_code,value> result {
+      do_request (methods::POST,
+                  string(UserFixture::userserver_addr)
+                  + sign_on_op + "/"
+                  + UserFixture::kino_user,
+                  value::object (vector<pair<string,value>>
+                                   {make_pair(pwd_prop ,
+                                              value::string(UserFixture::kino_pass))})
+                  )};
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK(result.second.has_field("Ticket"));
+    const string ticket {result.second["Ticket"].as_string()};
+    const string friends_uri {string(UserFixture::userserver_addr)
+                              + read_friend_list_op + "/"
+                              + UserFixture::kino_user};
+
+    cout << "Her ticket lets her read her friends" << endl;
+    result = ticket_request (methods::GET, friends_uri, ticket);
+    CHECK_EQUAL(status_codes::OK, result.first);
+
+    cout << "Someone edits her ticket and tries it" << endl;
+    string tampered {ticket};
+    tampered[2] = tampered[2] == 'A' ? 'B' : 'A';
+    result = ticket_request (methods::GET, friends_uri, tampered);
+    CHECK_EQUAL(status_codes::Forbidden, result.first);
+
+    cout << "Her ticket is no use to anyone else" << endl;
+    result = ticket_request (methods::GET,
+                             string(UserFixture::userserver_addr)
+                             + read_friend_list_op + "/"
+                             + UserFixture::ted_user,
+                             ticket);
+    CHECK_EQUAL(status_codes::Forbidden, result.first);
+
+    cout << "She signs off without sending the ticket, which revokes it" << endl;
+    result =
+      do_request (methods::POST,
+                  string(UserFixture::userserver_addr)
+                  + sign_off_op + "/"
+                  + UserFixture::kino_user
+                  );
+    CHECK_EQUAL(status_codes::OK, result.first);
+    result = ticket_request (methods::GET, friends_uri, ticket);
+    CHECK_EQUAL(status_codes::Forbidden, result.first);
+
+    cout << "Signing in again gives her a ticket that works" << endl;
+    result =
+      do_request (methods::POST,
+                  string(UserFixture::userserver_addr)
+                  + sign_on_op + "/"
+                  + UserFixture::kino_user,
+                  value::object (vector<pair<string,value>>
+                                   {make_pair(pwd_prop ,
+                                              value::string(UserFixture::kino_pass))})
+                  );
+    CHECK_EQUAL(status_codes::OK, result.first);
+    result = ticket_request (methods::GET, friends_uri, result.second["Ticket"].as_string());
+    CHECK_EQUAL(status_codes::OK, result.first);
+    result =
+      do_request (methods::POST,
+                  string(UserFixture::userserver_addr)
+                  + sign_off_op + "/"
+                  + UserFixture::kino_user
+                  );
+    CHECK_EQUAL(status_codes::OK, result.first);
+  }
+
   TEST_FIXTURE(UserFixture, add_unfriend_and_get_friendslist){
   	const string pwd_prop {UserFixture::auth_pwd_prop};
 
@@ -1981,6 +2378,69 @@ SUITE(USER_SERVER){
     value expect {value::object(vector<pair<string,value>>{make_pair(string(UserFixture::friend_prop), value::string("Canada;Cruz,Ted|USA;Clinton,Hillary|USA;Trump,Ivanka"))})};
     compare_json_values (expect, result.second);
 
+    cout << "DataTable holds his list in binary, marked as such for outside readers" << endl;
+    result =
+      do_request (methods::GET,
+                  string(UserFixture::addr)
+                  + read_entity_admin + "/"
+                  + UserFixture::table + "/"
+                  + UserFixture::trump_part + "/"
+                  + UserFixture::trump_row
+                  );
+    CHECK_EQUAL(status_codes::OK, result.first);
+    const string friends_type {string(UserFixture::friend_prop) + "@odata.type"};
+    CHECK(result.second.has_field(friends_type) &&
+          result.second.at(friends_type).as_string() == "Edm.Binary");
+
+    cout << "He adds a friend whose name the text form cannot hold, and reads the list as an array" << endl;
+    result =
+      do_request (methods::PUT,
+                  string(UserFixture::userserver_addr)
+                  + add_friend_op + "/"
+                  + UserFixture::trump_user + "/"
+                  + "USA/"
+                  + "Trump%7CJr%3BDon"
+                  );
+    CHECK_EQUAL(status_codes::OK, result.first);
+    result =
+      do_request (methods::GET,
+                  string(UserFixture::userserver_addr)
+                  + read_friend_list_op + "/"
+                  + UserFixture::trump_user
+                  + "?form=array"
+                  );
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK(result.second.has_field(UserFixture::friend_prop) &&
+          result.second.at(UserFixture::friend_prop).is_array());
+    if (result.second.has_field(UserFixture::friend_prop) &&
+        result.second.at(UserFixture::friend_prop).is_array()) {
+      value& friends = result.second.at(UserFixture::friend_prop);
+      CHECK_EQUAL(4, friends.size());
+      if (friends.size() == 4) {
+        CHECK_EQUAL(string {"Canada"}, friends[0]["Country"].as_string());
+        CHECK_EQUAL(string {"Cruz,Ted"}, friends[0]["Name"].as_string());
+        CHECK_EQUAL(string {"USA"}, friends[3]["Country"].as_string());
+        CHECK_EQUAL(string {"Trump|Jr;Don"}, friends[3]["Name"].as_string());
+      }
+    }
+    result =
+      do_request (methods::GET,
+                  string(UserFixture::userserver_addr)
+                  + read_friend_list_op + "/"
+                  + UserFixture::trump_user
+                  + "?form=tree"
+                  );
+    CHECK_EQUAL(status_codes::BadRequest, result.first);
+    result =
+      do_request (methods::PUT,
+                  string(UserFixture::userserver_addr)
+                  + unfriend_op + "/"
+                  + UserFixture::trump_user + "/"
+                  + "USA/"
+                  + "Trump%7CJr%3BDon"
+                  );
+    CHECK_EQUAL(status_codes::OK, result.first);
+
     cout << "Ted says some rude things about Donald (cuz he's lying ted) and Donald unfriends him" << endl;
     result =
       do_request (methods::PUT,
@@ -2224,12 +2684,9 @@ SUITE(USER_SERVER){
 
     CHECK_EQUAL(1, result.second.as_array().size());
 
-    result = 
-      do_request (methods::GET, string(addr)
-                  + read_entity_admin + "/"
-                  + string(UserFixture::table)
-                  , value::object(vector<pair<string,value>>{make_pair(string(UserFixture::update_prop), value::string(trump_line_1))})
-                  );
+    result =
+      wait_for_entities (string(addr), string(UserFixture::table),
+                         string(UserFixture::update_prop), trump_line_1, 2);
     CHECK_EQUAL(status_codes::OK, result.first);
 
     CHECK_EQUAL(2, result.second.as_array().size());
@@ -2253,12 +2710,9 @@ SUITE(USER_SERVER){
 
     CHECK_EQUAL(1, result.second.as_array().size());
 
-    result = 
-      do_request (methods::GET, string(addr)
-                  + read_entity_admin + "/"
-                  + string(UserFixture::table)
-                  , value::object(vector<pair<string,value>>{make_pair(string(UserFixture::update_prop), value::string(trump_line_1 + "\n" + trump_line_2))})
-                  );
+    result =
+      wait_for_entities (string(addr), string(UserFixture::table),
+                         string(UserFixture::update_prop), trump_line_1 + "\n" + trump_line_2, 2);
     CHECK_EQUAL(status_codes::OK, result.first);
     CHECK_EQUAL(2, result.second.as_array().size());
 
@@ -2286,12 +2740,9 @@ SUITE(USER_SERVER){
 
     CHECK_EQUAL(1, result.second.as_array().size());
 
-    result = 
-      do_request (methods::GET, string(addr)
-                  + read_entity_admin + "/"
-                  + string(UserFixture::table)
-                  , value::object(vector<pair<string,value>>{make_pair(string(UserFixture::update_prop), value::string(BakerLine1))})
-                  );
+    result =
+      wait_for_entities (string(addr), string(UserFixture::table),
+                         string(UserFixture::update_prop), BakerLine1, 1);
     CHECK_EQUAL(status_codes::OK, result.first);
     CHECK_EQUAL(1, result.second.as_array().size());
 
@@ -2354,6 +2805,16 @@ SUITE(USER_SERVER){
                   + do_something_op
                   );
     CHECK_EQUAL(status_codes::BadRequest, result.first);
+
+    cout << "Resharding takes only a shard count that fits" << endl;
+    for (const string& count : vector<string> {"0", "2x", "99"}) {
+      result = do_request (methods::POST,
+                           string(UserFixture::userserver_addr) + set_data_shards_admin + "/" + count);
+      CHECK_EQUAL(status_codes::BadRequest, result.first);
+    }
+    result = do_request (methods::POST,
+                         string(UserFixture::userserver_addr) + set_data_shards_admin + "/1");
+    CHECK_EQUAL(status_codes::OK, result.first);
   }
 }
 SUITE(PUSH_SERVER){
@@ -2473,6 +2934,75 @@ SUITE(PUSH_SERVER){
     CHECK_EQUAL(2, result.second.as_array().size());
   }
 
+  TEST_FIXTURE(UserFixture, feed){
+    cout << endl << "Ted keeps Napbook open and reads his feed" << endl;
+    const string ted_feed {string(UserFixture::push_addr)
+        + feed_op + "/"
+        + UserFixture::ted_part + "/"
+        + UserFixture::ted_row};
+
+    pair<status_code,value> result {
+      do_request (methods::GET, ted_feed + "?wait=0")};
+    CHECK_EQUAL(status_codes::NoContent, result.first);
+
+    const string trump_line_1 {"Make_America_Great_Again"};
+    const string trump_line_2 {"Ted_is_a_giant_liar"};
+    value friend_list {value::object (vector<pair<string,value>>
+                                        {make_pair(string(UserFixture::friend_prop),
+                                                   value::string(string(UserFixture::ted_part) + ";" + UserFixture::ted_row))})};
+
+    result =
+      do_request (methods::POST,
+                  string(UserFixture::push_addr)
+                  + push_status_op + "/"
+                  + UserFixture::trump_part + "/"
+                  + UserFixture::trump_row + "/"
+                  + trump_line_1
+                  , friend_list
+                  );
+    CHECK_EQUAL(status_codes::OK, result.first);
+
+    result =
+      do_request (methods::POST,
+                  string(UserFixture::push_addr)
+                  + push_status_op + "/"
+                  + UserFixture::trump_part + "/"
+                  + UserFixture::trump_row + "/"
+                  + trump_line_2
+                  , friend_list
+                  );
+    CHECK_EQUAL(status_codes::OK, result.first);
+
+    result = do_request (methods::GET, ted_feed + "?wait=0");
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK_EQUAL(trump_line_1 + "\n" + trump_line_2,
+                result.second[string(UserFixture::update_prop)].as_string());
+
+    cout << "Nothing new since his last read" << endl;
+    result = do_request (methods::GET, ted_feed + "?wait=1");
+    CHECK_EQUAL(status_codes::NoContent, result.first);
+
+    result = do_request (methods::GET, ted_feed + "?wait=soon");
+    CHECK_EQUAL(status_codes::BadRequest, result.first);
+    result = do_request (methods::GET, ted_feed + "?wait=5abc");
+    CHECK_EQUAL(status_codes::BadRequest, result.first);
+
+    cout << "His Updates hold the same statuses, read through PushServer" << endl;
+    result = do_request (methods::GET,
+                         string(UserFixture::push_addr)
+                         + updates_op + "/"
+                         + UserFixture::ted_part + "/"
+                         + UserFixture::ted_row);
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK_EQUAL(trump_line_1 + "\n" + trump_line_2,
+                result.second[string(UserFixture::update_prop)].as_string());
+
+    result = do_request (methods::GET,
+                         string(UserFixture::push_addr)
+                         + updates_op + "/Nowhere/Nobody");
+    CHECK_EQUAL(status_codes::NotFound, result.first);
+  }
+
   TEST_FIXTURE(UserFixture, PushDisallowedMethod)
   {
     cout << endl << "quick test on disallowed method for push server" << endl;
@@ -2489,7 +3019,7 @@ SUITE(PUSH_SERVER){
       do_request (methods::GET,
                 push_addr + do_something_op
     );
-    CHECK_EQUAL(status_codes::MethodNotAllowed, result.first);
+    CHECK_EQUAL(status_codes::BadRequest, result.first);
 
     result = 
       do_request (methods::PUT,
@@ -2508,8 +3038,469 @@ SUITE(PUSH_SERVER){
                   + do_something_op
                   )};
     CHECK_EQUAL(status_codes::BadRequest, result.first);
+
+    result = do_request (methods::POST,
+                         string(UserFixture::push_addr) + set_data_shards_admin + "/0");
+    CHECK_EQUAL(status_codes::BadRequest, result.first);
+    result = do_request (methods::POST,
+                         string(UserFixture::push_addr) + set_data_shards_admin + "/1");
+    CHECK_EQUAL(status_codes::OK, result.first);
   }
 
 }
+
+/*
+  The SessionServer that UserServers share through --session-store,
+  spoken to as RemoteSessionStore does
+ */
+class SessionFixture {
+public:
+  static constexpr const char* addr {"http://localhost:34576/"};
+  static constexpr const char* userid {"SessionTester"};
+  static constexpr const char* other_userid {"SessionNobody"};
+
+  const string session_op {"Session"};
+  const string lookup_op {"Lookup"};
+  const string expire_op {"Expire"};
+
+  /*
+    A session as session_to_json() sends it
+   */
+  value session_body (const string& generation) {
+    return build_json_object (vector<pair<string,string>> {
+        make_pair(string("Token"), string("sv=token")),
+        make_pair(string("Partition"), string("Canada")),
+        make_pair(string("Row"), string("Tester,Session")),
+        make_pair(string("TokenExpiry"), string("4102444800000")),
+        make_pair(string("IdleMs"), string("0")),
+        make_pair(string("Generation"), generation)});
+  }
+
+  ~SessionFixture() {
+    do_request (methods::DEL, string(addr) + sign_off_op + "/" + userid);
+  }
+};
+
+SUITE(SESSION_SERVER){
+  TEST_FIXTURE(SessionFixture, session_sign_on_and_off){
+    pair<status_code,value> result {
+      do_request (methods::PUT,
+                  string(SessionFixture::addr) + sign_on_op + "/" + SessionFixture::userid,
+                  session_body("7"))};
+    CHECK_EQUAL(status_codes::OK, result.first);
+
+    //a second sign-on keeps the first session
+    result = do_request (methods::PUT,
+                         string(SessionFixture::addr) + sign_on_op + "/" + SessionFixture::userid,
+                         session_body("8"));
+    CHECK_EQUAL(status_codes::Conflict, result.first);
+
+    result = do_request (methods::GET,
+                         string(SessionFixture::addr) + session_op + "/" + SessionFixture::userid);
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK_EQUAL(string("7"), result.second["Generation"].as_string());
+    CHECK_EQUAL(string("Canada"), result.second["Partition"].as_string());
+
+    //lookup finds only users that are signed on
+    result = do_request (methods::POST,
+                         string(SessionFixture::addr) + lookup_op,
+                         value::array(vector<value> {value::string(SessionFixture::userid),
+                                                     value::string(SessionFixture::other_userid)}));
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK(result.second.has_field(SessionFixture::userid));
+    CHECK(! result.second.has_field(SessionFixture::other_userid));
+
+    //expiring an earlier sign-on leaves the session alone
+    result = do_request (methods::DEL,
+                         string(SessionFixture::addr) + expire_op + "/" + SessionFixture::userid + "/6");
+    CHECK_EQUAL(status_codes::NotFound, result.first);
+
+    result = do_request (methods::DEL,
+                         string(SessionFixture::addr) + sign_off_op + "/" + SessionFixture::userid);
+    CHECK_EQUAL(status_codes::OK, result.first);
+    result = do_request (methods::DEL,
+                         string(SessionFixture::addr) + sign_off_op + "/" + SessionFixture::userid);
+    CHECK_EQUAL(status_codes::NotFound, result.first);
+    result = do_request (methods::GET,
+                         string(SessionFixture::addr) + session_op + "/" + SessionFixture::userid);
+    CHECK_EQUAL(status_codes::NotFound, result.first);
+  }
+
+  TEST_FIXTURE(SessionFixture, session_bad_requests){
+    pair<status_code,value> result {
+      do_request (methods::PUT,
+                  string(SessionFixture::addr) + sign_on_op + "/" + SessionFixture::userid,
+                  build_json_object(vector<pair<string,string>> {make_pair(string("Token"), string("x"))}))};
+    CHECK_EQUAL(status_codes::BadRequest, result.first);
+
+    result = do_request (methods::POST,
+                         string(SessionFixture::addr) + lookup_op,
+                         build_json_object(vector<pair<string,string>> {}));
+    CHECK_EQUAL(status_codes::BadRequest, result.first);
+  }
+}
+/*
+  The consistent-hash ring UserServer and PushServer route DataTable
+  requests with
+ */
+SUITE(SHARD_ROUTER){
+  const string shard_base {"http://localhost:34568"};
+
+  vector<string> route_rows (const ShardRouter& router, const string& country, unsigned rows) {
+    vector<string> owners {};
+    for (unsigned i = 0; i < rows; ++i)
+      owners.push_back(router.route("DataTable", country, "User" + std::to_string(i)));
+    return owners;
+  }
+
+  TEST(adding_a_shard_moves_only_its_share){
+    ShardRouter router {shard_base};
+    router.set_shards(shard_addrs(shard_base, 4));
+    const vector<string> before {route_rows(router, "Canada", 20000)};
+
+    const vector<string> five {shard_addrs(shard_base, 5)};
+    router.set_shards(five);
+    const vector<string> after {route_rows(router, "Canada", 20000)};
+    size_t moved {0};
+    for (size_t i = 0; i < before.size(); ++i)
+      if (after[i] != before[i]) {
+        ++moved;
+        //every entity that moves goes to the new shard
+        CHECK_EQUAL(five[4], after[i]);
+      }
+    //about a fifth of them
+    CHECK(moved > before.size() / 10);
+    CHECK(moved < before.size() * 3 / 10);
+
+    //and taking the shard away puts them back
+    router.set_shards(shard_addrs(shard_base, 4));
+    CHECK(before == route_rows(router, "Canada", 20000));
+  }
+
+  TEST(one_country_spreads_over_every_shard){
+    ShardRouter router {shard_base};
+    const vector<string> four {shard_addrs(shard_base, 4)};
+    router.set_shards(four);
+    const vector<string> owners {route_rows(router, "USA", 20000)};
+    for (const auto& shard : four)
+      CHECK(std::count(owners.begin(), owners.end(), shard) > 20000 / 8);
+  }
+
+  TEST(shard_counts_must_fit){
+    CHECK_THROW(shard_addrs(shard_base, 0), std::invalid_argument);
+    CHECK_THROW(shard_addrs(shard_base, "3x"), std::invalid_argument);
+    CHECK_THROW(shard_addrs(shard_base, 40), std::invalid_argument);
+    CHECK_EQUAL(2u, shard_addrs(shard_base, "2").size());
+  }
+}
+
+/*
+  When AuthServer's RefreshToken may renew a token, judged on
+  hand-made tokens so expiry and the sign-on's age can be set
+ */
+SUITE(SAS_RENEWAL){
+  const auto hour = utility::datetime::from_hours(1);
+  const uint8_t update_permissions = azure::storage::table_shared_access_policy::permissions::read |
+    azure::storage::table_shared_access_policy::permissions::update;
+
+  sas_token_t update_sas (const utility::datetime& start, const utility::datetime& expiry) {
+    sas_token_t sas {};
+    sas.table = "DataTable";
+    sas.start_partition = sas.end_partition = "USA";
+    sas.start_row = sas.end_row = "Franklin,Aretha";
+    sas.permissions = "ru";
+    sas.start = start;
+    sas.expiry = expiry;
+    sas.signature = "unchecked";
+    return sas;
+  }
+
+  TEST(renews_a_live_token){
+    const utility::datetime now {utility::datetime::utc_now()};
+    CHECK(sas_renewable(update_sas(now - hour, now + hour), "USA", "Franklin,Aretha",
+                        update_permissions, now, 24 * hour));
+  }
+
+  TEST(refuses_an_expired_token){
+    const utility::datetime now {utility::datetime::utc_now()};
+    CHECK(! sas_renewable(update_sas(now - 2 * hour, now - hour), "USA", "Franklin,Aretha",
+                          update_permissions, now, 24 * hour));
+  }
+
+  TEST(refuses_past_the_session_lifetime){
+    const utility::datetime now {utility::datetime::utc_now()};
+    CHECK(! sas_renewable(update_sas(now - 25 * hour, now + hour), "USA", "Franklin,Aretha",
+                          update_permissions, now, 24 * hour));
+    //a token without a start time cannot be dated
+    CHECK(! sas_renewable(update_sas(utility::datetime {}, now + hour), "USA", "Franklin,Aretha",
+                          update_permissions, now, 24 * hour));
+  }
+
+  TEST(refuses_another_entity_or_permission){
+    const utility::datetime now {utility::datetime::utc_now()};
+    const sas_token_t sas {update_sas(now - hour, now + hour)};
+    CHECK(! sas_renewable(sas, "Pies", "Apple", update_permissions, now, 24 * hour));
+    CHECK(! sas_renewable(sas, "USA", "Franklin,Aretha",
+                          azure::storage::table_shared_access_policy::permissions::read, now, 24 * hour));
+  }
+}
+
+/*
+  The breakers UserServer and PushServer keep for the servers they
+  call, driven directly with short windows and open times
+ */
+SUITE(CIRCUIT_BREAKER){
+  breaker_policy_t quick_policy () {
+    breaker_policy_t policy {};
+    policy.min_calls = 4;
+    policy.failure_percent = 50;
+    policy.slow_call = std::chrono::milliseconds {50};
+    policy.open_time = std::chrono::milliseconds {100};
+    return policy;
+  }
+
+  void record_calls (CircuitBreaker& breaker, unsigned count, bool success,
+                     std::chrono::milliseconds latency, const string& op) {
+    for (unsigned i = 0; i < count; ++i) {
+      bool probe {false};
+      CHECK(breaker.allow(probe));
+      breaker.record(probe, success, latency, op);
+    }
+  }
+
+  TEST(breaker_trips_and_refuses){
+    CircuitBreaker breaker {quick_policy()};
+    // Too few calls in the window to judge
+    record_calls(breaker, 3, false, std::chrono::milliseconds {1}, read_entity_auth);
+    CHECK(breaker.current_state() == CircuitBreaker::state_t::closed);
+
+    record_calls(breaker, 1, false, std::chrono::milliseconds {1}, read_entity_auth);
+    CHECK(breaker.current_state() == CircuitBreaker::state_t::open);
+
+    //open, calls are refused at once, none as a probe
+    const auto start = std::chrono::steady_clock::now();
+    bool probe {true};
+    CHECK(! breaker.allow(probe));
+    CHECK(! probe);
+    CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds {10});
+  }
+
+  TEST(breaker_half_open_probe){
+    CircuitBreaker breaker {quick_policy()};
+    record_calls(breaker, 4, false, std::chrono::milliseconds {1}, read_entity_auth);
+    CHECK(breaker.current_state() == CircuitBreaker::state_t::open);
+
+    //after open_time exactly one call goes through
+    std::this_thread::sleep_for(std::chrono::milliseconds {150});
+    bool probe {false};
+    CHECK(breaker.allow(probe));
+    CHECK(probe);
+    bool second {false};
+    CHECK(! breaker.allow(second));
+
+    //a failed probe opens it again
+    breaker.record(probe, false, std::chrono::milliseconds {1}, read_entity_auth);
+    CHECK(breaker.current_state() == CircuitBreaker::state_t::open);
+    CHECK(! breaker.allow(second));
+
+    //a good one closes it
+    std::this_thread::sleep_for(std::chrono::milliseconds {150});
+    CHECK(breaker.allow(probe));
+    CHECK(probe);
+    breaker.record(probe, true, std::chrono::milliseconds {1}, read_entity_auth);
+    CHECK(breaker.current_state() == CircuitBreaker::state_t::closed);
+    CHECK(breaker.allow(second));
+    CHECK(! second);
+  }
+
+  TEST(breaker_slow_calls_per_operation){
+    //slow reads count as failures
+    CircuitBreaker reads {quick_policy()};
+    record_calls(reads, 4, true, std::chrono::milliseconds {80}, read_entity_auth);
+    CHECK(reads.current_state() == CircuitBreaker::state_t::open);
+
+    //a PushStatus is never too slow, but can still fail
+    CircuitBreaker pushes {quick_policy()};
+    record_calls(pushes, 8, true, std::chrono::milliseconds {5000}, push_status_op);
+    CHECK(pushes.current_state() == CircuitBreaker::state_t::closed);
+    record_calls(pushes, 8, false, std::chrono::milliseconds {1}, push_status_op);
+    CHECK(pushes.current_state() == CircuitBreaker::state_t::open);
+
+    //an operation can be given its own limit
+    breaker_policy_t policy {quick_policy()};
+    CHECK(parse_breaker_option("--breaker-slow-op", read_entity_auth + "=200", policy));
+    CircuitBreaker tolerant {policy};
+    record_calls(tolerant, 4, true, std::chrono::milliseconds {80}, read_entity_auth);
+    CHECK(tolerant.current_state() == CircuitBreaker::state_t::closed);
+  }
+}
 // End of our extensions ================================================================================================================
 
+/*
+  The retries and hedged reads do_retrying_request() makes, driven
+  with attempts that fail or stall on cue
+ */
+SUITE(RESILIENCE){
+  retry_policy_t quick_retries () {
+    retry_policy_t policy {};
+    policy.max_attempts = 3;
+    policy.base_delay = std::chrono::milliseconds {1};
+    policy.max_delay = std::chrono::milliseconds {5};
+    policy.budget = std::chrono::milliseconds {1000};
+    return policy;
+  }
+
+  bool unavailable (const status_code& code) {
+    return code == status_codes::ServiceUnavailable;
+  }
+
+  bool any_error (const std::exception&) {
+    return true;
+  }
+
+  bool no_error (const std::exception&) {
+    return false;
+  }
+
+  TEST(retries_until_success){
+    unsigned calls {0};
+    const status_code result {
+      with_retries<status_code>(quick_retries(),
+                                [&calls] () {
+                                  return ++calls < 3 ? status_codes::ServiceUnavailable : status_codes::OK;
+                                },
+                                unavailable, any_error)};
+    CHECK_EQUAL(status_codes::OK, result);
+    CHECK_EQUAL(3u, calls);
+  }
+
+  TEST(gives_up_after_max_attempts){
+    unsigned calls {0};
+    const status_code result {
+      with_retries<status_code>(quick_retries(),
+                                [&calls] () { ++calls; return status_codes::ServiceUnavailable; },
+                                unavailable, any_error)};
+    CHECK_EQUAL(status_codes::ServiceUnavailable, result);
+    CHECK_EQUAL(3u, calls);
+  }
+
+  TEST(does_not_retry_lasting_failures){
+    unsigned calls {0};
+    const status_code result {
+      with_retries<status_code>(quick_retries(),
+                                [&calls] () { ++calls; return status_codes::NotFound; },
+                                unavailable, any_error)};
+    CHECK_EQUAL(status_codes::NotFound, result);
+    CHECK_EQUAL(1u, calls);
+
+    calls = 0;
+    CHECK_THROW(with_retries<status_code>(quick_retries(),
+                                          [&calls] () -> status_code {
+                                            ++calls;
+                                            throw std::runtime_error("refused");
+                                          },
+                                          unavailable, no_error),
+                std::runtime_error);
+    CHECK_EQUAL(1u, calls);
+  }
+
+  TEST(retries_exceptions_then_rethrows){
+    unsigned calls {0};
+    const status_code result {
+      with_retries<status_code>(quick_retries(),
+                                [&calls] () -> status_code {
+                                  if (++calls < 2)
+                                    throw std::runtime_error("connection reset");
+                                  return status_codes::OK;
+                                },
+                                unavailable, any_error)};
+    CHECK_EQUAL(status_codes::OK, result);
+    CHECK_EQUAL(2u, calls);
+
+    calls = 0;
+    CHECK_THROW(with_retries<status_code>(quick_retries(),
+                                          [&calls] () -> status_code {
+                                            ++calls;
+                                            throw std::runtime_error("connection reset");
+                                          },
+                                          unavailable, any_error),
+                std::runtime_error);
+    CHECK_EQUAL(3u, calls);
+  }
+
+  TEST(retries_stay_within_budget){
+    retry_policy_t policy {quick_retries()};
+    policy.max_attempts = 10;
+    policy.base_delay = std::chrono::milliseconds {50};
+    policy.max_delay = std::chrono::milliseconds {50};
+    policy.budget = std::chrono::milliseconds {80};
+    unsigned calls {0};
+    with_retries<status_code>(policy,
+                              [&calls] () { ++calls; return status_codes::ServiceUnavailable; },
+                              unavailable, any_error);
+    //a second delay of 50ms would end past the budget
+    CHECK_EQUAL(2u, calls);
+  }
+
+  /*
+    A tracker whose p95 is latency. Never destroyed, as hedged
+    attempts may outlive a test.
+   */
+  LatencyTracker& tracker_at (std::chrono::milliseconds latency) {
+    LatencyTracker& tracker {*new LatencyTracker {}};
+    for (std::size_t i = 0; i < LatencyTracker::min_samples; ++i)
+      tracker.record(latency);
+    return tracker;
+  }
+
+  TEST(hedges_a_slow_read){
+    LatencyTracker& latency {tracker_at(std::chrono::milliseconds {10})};
+    auto calls (std::make_shared<std::atomic<unsigned>>(0));
+    const auto start = std::chrono::steady_clock::now();
+    const unsigned answered_by {
+      hedged<unsigned>(latency, [calls] () {
+          const unsigned call {++*calls};
+          //the first attempt stalls well past the p95
+          if (call == 1)
+            std::this_thread::sleep_for(std::chrono::milliseconds {500});
+          return call;
+        })};
+    CHECK_EQUAL(2u, answered_by);
+    CHECK_EQUAL(2u, calls->load());
+    CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds {400});
+  }
+
+  TEST(does_not_hedge_a_fast_read){
+    LatencyTracker& latency {tracker_at(std::chrono::milliseconds {200})};
+    auto calls (std::make_shared<std::atomic<unsigned>>(0));
+    CHECK_EQUAL(1u, hedged<unsigned>(latency, [calls] () { return ++*calls; }));
+    CHECK_EQUAL(1u, calls->load());
+  }
+
+  TEST(hedge_fails_only_when_both_fail){
+    LatencyTracker& latency {tracker_at(std::chrono::milliseconds {10})};
+    auto calls (std::make_shared<std::atomic<unsigned>>(0));
+    //the first attempt fails late, the hedge succeeds
+    CHECK_EQUAL(2u, hedged<unsigned>(latency, [calls] () -> unsigned {
+          const unsigned call {++*calls};
+          if (call == 1) {
+            std::this_thread::sleep_for(std::chrono::milliseconds {100});
+            throw std::runtime_error("timed out");
+          }
+          return call;
+        }));
+
+    CHECK_THROW(hedged<unsigned>(latency, [] () -> unsigned {
+          std::this_thread::sleep_for(std::chrono::milliseconds {50});
+          throw std::runtime_error("timed out");
+        }),
+      std::runtime_error);
+  }
+
+  TEST(first_reads_are_not_hedged){
+    LatencyTracker latency {};
+    unsigned calls {0};
+    CHECK_EQUAL(1u, hedged<unsigned>(latency, [&calls] () { return ++calls; }));
+    CHECK_EQUAL(1u, calls);
+  }
+}